@@ -6,32 +6,425 @@
  * of the following two requests, either: a)display the current temperatures for RDU,
  * CLT, ALT, CHS, and RIC, or b)update the current temperature for one of the aforementioned
  * cities. Allows the user to freely disconnect and connect to the weather information server
- * via the command line.
+ * via the command line. With the "-b" option, requests are sent using the binary
+ * framing in weather_proto.h instead of text commands. Interactive requests go
+ * through the pooled client library in weather_client.h, which reconnects to the
+ * server on its own. With the "-L" option, the
+ * client instead measures the server's capacity, driving a mix of show and report
+ * requests over many connections and reporting throughput and latency percentiles.
  */
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include "weather_proto.h"
+#include "weather_client.h"
+#include "weather_hist.h"
 
 /** Maximum length for a command */
 #define MAX_CMD_LEN 128
+/** Longest wait for a reply before an interactive request is reported as failed */
+#define REPLY_TIMEOUT_MS 5000
+/** Maximum number of load generator connections */
+#define MAX_CONNS 1024
+/** Maximum requests outstanding on one load generator connection */
+#define MAX_OUTSTANDING 65536
+/** Number of seconds in an hour */
+#define SEC_IN_HOUR 3600
+
+/** Settings of a load generator run */
+struct Load_Config {
+	struct sockaddr_in addr; // server address
+	int conns; // number of connections
+	double rate; // total requests per second, or 0 for closed loop
+	int depth; // requests kept outstanding per connection in closed loop
+	double seconds; // length of the run
+	int showPercent; // percentage of requests that are shows
+	int binary; // whether to use the binary framing
+	char (*cities)[WP_CITY_LEN]; // cities to report
+	int numCities; // number of cities to report
+};
+
+/** Log-linear latency histogram in nanoseconds */
+struct Histogram {
+	uint64_t counts[HIST_BUCKETS]; // values recorded per bucket
+	uint64_t total; // number of values recorded
+	uint64_t max; // largest value recorded
+};
+
+/** State and results of one load generator connection */
+struct Load_Conn {
+	pthread_t thread; // thread driving the connection
+	int id; // index of the connection
+	const struct Load_Config *config; // settings of the run
+	uint64_t completed; // replies received
+	uint64_t errors; // error replies and failed connections
+	uint64_t skipped; // sends skipped because too many requests were outstanding
+	struct Histogram hist; // latency of each reply
+};
 
 /** 
- * Displays the prompt for the client.
+ * Displays the prompt for the client. At the end of input, the command is
+ * set to "e" to exit.
  * @param cmd the command prompt to display
  */
 void displayPrompt(char *cmd) {
 	printf(" > ");
-	scanf("%s", cmd);
+	if(scanf("%127s", cmd) != 1){
+		strcpy(cmd, "e");
+	}
 	int len = (int) strlen(cmd);
 	// Null terminate at length
 	cmd[len] = '\0';
 }
 
+/**
+ * Prints a reply. Show replies and pushes in the binary framing are printed in
+ * the same form as the text ones, requests that failed with the connection
+ * are reported as failed, and binary replies with an error status or too short
+ * for the entries they claim are reported as errors.
+ * @param arg unused
+ * @param reply the reply or push
+ */
+void printReply(void *arg, const struct wc_reply *reply)
+{
+	if(reply->status != WC_OK){
+		// The request may or may not have been applied
+		printf("Request failed\n");
+	} else if(!reply->binary){
+		printf("%s\n", reply->data);
+	} else {
+		struct wp_show show;
+		if(reply->frameStatus != WP_OK || reply->len < sizeof(show)){
+			printf("Error!\n");
+			fflush(stdout);
+			return;
+		}
+		memcpy(&show, reply->data, sizeof(show));
+		if(reply->len < sizeof(show) + (size_t) ntohl(show.count) * sizeof(struct wp_show_entry)){
+			printf("Error!\n");
+			fflush(stdout);
+			return;
+		}
+		for(uint32_t i = 0; i < ntohl(show.count); i++){
+			struct wp_show_entry entry;
+			memcpy(&entry, reply->data + sizeof(show) + i * sizeof(entry), sizeof(entry));
+			printf("%.*s %u\t", WP_CITY_LEN, entry.city, ntohs(entry.temperature));
+		}
+		printf("\n");
+	}
+	fflush(stdout);
+}
+
+/**
+ * Builds the binary request for a show or report command.
+ * @param cmd the command entered by the user
+ * @param report receives the payload of a report
+ * @return the request opcode
+ */
+int binaryRequest(char *cmd, struct wp_report *report)
+{
+	if(cmd[0] == 's' || cmd[0] == 'S'){
+		return WP_SHOW;
+	}
+	// Parse the report locally into fixed-width fields
+	char *save;
+	char *token;
+	memset(report, 0, sizeof(*report));
+	strtok_r(cmd, ":", &save);
+	if((token = strtok_r(NULL, ":", &save)) != NULL){
+		strncpy(report->city, token, WP_CITY_LEN);
+	}
+	report->hourstamp = htons((token = strtok_r(NULL, ":", &save)) ? (uint16_t) atoi(token) : 25);
+	report->temperature = htons((token = strtok_r(NULL, ":", &save)) ? (uint16_t) atoi(token) : 0);
+	return WP_REPORT;
+}
+
+/**
+ * Records a value in a histogram.
+ * @param hist the histogram
+ * @param value the value to record
+ */
+void histRecord(struct Histogram *hist, uint64_t value)
+{
+	hist->counts[histBucket(value)]++;
+	hist->total++;
+	if(value > hist->max){
+		hist->max = value;
+	}
+}
+
+/**
+ * Returns the current hour the way the server checks hourstamps.
+ * @return the current hour
+ */
+unsigned short currentHour(void)
+{
+	return (unsigned short) (time(NULL) / SEC_IN_HOUR % 24 - 5);
+}
+
+/**
+ * Encodes the next request of a load generator connection.
+ * @param config the settings of the run
+ * @param seed the connection's random state
+ * @param buf receives the request
+ * @return the length of the request
+ */
+int encodeRequest(const struct Load_Config *config, unsigned int *seed, char *buf)
+{
+	int show = (int) (rand_r(seed) % 100) < config->showPercent;
+	const char *city = config->cities[rand_r(seed) % config->numCities];
+	unsigned short temp = (unsigned short) (rand_r(seed) % 110);
+	if(!config->binary){
+		if(show){
+			return (int) strlen(strcpy(buf, "s")) + 1;
+		}
+		return sprintf(buf, "r:%.*s:%u:%u", WP_CITY_LEN, city, currentHour(), temp) + 1;
+	}
+	struct wp_header header = { WP_MAGIC, WP_VERSION, show ? WP_SHOW : WP_REPORT, 0, 0 };
+	if(show){
+		memcpy(buf, &header, WP_HEADER_LEN);
+		return WP_HEADER_LEN;
+	}
+	struct wp_report report;
+	memcpy(report.city, city, WP_CITY_LEN);
+	report.hourstamp = htons(currentHour());
+	report.temperature = htons(temp);
+	header.length = htonl(sizeof(report));
+	memcpy(buf, &header, WP_HEADER_LEN);
+	memcpy(buf + WP_HEADER_LEN, &report, sizeof(report));
+	return WP_HEADER_LEN + sizeof(report);
+}
+
+/**
+ * Consumes every complete reply in a load generator connection's receive buffer.
+ * A text reply is an error if it starts with "Error"; a binary reply is an error
+ * if its status is not WP_OK.
+ * @param lc the load generator connection
+ * @param buf the receive buffer
+ * @param len the bytes in the buffer
+ * @param sent send time of each outstanding request, as a ring
+ * @param head index of the oldest outstanding request in sent
+ * @param outstanding number of outstanding requests
+ * @return the number of bytes consumed
+ */
+size_t consumeReplies(struct Load_Conn *lc, const char *buf, size_t len, const uint64_t *sent, unsigned int *head,
+                      unsigned int *outstanding)
+{
+	size_t pos = 0;
+	uint64_t now = nowNanos();
+	while(pos < len && *outstanding > 0){
+		size_t replyLen;
+		int error;
+		if(lc->config->binary){
+			struct wp_header header;
+			if(len - pos < WP_HEADER_LEN){
+				break;
+			}
+			memcpy(&header, buf + pos, WP_HEADER_LEN);
+			replyLen = WP_HEADER_LEN + ntohl(header.length);
+			if(len - pos < replyLen){
+				break;
+			}
+			error = header.status != WP_OK;
+		} else {
+			const char *end = memchr(buf + pos, '\0', len - pos);
+			if(end == NULL){
+				break;
+			}
+			replyLen = end - (buf + pos) + 1;
+			error = strncmp(buf + pos, "Error", 5) == 0;
+		}
+		histRecord(&lc->hist, now - sent[*head]);
+		*head = (*head + 1) % MAX_OUTSTANDING;
+		(*outstanding)--;
+		lc->completed++;
+		lc->errors += error;
+		pos += replyLen;
+	}
+	return pos;
+}
+
+/**
+ * Drives one load generator connection. In open loop, requests are sent on a
+ * fixed schedule regardless of replies, and latency is measured from when each
+ * request was scheduled, so a stalled server is charged for the requests that
+ * queue up behind it. In closed loop, a fixed number of requests is kept
+ * outstanding.
+ * @param args the load generator connection
+ */
+void *loadMain(void *args)
+{
+	struct Load_Conn *lc = args;
+	const struct Load_Config *config = lc->config;
+	unsigned int seed = (unsigned int) nowNanos() ^ (unsigned int) lc->id;
+	uint64_t *sent = malloc(MAX_OUTSTANDING * sizeof(uint64_t));
+	size_t bufCap = 1 << 16;
+	char *buf = malloc(bufCap);
+	size_t bufLen = 0;
+	char req[WP_HEADER_LEN + MAX_CMD_LEN];
+	unsigned int head = 0;
+	unsigned int outstanding = 0;
+
+	int sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	int one = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if(connect(sock, (const struct sockaddr *) &config->addr, sizeof(config->addr)) < 0){
+		lc->errors++;
+		close(sock);
+		free(sent);
+		free(buf);
+		return NULL;
+	}
+
+	double interval = config->rate > 0 ? 1e9 * config->conns / config->rate : 0;
+	uint64_t start = nowNanos();
+	uint64_t end = start + (uint64_t) (config->seconds * 1e9);
+	// Stagger the schedules of the connections across one interval
+	double nextSend = start + interval * lc->id / config->conns;
+	while(1){
+		uint64_t now = nowNanos();
+		if(now >= end && outstanding == 0){
+			break;
+		}
+		// Send every request that is due
+		while(now < end && (interval > 0 ? nextSend <= now : outstanding < (unsigned int) config->depth)){
+			uint64_t due = interval > 0 ? (uint64_t) nextSend : now;
+			nextSend += interval;
+			if(outstanding == MAX_OUTSTANDING){
+				lc->skipped++;
+				continue;
+			}
+			int len = encodeRequest(config, &seed, req);
+			if(send(sock, req, len, 0) != len){
+				lc->errors++;
+				goto done;
+			}
+			sent[(head + outstanding) % MAX_OUTSTANDING] = due;
+			outstanding++;
+		}
+
+		// Wait for replies until the next request is due
+		int timeout = 100;
+		if(interval > 0 && now < end){
+			timeout = nextSend > now ? (int) ((nextSend - now) / 1e6) : 0;
+		}
+		struct pollfd pfd = { sock, POLLIN, 0 };
+		if(poll(&pfd, 1, timeout) < 0 && errno != EINTR){
+			break;
+		}
+		if(pfd.revents & (POLLIN | POLLHUP | POLLERR)){
+			if(bufLen == bufCap){
+				bufCap *= 2;
+				buf = realloc(buf, bufCap);
+			}
+			ssize_t n = recv(sock, buf + bufLen, bufCap - bufLen, 0);
+			if(n <= 0){
+				lc->errors += outstanding;
+				break;
+			}
+			bufLen += n;
+			size_t used = consumeReplies(lc, buf, bufLen, sent, &head, &outstanding);
+			memmove(buf, buf + used, bufLen - used);
+			bufLen -= used;
+		}
+		// Give up on replies that do not arrive within a second of the end
+		if(now >= end + 1000000000ull){
+			lc->errors += outstanding;
+			break;
+		}
+	}
+done:
+	close(sock);
+	free(sent);
+	free(buf);
+	return NULL;
+}
+
+/**
+ * Runs the load generator and prints throughput, errors, and latency percentiles.
+ * @param config the settings of the run
+ */
+void runLoad(const struct Load_Config *config)
+{
+	struct Load_Conn *conns = calloc(config->conns, sizeof(struct Load_Conn));
+	struct Histogram *total = calloc(1, sizeof(struct Histogram));
+	uint64_t completed = 0;
+	uint64_t errors = 0;
+	uint64_t skipped = 0;
+
+	printf("%d connections, %s, %d%% show, %s protocol, %.1f s\n", config->conns,
+	       config->rate > 0 ? "open loop" : "closed loop", config->showPercent, config->binary ? "binary" : "text",
+	       config->seconds);
+	if(config->rate > 0){
+		printf("Target rate: %.0f requests/s\n", config->rate);
+	} else {
+		printf("Outstanding requests per connection: %d\n", config->depth);
+	}
+	uint64_t start = nowNanos();
+	for(int i = 0; i < config->conns; i++){
+		conns[i].id = i;
+		conns[i].config = config;
+		if(pthread_create(&conns[i].thread, NULL, loadMain, &conns[i]) != 0){
+			printf("Error creating thread\n");
+			exit(1);
+		}
+	}
+	for(int i = 0; i < config->conns; i++){
+		pthread_join(conns[i].thread, NULL);
+		completed += conns[i].completed;
+		errors += conns[i].errors;
+		skipped += conns[i].skipped;
+		for(int b = 0; b < HIST_BUCKETS; b++){
+			total->counts[b] += conns[i].hist.counts[b];
+		}
+		total->total += conns[i].hist.total;
+		if(conns[i].hist.max > total->max){
+			total->max = conns[i].hist.max;
+		}
+	}
+	double elapsed = (nowNanos() - start) / 1e9;
+
+	printf("Completed: %llu requests in %.2f s (%.0f requests/s)\n", (unsigned long long) completed, elapsed,
+	       completed / elapsed);
+	printf("Errors: %llu, skipped sends: %llu\n", (unsigned long long) errors, (unsigned long long) skipped);
+	if(total->total > 0){
+		printf("Latency (us): p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+		       histPercentile(total->counts, total->total, 50) / 1e3, histPercentile(total->counts, total->total, 90) / 1e3,
+		       histPercentile(total->counts, total->total, 99) / 1e3, histPercentile(total->counts, total->total, 99.9) / 1e3,
+		       total->max / 1e3);
+	}
+	free(total);
+	free(conns);
+}
+
+/**
+ * Parses a comma separated list of cities to report.
+ * @param list the list
+ * @param config the settings receiving the cities
+ */
+void parseCities(char *list, struct Load_Config *config)
+{
+	char *save;
+	config->numCities = 0;
+	for(char *city = strtok_r(list, ",", &save); city != NULL; city = strtok_r(NULL, ",", &save)){
+		config->cities = realloc(config->cities, (config->numCities + 1) * sizeof(*config->cities));
+		memset(config->cities[config->numCities], 0, WP_CITY_LEN);
+		strncpy(config->cities[config->numCities++], city, WP_CITY_LEN - 1);
+	}
+}
+
 /**
  * Main method for client program. Initiates connection with server and decides
  * to either a)request weather information, or b)update weather information for
@@ -41,36 +434,79 @@ void displayPrompt(char *cmd) {
  * @param argv arry of command line arguments
  */
 int main(int argc, char * argv[]) {
+	/** Whether to use the binary framing */
+	int binary = 0;
+	/** Whether to run the load generator */
+	int load = 0;
+	/** Settings of the load generator */
+	struct Load_Config config = { .conns = 4, .depth = 1, .seconds = 10, .showPercent = 90 };
+	char defaultCities[] = "RDU,CLT,ALT,CHS,RIC";
+	int opt;
+	while((opt = getopt(argc, argv, "bLc:r:p:d:m:C:")) != -1){
+		switch(opt){
+			case 'b': binary = 1; break;
+			case 'L': load = 1; break;
+			case 'c': config.conns = atoi(optarg); break;
+			case 'r': config.rate = atof(optarg); break;
+			case 'p': config.depth = atoi(optarg); break;
+			case 'd': config.seconds = atof(optarg); break;
+			case 'm': config.showPercent = atoi(optarg); break;
+			case 'C': parseCities(optarg, &config); break;
+			default: argc = 0;
+		}
+	}
 	// Ensure correct program usage
-	if (argc != 3) {
-		printf("Usage: ./client <ip> <port>\n");
+	if (argc - optind != 2 || config.conns < 1 || config.conns > MAX_CONNS || config.depth < 1
+	    || config.depth > MAX_OUTSTANDING || config.showPercent < 0 || config.showPercent > 100 || config.seconds <= 0) {
+		printf("Usage: ./client [-b] <ip> <port>\n");
+		printf("       ./client -L [-b] [-c conns] [-r rate | -p depth] [-d secs] [-m show%%] [-C city,...] <ip> <port>\n");
 		exit(1);
 	}
-	/** The socket id */
-	int sockID;
-	/** Struct representing local address port */
-	struct sockaddr_in addrport;
-	// Create socket
-	if((sockID = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1){
-		printf("socket() failed\n");
+	argv += optind - 1;
+	if(load){
+		if(config.numCities == 0){
+			parseCities(defaultCities, &config);
+		}
+		config.binary = binary;
+		config.addr.sin_family = AF_INET;
+		config.addr.sin_port = htons((unsigned short) atoi(argv[2]));
+		config.addr.sin_addr.s_addr = inet_addr(argv[1]);
+		runLoad(&config);
+		free(config.cities);
+		return EXIT_SUCCESS;
+	}
+	// The server is reached through a pool of one connection, which
+	// reconnects on its own if the server goes away
+	struct wc_config poolConfig = { .host = argv[1], .port = (unsigned short) atoi(argv[2]) };
+	struct wc_pool *pool = wcOpen(&poolConfig);
+	if(pool == NULL){
+		printf("Invalid server address\n");
 		exit(1);
 	}
-	
-	// Prepare the net address
-	addrport.sin_family = AF_INET;
-	addrport.sin_port = htons((unsigned short) atoi(argv[2]));
-	addrport.sin_addr.s_addr = inet_addr(argv[1]);
-	// Connect to the server
-	int status = connect(sockID, (struct sockaddr *) &addrport, sizeof(addrport));
-	
+	/** Messages for each reply status */
+	static const char *statuses[] = { "Successfully report temperature!", "Error city code!", "Error hourstamp!",
+	                                  "Malformed report!", "Unsupported version!", "Unsupported command!",
+	                                  "Error read-only replica!" };
 	/** Buffer for a command */
 	char rcvBuf[MAX_CMD_LEN];
-	/** Length of command */
-	int cmdLen;
-	/** Option flags */
-	int flags = 0;
-	/** Count to determine send() and receive() errors */
-	int count;
+	/** Reply to the current command */
+	struct wc_future *future;
+	const struct wc_reply *reply;
+	
+	// Agree on a protocol version before sending binary frames
+	if(binary){
+		future = wcRequestFrame(pool, WP_HELLO, NULL, 0);
+		reply = wcWait(pool, future, REPLY_TIMEOUT_MS);
+		if(reply == NULL){
+			printf("Request failed\n");
+			exit(1);
+		}
+		if(reply->status != WC_OK || reply->frameStatus != WP_OK){
+			printf("Server does not support the binary protocol\n");
+			exit(1);
+		}
+		wcFutureFree(future);
+	}
 	
 	//Start of while loop
 	while(1){
@@ -81,22 +517,41 @@ int main(int argc, char * argv[]) {
 			// Break and exit the program
 			break;
 		}else if(rcvBuf[0] == 'r' || rcvBuf[0] == 'R' || strcmp(rcvBuf, "s") == 0
-						 || strcmp(rcvBuf, "S") == 0){ //starts with "r" or "R"
+						 || strcmp(rcvBuf, "S") == 0 || ((rcvBuf[0] == 'b' || rcvBuf[0] == 'B' || rcvBuf[0] == 'h' || rcvBuf[0] == 'H'
+						 || rcvBuf[0] == 'w' || rcvBuf[0] == 'W' || strcmp(rcvBuf, "stats") == 0) && !binary)){ //starts with "r" or "R"
 			// Request "report" and send data to report -> errors are handled server side,
 			// BUT printed by the client!
-			cmdLen = (int) strlen(rcvBuf) + 1;
-			// Send the request and handle failure
-			if((count = send(sockID, rcvBuf, cmdLen, flags)) < 0){
-				printf("send() error\n");
+			// After subscribing, print the reply and pushed changes as they
+			// arrive; the pool subscribes again whenever it reconnects
+			if(!binary && (rcvBuf[0] == 'w' || rcvBuf[0] == 'W')){
+				wcOnPush(pool, printReply, NULL);
+				wcSendText(pool, rcvBuf, printReply, NULL);
+				while(wcPoll(pool, -1) >= 0){
+				}
+				break;
 			}
-			// Clear out space for incoming message
-			memset(rcvBuf, 0, MAX_CMD_LEN);
-			
-			if((count = recv(sockID, (void *) rcvBuf, sizeof(rcvBuf), flags)) < 0){
-				printf("recv() failed\n");
+			if(binary){
+				struct wp_report report;
+				int opcode = binaryRequest(rcvBuf, &report);
+				future = wcRequestFrame(pool, opcode, &report, opcode == WP_REPORT ? sizeof(report) : 0);
+			} else {
+				future = wcRequestText(pool, rcvBuf);
 			}
-			// Print the returned report status (either sucess or failure)
-			printf("%s\n", rcvBuf);
+			// Give up on a server that does not answer, as the pool would retry forever
+			reply = wcWait(pool, future, REPLY_TIMEOUT_MS);
+			if(reply == NULL){
+				printf("Request failed\n");
+				wcFutureFree(future);
+				break;
+			}
+			if(reply->binary && reply->status == WC_OK && reply->opcode == WP_REPORT){
+				printf("%s\n", reply->frameStatus < sizeof(statuses) / sizeof(statuses[0])
+				                ? statuses[reply->frameStatus] : "Error!");
+			} else {
+				// Print the returned report status (either sucess or failure)
+				printReply(NULL, reply);
+			}
+			wcFutureFree(future);
 			
 		} else {
 			printf("Invalid action\n");
@@ -105,10 +560,8 @@ int main(int argc, char * argv[]) {
 		memset(rcvBuf, 0, MAX_CMD_LEN);
 	}
 	
-	// Close the client socket
-	if((status = close(sockID)) < 0){
-		printf("Failed to close socket\n");
-	}
+	// Close the connection to the server
+	wcClose(pool);
 
 	// Return exit success
 	return EXIT_SUCCESS;
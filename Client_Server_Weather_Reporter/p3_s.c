@@ -10,33 +10,309 @@
  * the first temperature reported is assigned.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <endian.h>
+#include <time.h>
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <pthread.h>
-#include <sys/time.h>
 #include <math.h>
+#include "weather_proto.h"
+#include "weather_hist.h"
 
 /** Maximum pending connections */
 #define MAXPENDING 5
 /** Maximum data length for a message */
 #define MAX_DATA_LEN 128
-/** Number of cities handled by the server */
-#define NUM_CITIES 5
+/** Maximum length of a city (station) code */
+#define MAX_CITY_LEN 7
+/** Space needed to show one city: code, separator, temperature, and tab */
+#define SHOW_ENTRY_LEN (MAX_CITY_LEN + 8)
+/** Default file listing the cities handled by the server */
+#define CITY_FILE "cities.txt"
 /** Number of seconds in an hour */
 #define SEC_IN_HOUR 3600
+/** Size of a connection's receive buffer, enough for the largest frame */
+#define IN_BUF_LEN (WP_HEADER_LEN + WP_MAX_PAYLOAD)
+/** Size of the buffer holding a connection's small replies */
+#define OUT_BUF_LEN 16384
+/** Maximum replies coalesced into one writev() */
+#define MAX_IOV 64
+/** Maximum reports in a batch */
+#define MAX_BATCH WP_MAX_BATCH
+/** Hourly aggregates kept per city (one week) */
+#define HISTORY_HOURS 168
+/** Daily aggregates kept per city */
+#define HISTORY_DAYS 90
+/** Weekly aggregates kept per city */
+#define HISTORY_WEEKS 52
+/** Number of hours in a day and in a week */
+#define HOURS_IN_DAY 24
+#define HOURS_IN_WEEK 168
+/** Longest range of hours a history query may cover */
+#define MAX_HISTORY_RANGE ((HISTORY_WEEKS - 1) * HOURS_IN_WEEK)
+/** Identifies a checkpoint file ("WCKP") */
+#define CHECKPOINT_MAGIC 0x57434B50u
+/** Format version of checkpoint files; version 2 adds city history */
+#define CHECKPOINT_VERSION 2
+/** Default number of seconds between checkpoints */
+#define CHECKPOINT_INTERVAL 60
+/** Maximum length of a path in the data directory */
+#define MAX_PATH_LEN 4096
+/** Milliseconds between pushes of changed temperatures to subscribers */
+#define PUSH_TICK_MS 50
+/** Most recent log records kept in memory for replicas (a power of two) */
+#define REPL_RING_LEN 65536
+/** Most records sent in one updates frame */
+#define REPL_BATCH 1024
+/** Milliseconds between heartbeats sent to an idle replica */
+#define REPL_HEARTBEAT_MS 100
+/** Seconds a replica waits for a frame before reconnecting to the primary */
+#define REPL_TIMEOUT 2
+/** Datagrams received by one recvmmsg() call */
+#define UDP_BATCH 64
+/** Largest datagram accepted; larger ones are truncated and counted as malformed */
+#define UDP_DATAGRAM_LEN 2048
+/** Receive buffer requested for the UDP socket, to absorb bursts */
+#define UDP_RCVBUF (4 * 1024 * 1024)
+/** Entries in each thread's log ring (a power of two) */
+#define LOG_RING_SLOTS 1024
+/** Longest log message kept; longer ones are truncated */
+#define LOG_MSG_LEN 118
+/** Milliseconds the log drainer sleeps once every ring is empty */
+#define LOG_DRAIN_MS 10
+
+/** Log levels, from most to least verbose */
+enum Log_Level { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR };
+
+/** Writes a string literal to the log, copying it without formatting */
+#define LOG_TEXT(level, text) logWrite(level, text, sizeof(text) - 1)
 
 /** Temperature data struct */
 struct Temp_Data {
-	char city[4]; // city postal code
+	char city[MAX_CITY_LEN + 1]; // city postal code
 	unsigned short temperature; // current temperature
 	unsigned short hourstamp; // current hour
+	uint32_t epochHour; // hour since the Unix epoch that count and sumTemps cover, or 0 if unknown
 	unsigned long count; // number of temperatures reported for the hour
 	unsigned long sumTemps; // Sum of all temps for the hour
+	uint64_t lsn; // log sequence number of the last report applied
+	unsigned long changes; // number of times the temperature has changed
+	pthread_mutex_t lock; // guards this city's data
+};
+
+/** Record appended to the write-ahead log for each accepted report */
+struct Wal_Record {
+	uint64_t lsn; // log sequence number, increasing by one per record
+	char city[MAX_CITY_LEN + 1]; // city reported
+	uint32_t epochHour; // hours since the Unix epoch when recorded
+	uint16_t hourstamp; // hour of the report
+	uint16_t temperature; // reported temperature
+	uint32_t reserved; // zero
+	uint32_t checksum; // hash of the preceding fields
+};
+
+/** Write-ahead log shared by all client threads */
+struct Wal {
+	int enabled; // whether reports are logged
+	int syncCommit; // whether replies wait for their reports to be durable
+	int fd; // current segment
+	int rotateRequested; // whether the writer should start a new segment
+	unsigned long rotations; // number of segments closed
+	uint64_t nextLsn; // number of the next record appended
+	uint64_t durableLsn; // every record up to this one is on disk
+	uint64_t rotatedLsn; // last record of the segment most recently closed
+	int replicate; // whether records are kept in ring for replicas
+	struct Wal_Record *ring; // the last REPL_RING_LEN records, indexed by log sequence number
+	char *pending; // records appended but not yet written
+	size_t pendingLen; // bytes used in pending
+	size_t pendingCap; // capacity of pending
+	pthread_mutex_t lock; // guards all of the above
+	pthread_cond_t work; // signalled when the writer has work
+	pthread_cond_t flushed; // signalled when durableLsn or rotatedLsn advances
+	pthread_cond_t appended; // broadcast when records are added to ring
+};
+
+/** Replication progress, shown in the statistics */
+struct Replication {
+	uint64_t epoch; // random identity of this primary's run, or of the run of the primary this
+	                // replica last received a whole state from; 0 if none
+	unsigned long replicas; // replicas streaming from this primary
+	uint64_t streamed; // records sent to replicas
+	uint64_t states; // whole states sent to replicas, or received from the primary
+	int connected; // whether this replica is streaming from its primary
+	uint64_t applied; // last log position this replica applied
+	uint64_t head; // last log position on the primary, as of its latest frame
+	uint64_t received; // records this replica received
+	uint64_t lastFrame; // monotonic time in nanoseconds of the latest frame from the primary
+	uint64_t rate; // records received per second, over the last second
+};
+
+/**
+ * Header of a checkpoint file, followed by one Checkpoint_Record per city and,
+ * from version 2, one struct History per city in the same order
+ */
+struct Checkpoint_Header {
+	uint32_t magic; // CHECKPOINT_MAGIC
+	uint32_t version; // CHECKPOINT_VERSION
+	uint64_t lsn; // every record up to this one is reflected in the checkpoint
+	uint32_t count; // number of city records that follow
+	uint32_t checksum; // hash of the city records
+};
+
+/** State of one city in a checkpoint file */
+struct Checkpoint_Record {
+	char city[MAX_CITY_LEN + 1]; // city code
+	uint64_t lsn; // last report applied to the city
+	uint64_t count; // number of temperatures reported for the hour
+	uint64_t sumTemps; // sum of all temps for the hour
+	uint16_t temperature; // current temperature
+	uint16_t hourstamp; // current hour
+	uint32_t epochHour; // hour since the Unix epoch that count and sumTemps cover, or 0 if unknown
+};
+
+/** Aggregate of the temperatures reported during one period */
+struct Aggregate {
+	uint32_t period; // hour, day, or week since the Unix epoch the aggregate covers
+	uint32_t count; // number of temperatures reported, or 0 if the slot is empty
+	uint64_t sum; // sum of the temperatures reported
+	uint16_t min; // lowest temperature reported
+	uint16_t max; // highest temperature reported
+	uint32_t reserved; // zero
+};
+
+/**
+ * Reporting history of one city. Each ring holds the most recent periods of its
+ * length, indexed by period modulo the ring size, and all three are updated by
+ * every report, so a range query only combines precomputed aggregates.
+ */
+struct History {
+	struct Aggregate hours[HISTORY_HOURS]; // hourly aggregates
+	struct Aggregate days[HISTORY_DAYS]; // daily rollups
+	struct Aggregate weeks[HISTORY_WEEKS]; // weekly rollups
+};
+
+/** One report in a batch, tagged with its position so replies stay in order */
+struct Batch_Item {
+	struct Temp_Data *entry; // city being reported
+	int index; // position of the report in the batch
+	unsigned short temperature; // reported temperature
+};
+
+/** Pre-rendered reply for the show command, shared by all readers */
+struct Snapshot {
+	unsigned long version; // state version the snapshot was rendered from
+	int refs; // references held by readers, plus one while published
+	int len; // length of the text, including its terminating null character
+	int binLen; // length of the binary show reply frame
+	char *bin; // binary show reply frame, stored after the text
+	char text[]; // temperature of each city
+};
+
+/** State of one client connection */
+struct Connection {
+	int sock; // client socket
+	int version; // negotiated binary protocol version
+	size_t inLen; // bytes waiting to be parsed in in
+	int skipping; // whether the rest of a text request cut at MAX_DATA_LEN - 1 is being discarded
+	size_t outLen; // bytes of out used by queued replies
+	int iovCount; // replies queued in iov
+	int heldCount; // snapshots referenced by queued replies
+	uint64_t commitLsn; // last log record that must be durable before replies are sent
+	int replica; // whether the client asked to follow this server as a replica
+	uint64_t replicaFrom; // last log record the replica applied
+	uint64_t replicaEpoch; // run of this primary that numbered replicaFrom, as the replica knows it
+	int eventFd; // signalled when subscribed cities change, or -1 if not subscribed
+	int binaryPush; // whether pushes are sent as binary frames
+	int *subscribed; // cities subscribed to, as indexes into temp_array
+	int subCount; // number of cities subscribed to
+	int *dirty; // subscribed cities changed since the last push
+	int dirtyCount; // number of cities in dirty
+	unsigned char *isDirty; // whether each city is in dirty, indexed like temp_array
+	pthread_mutex_t pushLock; // guards dirty, dirtyCount, and isDirty
+	struct iovec iov[MAX_IOV]; // queued replies, sent with one writev()
+	struct Snapshot *held[MAX_IOV]; // snapshots to release once sent
+	struct Batch_Item batch[MAX_BATCH]; // valid reports of the batch being applied
+	uint8_t statuses[sizeof(uint32_t) + MAX_BATCH]; // per-report statuses of a batch reply
+	char in[IN_BUF_LEN]; // received requests
+	char out[OUT_BUF_LEN]; // copies of small replies
+};
+
+/** Kinds of request counted by the server statistics */
+enum Request_Type { REQ_SHOW, REQ_REPORT, REQ_BATCH, REQ_HISTORY, REQ_SUBSCRIBE, REQ_HELLO, REQ_STATS, REQ_OTHER, NUM_REQ_TYPES };
+
+/** Names of each enum Request_Type */
+static const char *request_names[] = { "show", "report", "batch", "history", "subscribe", "hello", "stats", "other" };
+
+/**
+ * Counters of one thread. Only the owning thread writes them, with plain relaxed
+ * stores, so counting needs no locks or atomic read-modify-write instructions;
+ * readers sum every thread's counters on demand.
+ */
+struct Thread_Stats {
+	struct Thread_Stats *next; // next block in the list of all blocks
+	int inUse; // whether a live thread owns the block
+	uint64_t connections; // connections accepted
+	uint64_t closed; // connections closed
+	uint64_t requests[NUM_REQ_TYPES]; // requests of each type
+	uint64_t reports; // reports submitted, including those in batches
+	uint64_t cityErrors; // reports rejected for an invalid city
+	uint64_t hourErrors; // reports rejected for an invalid hourstamp
+	uint64_t malformed; // malformed requests
+	uint64_t bytesIn; // bytes received
+	uint64_t bytesOut; // bytes sent
+	uint64_t pushes; // pushes sent to subscribers
+	uint64_t datagrams; // UDP datagrams received
+	uint64_t dropped; // UDP datagrams dropped by the kernel for lack of buffer space
+	uint64_t serviceTime[NUM_REQ_TYPES][HIST_BUCKETS]; // service time histogram of each type, in nanoseconds
+};
+
+/** One message in a log ring */
+struct Log_Entry {
+	uint8_t level; // enum Log_Level of the message
+	uint8_t len; // length of the message
+	char msg[LOG_MSG_LEN]; // the message, without a newline or null character
+};
+
+/**
+ * Log messages of one thread. The owning thread is the only producer and the
+ * drainer the only consumer, so head and tail are each written by one side and
+ * the ring needs no locks. Messages are dropped, and counted, while it is full.
+ */
+struct Log_Ring {
+	struct Log_Ring *next; // next ring in the list of all rings
+	int inUse; // whether a live thread owns the ring
+	uint64_t head; // entries written, advanced by the producer
+	uint64_t tail; // entries drained, advanced by the drainer
+	uint64_t dropped; // entries dropped on a full ring, written by the producer
+	uint64_t reported; // dropped entries already reported, written by the drainer
+	struct Log_Entry entries[LOG_RING_SLOTS]; // the messages
+};
+
+/** Connections subscribed to one city */
+struct Subscriber_List {
+	struct Connection **conns; // subscribed connections
+	int count; // number of subscribed connections
+	int cap; // capacity of conns
 };
 
 /** Arguments for thread creation */
@@ -44,251 +320,2618 @@ struct ThreadArgs{
 	int clntSock; // client socket
 };
 
-/** Array of temperature data */
-struct Temp_Data temp_array[5];
-/** Lock for synchronization */
-pthread_mutex_t lock;
+/** Text replies to a report, indexed by enum WP_STATUS */
+static const char *report_replies[] = { [WP_OK] = "Successfully report temperature!", [WP_ERR_CITY] = "Error city code!",
+                                        [WP_ERR_HOUR] = "Error hourstamp!", [WP_ERR_READONLY] = "Error read-only replica!" };
+
+/** Cities used when no city file is present */
+static const char *default_cities[] = { "RDU", "CLT", "ALT", "CHS", "RIC" };
+
+/** Array of temperature data, one entry per city in file order */
+struct Temp_Data *temp_array;
+/** Reporting history of each city, parallel to temp_array and guarded by its locks */
+struct History *history_array;
+/** Number of cities handled by the server */
+int num_cities;
+/** Open-addressing index into temp_array. Each slot holds an index + 1, or 0 if empty */
+int *city_index;
+/** Mask for probing city_index (its capacity is a power of two) */
+unsigned int index_mask;
+/** Incremented each time a report changes a city's temperature; shared by every worker */
+unsigned long *state_version;
+/** Number of worker processes sharing the city table, or 0 to serve from this process */
+int num_workers;
+/** Name of the shared memory segment holding the city table, if workers share it */
+char shm_name[64];
+/** Most recently published snapshot */
+struct Snapshot *current_snapshot;
+/** Lock held only while the published snapshot is swapped or referenced */
+pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Lock serializing snapshot rebuilds */
+pthread_mutex_t rebuild_lock = PTHREAD_MUTEX_INITIALIZER;
+/** List of every thread's statistics, including blocks of exited threads */
+struct Thread_Stats *all_stats;
+/** Guards adding blocks to all_stats and claiming free ones */
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Statistics of the calling thread */
+__thread struct Thread_Stats *my_stats;
+/**
+ * Current hour, published by the clock thread: the hour since the Unix epoch in
+ * the upper bits and the hour of the day in EST in the low 16 bits, so both are
+ * read together with one load
+ */
+uint64_t server_clock;
+/** Seconds between statistics dumps, or 0 to not dump them */
+int stats_interval;
+/** List of every thread's log ring, including rings of exited threads */
+struct Log_Ring *all_logs;
+/** Guards adding rings to all_logs and claiming free ones */
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Log ring of the calling thread */
+__thread struct Log_Ring *my_log;
+/** Least severe level written to the log */
+int log_level = LOG_INFO;
+/** Names of each enum Log_Level, as printed before their messages */
+static const char *log_names[] = { "debug: ", "", "warning: ", "error: " };
+/** Subscribers of each city, indexed like temp_array */
+struct Subscriber_List *subscribers;
+/** Guards subscribers; writers add and remove subscriptions, the notifier reads */
+pthread_rwlock_t subs_lock = PTHREAD_RWLOCK_INITIALIZER;
+/** Write-ahead log of accepted reports */
+struct Wal wal = { .lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER, .flushed = PTHREAD_COND_INITIALIZER,
+                   .appended = PTHREAD_COND_INITIALIZER, .fd = -1, .syncCommit = 1, .nextLsn = 1 };
+/** Replication progress */
+struct Replication replication;
+/** Address of the primary this server replicates, or NULL if it is not a replica */
+const char *primary_host;
+/** Port of the primary this server replicates */
+unsigned short primary_port;
+/** Directory holding the log and checkpoint, or NULL if state is not kept */
+const char *data_dir;
+/** Seconds between checkpoints */
+int checkpoint_interval = CHECKPOINT_INTERVAL;
 
 /**
- * Initializes the temperature array with each city's postal code.
- * All other values remain their default.
- * @param array_p the temperature array to be initialized
+ * Returns the statistics block of the calling thread, claiming one on first use.
+ * Blocks of exited threads are reused, so their counts are never lost.
+ * @return the thread's statistics
  */
-void init_array(struct Temp_Data * array_p) {
-	strcpy(array_p[0].city, "RDU");
-	strcpy(array_p[1].city, "CLT");
-	strcpy(array_p[2].city, "ALT");
-	strcpy(array_p[3].city, "CHS");
-	strcpy(array_p[4].city, "RIC");
+struct Thread_Stats *threadStats(void)
+{
+	if(my_stats != NULL){
+		return my_stats;
+	}
+	pthread_mutex_lock(&stats_lock);
+	for(struct Thread_Stats *ts = all_stats; ts != NULL; ts = ts->next){
+		if(!ts->inUse){
+			my_stats = ts;
+			break;
+		}
+	}
+	if(my_stats == NULL){
+		my_stats = calloc(1, sizeof(struct Thread_Stats));
+		my_stats->next = all_stats;
+		__atomic_store_n(&all_stats, my_stats, __ATOMIC_RELEASE);
+	}
+	my_stats->inUse = 1;
+	pthread_mutex_unlock(&stats_lock);
+	return my_stats;
 }
 
 /**
- * Appends the temperature for each city to the specified message for client
- * transfer. Performs the operation for client request 's' or 'S'.
- * @param data the message to be modified 
+ * Gives up the calling thread's statistics block for reuse by a later thread.
  */
-void getTemps(char *data)
+void releaseThreadStats(void)
 {
-	char temp[4];
-	for(int i = 0; i < NUM_CITIES; i++){
-		strcat(data, temp_array[i].city);
-		strcat(data, " ");
-		sprintf(temp, "%u", temp_array[i].temperature);
-		strcat(data, temp);
-		strcat(data, "\t");
-		// Reset temp for next temperature
-		memset(temp, 0, 4);
+	if(my_stats != NULL){
+		pthread_mutex_lock(&stats_lock);
+		my_stats->inUse = 0;
+		pthread_mutex_unlock(&stats_lock);
+		my_stats = NULL;
 	}
 }
 
 /**
- * Returns whether or not the given city is valid. A valid city contains any
- * of the five valid postal codes within the temperature array. Postal codes
- * must be capitalized.
- * @param data the temperature struct to evaluate
- * @return if the city is valid
+ * Adds to one of the calling thread's counters. The thread is the only writer,
+ * so a relaxed load and store suffice.
+ * @param counter the counter
+ * @param amount the amount to add
+ */
+void statAdd(uint64_t *counter, uint64_t amount)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+/**
+ * Records a served request and its service time in the calling thread's statistics.
+ * @param type the enum Request_Type of the request
+ * @param nanos the time taken to serve it
+ */
+void statRequest(int type, uint64_t nanos)
+{
+	struct Thread_Stats *ts = threadStats();
+	statAdd(&ts->requests[type], 1);
+	statAdd(&ts->serviceTime[type][histBucket(nanos)], 1);
+}
+
+/**
+ * Merges every thread's statistics and renders them as text.
+ * @param buf the buffer to render into
+ * @param cap the capacity of the buffer
+ * @return the length of the text, excluding its terminating null character
+ */
+int renderStats(char *buf, size_t cap)
+{
+	struct Thread_Stats *sum = calloc(1, sizeof(struct Thread_Stats));
+	for(struct Thread_Stats *ts = __atomic_load_n(&all_stats, __ATOMIC_ACQUIRE); ts != NULL; ts = ts->next){
+		// Each block is a run of counters, so sum them word by word
+		const uint64_t *src = &ts->connections;
+		uint64_t *dst = &sum->connections;
+		size_t words = (sizeof(struct Thread_Stats) - offsetof(struct Thread_Stats, connections)) / sizeof(uint64_t);
+		for(size_t i = 0; i < words; i++){
+			dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+		}
+	}
+
+	int len = snprintf(buf, cap,
+	                   "connections %llu active %llu\nreports %llu city errors %llu hour errors %llu malformed %llu\n"
+	                   "bytes in %llu out %llu pushes %llu\ndatagrams %llu dropped %llu\nstate version %lu cities %d\n",
+	                   (unsigned long long) sum->connections, (unsigned long long) (sum->connections - sum->closed),
+	                   (unsigned long long) sum->reports, (unsigned long long) sum->cityErrors,
+	                   (unsigned long long) sum->hourErrors, (unsigned long long) sum->malformed,
+	                   (unsigned long long) sum->bytesIn, (unsigned long long) sum->bytesOut,
+	                   (unsigned long long) sum->pushes, (unsigned long long) sum->datagrams,
+	                   (unsigned long long) sum->dropped, __atomic_load_n(state_version, __ATOMIC_RELAXED), num_cities);
+	if(wal.replicate && (size_t) len < cap){
+		len += snprintf(buf + len, cap - len, "primary: replicas %lu head %llu streamed %llu states %llu\n",
+		                __atomic_load_n(&replication.replicas, __ATOMIC_RELAXED), (unsigned long long) (wal.nextLsn - 1),
+		                (unsigned long long) __atomic_load_n(&replication.streamed, __ATOMIC_RELAXED),
+		                (unsigned long long) __atomic_load_n(&replication.states, __ATOMIC_RELAXED));
+	}
+	if(primary_host != NULL && (size_t) len < cap){
+		uint64_t head = __atomic_load_n(&replication.head, __ATOMIC_RELAXED);
+		uint64_t applied = __atomic_load_n(&replication.applied, __ATOMIC_RELAXED);
+		uint64_t lastFrame = __atomic_load_n(&replication.lastFrame, __ATOMIC_RELAXED);
+		len += snprintf(buf + len, cap - len, "replica of %s:%u: %s applied %llu lag %llu records %.1f ms received %llu (%llu/s) states %llu\n",
+		                primary_host, primary_port, __atomic_load_n(&replication.connected, __ATOMIC_RELAXED) ? "connected" : "disconnected",
+		                (unsigned long long) applied, (unsigned long long) (head > applied ? head - applied : 0),
+		                lastFrame ? (nowNanos() - lastFrame) / 1e6 : 0.0,
+		                (unsigned long long) __atomic_load_n(&replication.received, __ATOMIC_RELAXED),
+		                (unsigned long long) __atomic_load_n(&replication.rate, __ATOMIC_RELAXED),
+		                (unsigned long long) __atomic_load_n(&replication.states, __ATOMIC_RELAXED));
+	}
+	for(int t = 0; t < NUM_REQ_TYPES && (size_t) len < cap; t++){
+		uint64_t n = sum->requests[t];
+		if(n == 0){
+			continue;
+		}
+		len += snprintf(buf + len, cap - len, "%s %llu p50 %.1fus p99 %.1fus p99.9 %.1fus\n", request_names[t],
+		                (unsigned long long) n, histPercentile(sum->serviceTime[t], n, 50) / 1e3,
+		                histPercentile(sum->serviceTime[t], n, 99) / 1e3, histPercentile(sum->serviceTime[t], n, 99.9) / 1e3);
+	}
+	free(sum);
+	return (size_t) len < cap ? len : (int) cap - 1;
+}
+
+/**
+ * Returns the log ring of the calling thread, claiming one on first use. Rings
+ * of exited threads are reused once claimed, so a ring always has one producer.
+ * @return the thread's log ring
+ */
+struct Log_Ring *threadLog(void)
+{
+	if(my_log != NULL){
+		return my_log;
+	}
+	pthread_mutex_lock(&log_lock);
+	for(struct Log_Ring *ring = all_logs; ring != NULL; ring = ring->next){
+		if(!ring->inUse){
+			my_log = ring;
+			break;
+		}
+	}
+	if(my_log == NULL){
+		my_log = calloc(1, sizeof(struct Log_Ring));
+		my_log->next = all_logs;
+		__atomic_store_n(&all_logs, my_log, __ATOMIC_RELEASE);
+	}
+	my_log->inUse = 1;
+	pthread_mutex_unlock(&log_lock);
+	return my_log;
+}
+
+/**
+ * Gives up the calling thread's log ring for reuse by a later thread. Messages
+ * still in the ring are drained as usual.
+ */
+void releaseThreadLog(void)
+{
+	if(my_log != NULL){
+		pthread_mutex_lock(&log_lock);
+		my_log->inUse = 0;
+		pthread_mutex_unlock(&log_lock);
+		my_log = NULL;
+	}
+}
+
+/**
+ * Claims the next entry of the calling thread's log ring.
+ * @param level the enum Log_Level of the message
+ * @return the entry to fill and publish with logPublish(), or NULL if the
+ *         level is not logged or the ring is full
+ */
+struct Log_Entry *logClaim(int level)
+{
+	if(level < log_level){
+		return NULL;
+	}
+	struct Log_Ring *ring = threadLog();
+	if(ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS){
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	struct Log_Entry *entry = &ring->entries[ring->head & (LOG_RING_SLOTS - 1)];
+	entry->level = (uint8_t) level;
+	return entry;
+}
+
+/**
+ * Publishes the entry last claimed by the calling thread to the drainer.
+ */
+void logPublish(void)
+{
+	__atomic_store_n(&my_log->head, my_log->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Writes a message to the log. The message is only copied into the calling
+ * thread's ring; the drainer thread writes it out.
+ * @param level the enum Log_Level of the message
+ * @param msg the message, without a trailing newline
+ * @param len the length of the message
+ */
+void logWrite(int level, const char *msg, size_t len)
+{
+	struct Log_Entry *entry = logClaim(level);
+	if(entry != NULL){
+		entry->len = (uint8_t) (len < LOG_MSG_LEN ? len : LOG_MSG_LEN);
+		memcpy(entry->msg, msg, entry->len);
+		logPublish();
+	}
+}
+
+/**
+ * Formats a message straight into the calling thread's log ring. Meant for
+ * errors and other paths off the request hot path.
+ * @param level the enum Log_Level of the message
+ * @param format the printf() format of the message, without a trailing newline
+ */
+void logFormat(int level, const char *format, ...)
+{
+	struct Log_Entry *entry = logClaim(level);
+	if(entry != NULL){
+		va_list args;
+		va_start(args, format);
+		int len = vsnprintf(entry->msg, LOG_MSG_LEN, format, args);
+		va_end(args);
+		entry->len = (uint8_t) (len < 0 ? 0 : len < LOG_MSG_LEN ? len : LOG_MSG_LEN - 1);
+		logPublish();
+	}
+}
+
+/**
+ * Log drainer thread. Copies the messages of every ring to stdout, so threads
+ * never block on the console or on each other to log. Messages of one thread
+ * keep their order; messages of different threads may interleave.
+ * @param args unused
+ */
+void *logMain(void *args)
+{
+	while(1){
+		int drained = 0;
+		for(struct Log_Ring *ring = __atomic_load_n(&all_logs, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next){
+			uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+			uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+			for(uint64_t i = ring->tail; i < head; i++){
+				const struct Log_Entry *entry = &ring->entries[i & (LOG_RING_SLOTS - 1)];
+				fputs(log_names[entry->level], stdout);
+				fwrite(entry->msg, 1, entry->len, stdout);
+				putchar('\n');
+			}
+			drained |= head != ring->tail;
+			__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+			if(dropped != ring->reported){
+				printf("warning: %llu log messages dropped\n", (unsigned long long) (dropped - ring->reported));
+				ring->reported = dropped;
+			}
+		}
+		if(drained){
+			fflush(stdout);
+		} else {
+			usleep(LOG_DRAIN_MS * 1000);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Statistics thread. Logs the merged statistics every stats_interval seconds.
+ * @param args unused
+ */
+void *statsMain(void *args)
+{
+	char buf[4096];
+	while(1){
+		sleep(stats_interval);
+		renderStats(buf, sizeof(buf));
+		LOG_TEXT(LOG_INFO, "--- stats ---");
+		for(char *line = buf, *end; (end = strchr(line, '\n')) != NULL; line = end + 1){
+			logWrite(LOG_INFO, line, end - line);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Locks a city. When workers share the city table, the lock is robust: if a
+ * worker died holding it, the lock passes to the caller, and the city, which
+ * may hold a partial update of the dead worker's last report, is kept as is.
+ * @param entry the city to lock
+ */
+void lockCity(struct Temp_Data *entry)
+{
+	if(pthread_mutex_lock(&entry->lock) == EOWNERDEAD){
+		logFormat(LOG_WARN, "Recovered the lock of %s from a dead worker", entry->city);
+		pthread_mutex_consistent(&entry->lock);
+	}
+}
+
+/**
+ * Unlocks a city locked with lockCity().
+ * @param entry the city to unlock
+ */
+void unlockCity(struct Temp_Data *entry)
+{
+	pthread_mutex_unlock(&entry->lock);
+}
+
+/**
+ * Returns the FNV-1a hash of a city code.
+ * @param city the city code to hash
+ * @return the hash of the city code
  */
-int isValidCity(struct Temp_Data data)
+unsigned int hashCity(const char *city)
 {
-	// Check if city is valid
-	if(strcmp(data.city, "RDU") != 0 && strcmp(data.city, "CLT") != 0 && strcmp(data.city, "ALT") != 0 
-		 && strcmp(data.city, "CHS") != 0 && strcmp(data.city, "RIC") != 0){
+	unsigned int h = 2166136261u;
+	for(; *city; city++){
+		h ^= (unsigned char) *city;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/**
+ * Returns the temperature data for the given city, or NULL if the server does not
+ * handle that city. Postal codes must be capitalized. This is the only lookup made
+ * for a report, so validating a city and locating its record share a single probe.
+ * @param city the city code to look up
+ * @return the city's temperature data, or NULL if the city is invalid
+ */
+struct Temp_Data *isValidCity(const char *city)
+{
+	unsigned int slot = hashCity(city) & index_mask;
+	// Probe linearly until the city or an empty slot is found
+	while(city_index[slot] != 0){
+		struct Temp_Data *entry = &temp_array[city_index[slot] - 1];
+		if(strcmp(entry->city, city) == 0){
+			return entry;
+		}
+		slot = (slot + 1) & index_mask;
+	}
+	return NULL;
+}
+
+/**
+ * Adds a city to the temperature array and its index. Duplicate cities are ignored.
+ * @param city the city code to add
+ * @return 1 if the city was added, 0 if it was already present
+ */
+int addCity(const char *city)
+{
+	if(isValidCity(city) != NULL){
 		return 0;
 	}
+	unsigned int slot = hashCity(city) & index_mask;
+	while(city_index[slot] != 0){
+		slot = (slot + 1) & index_mask;
+	}
+	strcpy(temp_array[num_cities].city, city);
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	if(num_workers > 0){
+		pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	}
+	pthread_mutex_init(&temp_array[num_cities].lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	city_index[slot] = ++num_cities;
 	return 1;
 }
- 
+
+/**
+ * Reads the city codes listed in a file, one per line. Blank lines and lines
+ * starting with '#' are skipped. Surrounding whitespace is ignored.
+ * @param file the open city file
+ * @param codes array receiving the codes, grown as needed
+ * @return the number of codes read, or -1 if a code is invalid
+ */
+int readCityFile(FILE *file, char (**codes)[MAX_CITY_LEN + 1])
+{
+	char line[MAX_DATA_LEN];
+	int count = 0;
+	int capacity = 0;
+	int lineNum = 0;
+	while(fgets(line, sizeof(line), file) != NULL){
+		lineNum++;
+		// Trim surrounding whitespace
+		char *start = line;
+		while(isspace((unsigned char) *start)){
+			start++;
+		}
+		char *end = start + strlen(start);
+		while(end > start && isspace((unsigned char) end[-1])){
+			end--;
+		}
+		*end = '\0';
+		if(*start == '\0' || *start == '#'){
+			continue;
+		}
+		// Reject codes that cannot be sent in a report
+		if(end - start > MAX_CITY_LEN || strchr(start, ':') != NULL || strpbrk(start, " \t") != NULL){
+			printf("Invalid city code on line %d: %s\n", lineNum, start);
+			return -1;
+		}
+		if(count == capacity){
+			capacity = capacity ? capacity * 2 : 64;
+			*codes = realloc(*codes, capacity * sizeof(**codes));
+		}
+		strcpy((*codes)[count++], start);
+	}
+	return count;
+}
+
+/**
+ * Allocates the zeroed memory of the city table. When workers share it, the
+ * table is a POSIX shared memory segment mapped before the workers are forked,
+ * so every worker reads and updates the same cities with no IPC.
+ * @param len the size of the table
+ * @return the table
+ */
+void *allocTable(size_t len)
+{
+	if(num_workers == 0){
+		return calloc(1, len);
+	}
+	snprintf(shm_name, sizeof(shm_name), "/weather-server-%d", (int) getpid());
+	int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if(fd < 0 || ftruncate(fd, len) < 0){
+		printf("Unable to create shared memory %s: %s\n", shm_name, strerror(errno));
+		exit(1);
+	}
+	void *table = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(table == MAP_FAILED){
+		printf("Unable to map shared memory %s: %s\n", shm_name, strerror(errno));
+		shm_unlink(shm_name);
+		exit(1);
+	}
+	return table;
+}
+
+/**
+ * Loads the cities handled by the server and builds the temperature array and
+ * its index. If the default city file is not present, the server handles the
+ * five original cities. All other values remain their default.
+ * @param path the city file to load, or NULL for the default file
+ */
+void init_array(const char *path)
+{
+	char (*codes)[MAX_CITY_LEN + 1] = NULL;
+	int count;
+	FILE *file = fopen(path ? path : CITY_FILE, "r");
+	if(file == NULL){
+		if(path != NULL){
+			printf("Unable to open city file %s\n", path);
+			exit(1);
+		}
+		count = sizeof(default_cities) / sizeof(default_cities[0]);
+		codes = malloc(count * sizeof(*codes));
+		for(int i = 0; i < count; i++){
+			strcpy(codes[i], default_cities[i]);
+		}
+	} else {
+		count = readCityFile(file, &codes);
+		fclose(file);
+		if(count <= 0){
+			printf("No valid cities in %s\n", path ? path : CITY_FILE);
+			exit(1);
+		}
+	}
+
+	// Keep the index at most half full so probe sequences stay short
+	unsigned int capacity = 1;
+	while(capacity < 2 * (unsigned int) count){
+		capacity <<= 1;
+	}
+	index_mask = capacity - 1;
+	city_index = calloc(capacity, sizeof(int));
+	// The cities, their histories, and the state version live in one table,
+	// which worker processes share
+	size_t tableLen = count * (sizeof(struct Temp_Data) + sizeof(struct History)) + sizeof(unsigned long);
+	char *table = allocTable(tableLen);
+	temp_array = (struct Temp_Data *) table;
+	history_array = (struct History *) (table + count * sizeof(struct Temp_Data));
+	state_version = (unsigned long *) (table + count * (sizeof(struct Temp_Data) + sizeof(struct History)));
+	subscribers = calloc(count, sizeof(struct Subscriber_List));
+	num_cities = 0;
+	for(int i = 0; i < count; i++){
+		if(!addCity(codes[i])){
+			printf("Ignoring duplicate city %s\n", codes[i]);
+		}
+	}
+	free(codes);
+}
+
+/**
+ * Writes the temperature for each city to the specified message for client
+ * transfer. Performs the operation for client request 's' or 'S'. The message
+ * must hold at least num_cities * SHOW_ENTRY_LEN + 1 characters. Each entry is
+ * appended at a cursor, so rendering is linear in the length of the message.
+ * @param data the message to be modified 
+ * @return the length of the message, excluding its terminating null character
+ */
+int getTemps(char *data)
+{
+	char *cursor = data;
+	for(int i = 0; i < num_cities; i++){
+		size_t len = strlen(temp_array[i].city);
+		memcpy(cursor, temp_array[i].city, len);
+		cursor += len;
+		*cursor++ = ' ';
+		// Write the digits of the temperature in reverse, then flip them
+		unsigned int temp = __atomic_load_n(&temp_array[i].temperature, __ATOMIC_RELAXED);
+		char *digits = cursor;
+		do {
+			*cursor++ = (char) ('0' + temp % 10);
+			temp /= 10;
+		} while(temp != 0);
+		for(char *end = cursor - 1; digits < end; digits++, end--){
+			char c = *digits;
+			*digits = *end;
+			*end = c;
+		}
+		*cursor++ = '\t';
+	}
+	*cursor = '\0';
+	return (int) (cursor - data);
+}
+
+/**
+ * Releases a reference to a snapshot, freeing it once no reader holds it.
+ * @param snap the snapshot to release
+ */
+void releaseSnapshot(struct Snapshot *snap)
+{
+	if(__atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL) == 0){
+		free(snap);
+	}
+}
+
+/**
+ * Writes the binary show reply frame for every city.
+ * @param frame the frame to write, with room for every city
+ * @param version the state version being rendered
+ * @return the length of the frame
+ */
+int getTempsBinary(char *frame, unsigned long version)
+{
+	struct wp_header header = { WP_MAGIC, WP_VERSION, WP_SHOW | WP_REPLY, WP_OK, 0 };
+	struct wp_show show = { htonl((uint32_t) version), htonl((uint32_t) num_cities) };
+	int len = WP_HEADER_LEN + (int) sizeof(show) + num_cities * (int) sizeof(struct wp_show_entry);
+	header.length = htonl((uint32_t) (len - WP_HEADER_LEN));
+	memcpy(frame, &header, WP_HEADER_LEN);
+	memcpy(frame + WP_HEADER_LEN, &show, sizeof(show));
+	struct wp_show_entry *entries = (struct wp_show_entry *) (frame + WP_HEADER_LEN + sizeof(show));
+	for(int i = 0; i < num_cities; i++){
+		struct wp_show_entry entry;
+		memset(entry.city, 0, WP_CITY_LEN);
+		strcpy(entry.city, temp_array[i].city);
+		entry.temperature = htons(__atomic_load_n(&temp_array[i].temperature, __ATOMIC_RELAXED));
+		entry.hourstamp = htons(__atomic_load_n(&temp_array[i].hourstamp, __ATOMIC_RELAXED));
+		memcpy(&entries[i], &entry, sizeof(entry));
+	}
+	return len;
+}
+
+/**
+ * Renders the current temperatures into a new snapshot and publishes it. The
+ * snapshot holds both the text reply and the binary reply frame. The previous
+ * snapshot stays valid for readers still sending it and is freed by the last
+ * of them. Must be called with rebuild_lock held.
+ */
+void publishSnapshot(void)
+{
+	size_t textCap = (size_t) num_cities * SHOW_ENTRY_LEN + 1;
+	size_t binCap = WP_HEADER_LEN + sizeof(struct wp_show) + (size_t) num_cities * sizeof(struct wp_show_entry);
+	struct Snapshot *snap = malloc(sizeof(struct Snapshot) + textCap + binCap);
+	// Read the version first, so a report racing with rendering forces another rebuild
+	snap->version = __atomic_load_n(state_version, __ATOMIC_ACQUIRE);
+	snap->refs = 1;
+	snap->len = getTemps(snap->text) + 1;
+	snap->bin = snap->text + textCap;
+	snap->binLen = getTempsBinary(snap->bin, snap->version);
+
+	pthread_mutex_lock(&snapshot_lock);
+	struct Snapshot *old = current_snapshot;
+	current_snapshot = snap;
+	pthread_mutex_unlock(&snapshot_lock);
+	if(old != NULL){
+		releaseSnapshot(old);
+	}
+}
+
+/**
+ * Returns a reference to a snapshot reflecting every report recorded so far,
+ * rebuilding it only if a report has changed a temperature since it was rendered.
+ * The caller sends the snapshot as is and then releases it.
+ * @return the current snapshot
+ */
+struct Snapshot *acquireSnapshot(void)
+{
+	struct Snapshot *snap;
+	pthread_mutex_lock(&snapshot_lock);
+	snap = current_snapshot;
+	__atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&snapshot_lock);
+	if(snap->version == __atomic_load_n(state_version, __ATOMIC_ACQUIRE)){
+		return snap;
+	}
+
+	// Stale, so rebuild unless another reader already has
+	releaseSnapshot(snap);
+	pthread_mutex_lock(&rebuild_lock);
+	if(current_snapshot->version != __atomic_load_n(state_version, __ATOMIC_ACQUIRE)){
+		publishSnapshot();
+	}
+	pthread_mutex_lock(&snapshot_lock);
+	snap = current_snapshot;
+	__atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&snapshot_lock);
+	pthread_mutex_unlock(&rebuild_lock);
+	return snap;
+}
+
+/**
+ * Returns the current hour as published by the clock thread. Split it with
+ * clockHour() and clockEpochHour().
+ * @return the current hour
+ */
+uint64_t readClock(void)
+{
+	return __atomic_load_n(&server_clock, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Returns the hour of the day in EST of a reading of the clock.
+ * @param clock the reading
+ * @return the hour of the day
+ */
+unsigned short clockHour(uint64_t clock)
+{
+	return (unsigned short) clock;
+}
+
+/**
+ * Returns the hour since the Unix epoch of a reading of the clock.
+ * @param clock the reading
+ * @return the hour since the Unix epoch
+ */
+uint32_t clockEpochHour(uint64_t clock)
+{
+	return (uint32_t) (clock >> 16);
+}
+
+/**
+ * Returns the current hour of the day in EST.
+ * @return the current hour
+ */
+unsigned short getCurrentHour(void)
+{
+	return clockHour(readClock());
+}
+
+/**
+ * Reads the system clock and publishes the current hour.
+ * @return the hour since the Unix epoch
+ */
+uint32_t tickClock(void)
+{
+	uint32_t epochHour = (uint32_t) (time(NULL) / SEC_IN_HOUR);
+	// Convert from GMT to EST (Note: GMT is 5 hours ahead)
+	unsigned short hour = (unsigned short) (epochHour % 24 - 5);
+	__atomic_store_n(&server_clock, (uint64_t) epochHour << 16 | hour, __ATOMIC_RELEASE);
+	return epochHour;
+}
+
 /**
  * Returns if the given timestamp is valid. A valid timestamp is not negative, 
  * does not exceed 24, and equals the current hour.
  * @param data the temperature struct to evaluate
+ * @param curr_hour the current hour
  * @return if the given timestamp is valid 
  */
-int isValidTimestamp(struct Temp_Data data)
+int isValidTimestamp(struct Temp_Data data, unsigned short curr_hour)
+{
+	// Check if hour stamp is not valid
+	if(data.hourstamp < 0 || data.hourstamp > 23){
+		return 0;
+	}
+	// Check if current hour and requested hour are unequal
+	if(curr_hour != data.hourstamp){
+		return 0;
+	}
+	// Hour is current, so return valid
+	return 1;
+}
+
+/**
+ * Returns the FNV-1a hash of a block of memory, used to detect torn or
+ * corrupt records on disk.
+ * @param data the memory to hash
+ * @param len the length of the memory
+ * @return the hash
+ */
+uint32_t checksum(const void *data, size_t len)
+{
+	const unsigned char *bytes = data;
+	uint32_t h = 2166136261u;
+	for(size_t i = 0; i < len; i++){
+		h ^= bytes[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/**
+ * Writes a whole buffer to a file descriptor.
+ * @param fd the file descriptor
+ * @param buf the buffer to write
+ * @param len the length of the buffer
+ * @return 0 on success, or -1 on failure
+ */
+int writeAll(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	while(len > 0){
+		ssize_t n = write(fd, p, len);
+		if(n < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * Creates the log segment whose first record is lsn. Segments are named after
+ * their first record so that they sort in log order.
+ * @param lsn the first record of the segment
+ * @return the segment's file descriptor
+ */
+int openSegment(uint64_t lsn)
+{
+	char path[MAX_PATH_LEN];
+	snprintf(path, sizeof(path), "%s/wal-%020llu.log", data_dir, (unsigned long long) lsn);
+	int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if(fd < 0){
+		printf("Unable to open log segment %s\n", path);
+		exit(1);
+	}
+	return fd;
+}
+
+/**
+ * Appends log records for reports about to be applied to a city. Each record
+ * gets the next log sequence number. Records are only copied into the pending
+ * buffer here; the log writer thread writes and syncs them in groups. Must be
+ * called with the city's lock held, so the city's records reach the log in the
+ * order they are applied.
+ * @param city the city being reported
+ * @param hourstamp the hour of the reports
+ * @param epochHour the hour since the Unix epoch the reports arrived in
+ * @param temps the reported temperatures
+ * @param n the number of reported temperatures
+ * @return the log sequence number of the last record appended
+ */
+uint64_t walAppend(const char *city, unsigned short hourstamp, uint32_t epochHour, const unsigned short *temps, int n)
+{
+	struct Wal_Record rec;
+	memset(&rec, 0, sizeof(rec));
+	strcpy(rec.city, city);
+	rec.epochHour = epochHour;
+	rec.hourstamp = hourstamp;
+
+	pthread_mutex_lock(&wal.lock);
+	size_t needed = wal.pendingLen + n * sizeof(rec);
+	if(wal.enabled && needed > wal.pendingCap){
+		wal.pendingCap = needed > 2 * wal.pendingCap ? needed : 2 * wal.pendingCap;
+		wal.pending = realloc(wal.pending, wal.pendingCap);
+	}
+	for(int i = 0; i < n; i++){
+		rec.lsn = wal.nextLsn++;
+		rec.temperature = temps[i];
+		rec.checksum = checksum(&rec, offsetof(struct Wal_Record, checksum));
+		if(wal.enabled){
+			memcpy(wal.pending + wal.pendingLen, &rec, sizeof(rec));
+			wal.pendingLen += sizeof(rec);
+		}
+		if(wal.replicate){
+			wal.ring[rec.lsn & (REPL_RING_LEN - 1)] = rec;
+		}
+	}
+	if(wal.enabled){
+		pthread_cond_signal(&wal.work);
+	}
+	if(wal.replicate){
+		pthread_cond_broadcast(&wal.appended);
+	}
+	pthread_mutex_unlock(&wal.lock);
+	return rec.lsn;
+}
+
+/**
+ * Waits until every log record up to lsn is durable. Many client threads wait
+ * on the same sync, so each sync commits a whole group of reports.
+ * @param lsn the log sequence number to wait for
+ */
+void walWait(uint64_t lsn)
+{
+	pthread_mutex_lock(&wal.lock);
+	while(wal.durableLsn < lsn){
+		pthread_cond_wait(&wal.flushed, &wal.lock);
+	}
+	pthread_mutex_unlock(&wal.lock);
+}
+
+/**
+ * Log writer thread. Takes every pending record at once, writes them with a
+ * single write() and makes them durable with a single fdatasync(), then wakes
+ * the client threads waiting on them. Reports appended meanwhile accumulate for
+ * the next group. Also starts a new segment when a checkpoint asks for one.
+ * @param args unused
+ */
+void *walWriter(void *args)
+{
+	char *batch = NULL;
+	size_t batchCap = 0;
+	pthread_mutex_lock(&wal.lock);
+	while(1){
+		while(wal.pendingLen == 0 && !wal.rotateRequested){
+			pthread_cond_wait(&wal.work, &wal.lock);
+		}
+		// Swap buffers, with their capacities, so appends continue while this group is written
+		char *group = wal.pending;
+		size_t groupLen = wal.pendingLen;
+		size_t groupCap = wal.pendingCap;
+		wal.pending = batch;
+		wal.pendingCap = batchCap;
+		wal.pendingLen = 0;
+		batch = group;
+		batchCap = groupCap;
+		uint64_t lastLsn = wal.nextLsn - 1;
+		int rotate = wal.rotateRequested;
+		wal.rotateRequested = 0;
+		pthread_mutex_unlock(&wal.lock);
+
+		if(groupLen > 0 && (writeAll(wal.fd, group, groupLen) < 0 || fdatasync(wal.fd) < 0)){
+			printf("Unable to write the log: %s\n", strerror(errno));
+			exit(1);
+		}
+		if(rotate){
+			close(wal.fd);
+			wal.fd = openSegment(lastLsn + 1);
+		}
+
+		pthread_mutex_lock(&wal.lock);
+		wal.durableLsn = lastLsn;
+		if(rotate){
+			wal.rotatedLsn = lastLsn;
+			wal.rotations++;
+		}
+		pthread_cond_broadcast(&wal.flushed);
+	}
+	return NULL;
+}
+
+/**
+ * Asks the log writer to close the current segment and waits until it has.
+ * @return the last record of the closed segment; later records are in newer segments
+ */
+uint64_t walRotate(void)
+{
+	pthread_mutex_lock(&wal.lock);
+	unsigned long target = wal.rotations + 1;
+	wal.rotateRequested = 1;
+	pthread_cond_signal(&wal.work);
+	while(wal.rotations < target){
+		pthread_cond_wait(&wal.flushed, &wal.lock);
+	}
+	uint64_t lsn = wal.rotatedLsn;
+	pthread_mutex_unlock(&wal.lock);
+	return lsn;
+}
+
+/**
+ * Adds a temperature to the aggregate of its period in a ring, starting the
+ * aggregate over if its slot still holds an older period.
+ * @param ring the ring of aggregates
+ * @param size the number of slots in the ring
+ * @param period the period the temperature was reported in
+ * @param temp the reported temperature
+ */
+void addToAggregate(struct Aggregate *ring, int size, uint32_t period, unsigned short temp)
+{
+	struct Aggregate *agg = &ring[period % size];
+	if(agg->period != period || agg->count == 0){
+		memset(agg, 0, sizeof(*agg));
+		agg->period = period;
+		agg->min = temp;
+		agg->max = temp;
+	}
+	agg->count++;
+	agg->sum += temp;
+	if(temp < agg->min){
+		agg->min = temp;
+	}
+	if(temp > agg->max){
+		agg->max = temp;
+	}
+}
+
+/**
+ * Returns the aggregate of a period if its ring still holds it.
+ * @param ring the ring of aggregates
+ * @param size the number of slots in the ring
+ * @param period the period wanted
+ * @return the aggregate, or NULL if nothing was reported in the period or it has been overwritten
+ */
+const struct Aggregate *findAggregate(const struct Aggregate *ring, int size, uint32_t period)
+{
+	const struct Aggregate *agg = &ring[period % size];
+	return agg->count != 0 && agg->period == period ? agg : NULL;
+}
+
+/**
+ * Combines the aggregates of a city's history covering a range of hours. Whole
+ * weeks and days inside the range are read from the rollups, so the cost is
+ * proportional to the number of aggregates read rather than the number of hours.
+ * Hours older than the hourly ring are answered by their whole day, and days
+ * older than the daily ring by their whole week. Must be called with the city's
+ * lock held.
+ * @param history the city's history
+ * @param first the first hour since the Unix epoch in the range
+ * @param last the last hour since the Unix epoch in the range
+ * @param now the current hour since the Unix epoch
+ * @param result receives the combined aggregate
+ */
+void queryHistory(const struct History *history, uint32_t first, uint32_t last, uint32_t now, struct Aggregate *result)
+{
+	memset(result, 0, sizeof(*result));
+	uint32_t h = first;
+	while(h <= last){
+		const struct Aggregate *agg;
+		uint32_t next;
+		int hourKept = h + HISTORY_HOURS > now;
+		int dayKept = h / HOURS_IN_DAY + HISTORY_DAYS > now / HOURS_IN_DAY;
+		if(h % HOURS_IN_WEEK == 0 && h + HOURS_IN_WEEK - 1 <= last){
+			agg = findAggregate(history->weeks, HISTORY_WEEKS, h / HOURS_IN_WEEK);
+			next = h + HOURS_IN_WEEK;
+		} else if((h % HOURS_IN_DAY == 0 && h + HOURS_IN_DAY - 1 <= last && dayKept) || (!hourKept && dayKept)){
+			agg = findAggregate(history->days, HISTORY_DAYS, h / HOURS_IN_DAY);
+			next = (h / HOURS_IN_DAY + 1) * HOURS_IN_DAY;
+		} else if(hourKept){
+			agg = findAggregate(history->hours, HISTORY_HOURS, h);
+			next = h + 1;
+		} else {
+			agg = findAggregate(history->weeks, HISTORY_WEEKS, h / HOURS_IN_WEEK);
+			next = (h / HOURS_IN_WEEK + 1) * HOURS_IN_WEEK;
+		}
+		if(agg != NULL){
+			if(result->count == 0 || agg->min < result->min){
+				result->min = agg->min;
+			}
+			if(result->count == 0 || agg->max > result->max){
+				result->max = agg->max;
+			}
+			result->count += agg->count;
+			result->sum += agg->sum;
+		}
+		h = next;
+	}
+}
+
+/**
+ * Records temperatures reported for one city in the same hour, under a single
+ * acquisition of the city's lock. If these are the initial reported temperatures
+ * for the hour, the current temperature is overwritten by their average. Else,
+ * averages all reported temperatures for this hour and assigns as the current
+ * temperature. The clock thread normally resets the city at each new hour; if
+ * the reports arrive first, or are being replayed, they reset it themselves.
+ * Reports from an hour the city has already left only update its history.
+ * @param entry the temperature data of the city being reported
+ * @param hourstamp the hour of the reports
+ * @param epochHour the hour since the Unix epoch the reports arrived in
+ * @param temps the reported temperatures
+ * @param n the number of reported temperatures
+ * @param lsn the log sequence number when replaying a log record, or 0 to log
+ *            new reports, in which case it receives the number of the last record
+ * @return whether the city's current temperature changed
+ */
+int applyTemps(struct Temp_Data *entry, unsigned short hourstamp, uint32_t epochHour, const unsigned short *temps, int n,
+               uint64_t *lsn)
+{
+	struct History *history = &history_array[entry - temp_array];
+	lockCity(entry);
+	if(*lsn != 0){
+		entry->lsn = *lsn;
+	} else if(wal.enabled || wal.replicate){
+		*lsn = entry->lsn = walAppend(entry->city, hourstamp, epochHour, temps, n);
+	}
+	// Roll the reports up into the city's history
+	for(int i = 0; i < n; i++){
+		addToAggregate(history->hours, HISTORY_HOURS, epochHour, temps[i]);
+		addToAggregate(history->days, HISTORY_DAYS, epochHour / HOURS_IN_DAY, temps[i]);
+		addToAggregate(history->weeks, HISTORY_WEEKS, epochHour / HOURS_IN_WEEK, temps[i]);
+	}
+	unsigned short oldTemp = entry->temperature;
+	// Reports validated just before the clock thread rolled the city over only
+	// count toward its history
+	if(entry->epochHour != 0 && epochHour < entry->epochHour){
+		unlockCity(entry);
+		return 0;
+	}
+	// Check if a new hour has passed, in case the report beat the rollover or is
+	// being replayed. Without a known hour, fall back to the hourstamp.
+	if(epochHour > entry->epochHour && (entry->epochHour != 0 || entry->hourstamp != hourstamp)){
+		// At a new hour, so reset sumTemps
+		entry->sumTemps = 0;
+		entry->count = 0;
+	}
+	entry->epochHour = epochHour;
+	entry->hourstamp = hourstamp;
+	// Sum recorded temps and average, then floor. The first report of the hour
+	// averages to itself, overwriting the previous hour's temperature.
+	for(int i = 0; i < n; i++){
+		entry->sumTemps += (unsigned long) temps[i];
+	}
+	entry->count += n;
+	unsigned short newTemp = (unsigned short) floor(((double) entry->sumTemps / entry->count));
+	__atomic_store_n(&entry->temperature, newTemp, __ATOMIC_RELAXED);
+	// Let the notifier know this city has a new temperature to push
+	if(newTemp != oldTemp){
+		__atomic_add_fetch(&entry->changes, 1, __ATOMIC_RELEASE);
+	}
+	unlockCity(entry);
+	return newTemp != oldTemp;
+}
+
+/**
+ * Records the temperature for the given city. If this is the initial reported temperature
+ * for the given city, the current temperature is overwritten. Else, averages all reported
+ * temperatures for this hour and assigns as the current temperature. If a new hour passes,
+ * resets the city's temperatures to their defaults and updates the current hourstamp.
+ * @param entry the temperature data of the city being reported
+ * @param data the temperature struct providing a temperature to report
+ * @param epochHour the hour since the Unix epoch the report was validated in
+ * @return the log sequence number of the report, or 0 if reports are not logged
+ */
+uint64_t recordTemp(struct Temp_Data *entry, struct Temp_Data data, uint32_t epochHour)
+{
+	uint64_t lsn = 0;
+	LOG_TEXT(LOG_DEBUG, "Recording temp");
+	// Only a changed temperature invalidates the show snapshot
+	if(applyTemps(entry, data.hourstamp, epochHour, &data.temperature, 1, &lsn)){
+		__atomic_add_fetch(state_version, 1, __ATOMIC_RELEASE);
+	}
+	return lsn;
+}
+
+/**
+ * Orders batch items by city, then by position in the batch.
+ * @param a the first batch item
+ * @param b the second batch item
+ * @return negative, zero, or positive as a sorts before, with, or after b
+ */
+int compareBatchItems(const void *a, const void *b)
+{
+	const struct Batch_Item *x = a;
+	const struct Batch_Item *y = b;
+	if(x->entry != y->entry){
+		return x->entry < y->entry ? -1 : 1;
+	}
+	return x->index - y->index;
+}
+
+/**
+ * Starts a new hour for every city at once: each city's sum and count are reset
+ * under its lock, so the first report of the hour finds the city ready and
+ * overwrites its temperature. The temperature itself is kept until then.
+ * @param epochHour the new hour since the Unix epoch
+ */
+void rolloverCities(uint32_t epochHour)
+{
+	for(int i = 0; i < num_cities; i++){
+		struct Temp_Data *entry = &temp_array[i];
+		lockCity(entry);
+		if(entry->epochHour < epochHour){
+			entry->epochHour = epochHour;
+			entry->sumTemps = 0;
+			entry->count = 0;
+		}
+		unlockCity(entry);
+	}
+}
+
+/**
+ * Clock thread. Sleeps on a timerfd until each hour boundary, then publishes the
+ * new hour and rolls every city over. The timer is cancelled if the system clock
+ * is set, in which case the hour is read again.
+ * @param args unused
+ */
+void *clockMain(void *args)
+{
+	int fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
+	if(fd < 0){
+		logFormat(LOG_ERROR, "timerfd_create() failed: %s", strerror(errno));
+		return NULL;
+	}
+	while(1){
+		uint32_t epochHour = tickClock();
+		rolloverCities(epochHour);
+		struct itimerspec spec = { .it_value = { .tv_sec = (time_t) (epochHour + 1) * SEC_IN_HOUR } };
+		timerfd_settime(fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &spec, NULL);
+		uint64_t expirations;
+		// Fails with ECANCELED if the clock was set, which also calls for a new reading
+		if(read(fd, &expirations, sizeof(expirations)) < 0 && errno != ECANCELED && errno != EINTR){
+			logFormat(LOG_ERROR, "Unable to read the clock timer: %s", strerror(errno));
+			sleep(1);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Validates and records a batch of reported temperatures. Every report is
+ * validated in one pass against a single reading of the clock, then the valid
+ * reports are grouped by city and each city is updated once for its whole group.
+ * @param reports the reported temperature structs
+ * @param n the number of reports, at most MAX_BATCH
+ * @param items scratch space for n batch items
+ * @param statuses receives the enum WP_STATUS of each report
+ * @param lsn receives the log sequence number of the last report logged, if any
+ * @return the number of reports recorded
+ */
+int submitBatch(const struct Temp_Data *reports, int n, struct Batch_Item *items, uint8_t *statuses, uint64_t *lsn)
+{
+	uint64_t clock = readClock();
+	unsigned short curr_hour = clockHour(clock);
+	uint32_t epochHour = clockEpochHour(clock);
+	struct Thread_Stats *ts = threadStats();
+	int valid = 0;
+	statAdd(&ts->reports, n);
+	// Replicas only change through their primary
+	if(primary_host != NULL){
+		memset(statuses, WP_ERR_READONLY, n);
+		return 0;
+	}
+	for(int i = 0; i < n; i++){
+		struct Temp_Data *entry = isValidCity(reports[i].city);
+		if(entry == NULL){
+			statuses[i] = WP_ERR_CITY;
+			statAdd(&ts->cityErrors, 1);
+		} else if(!isValidTimestamp(reports[i], curr_hour)){
+			statuses[i] = WP_ERR_HOUR;
+			statAdd(&ts->hourErrors, 1);
+		} else {
+			statuses[i] = WP_OK;
+			items[valid].entry = entry;
+			items[valid].index = i;
+			items[valid++].temperature = reports[i].temperature;
+		}
+	}
+	if(valid == 0){
+		return 0;
+	}
+
+	qsort(items, valid, sizeof(struct Batch_Item), compareBatchItems);
+	unsigned short temps[MAX_BATCH];
+	int changed = 0;
+	for(int start = 0; start < valid; ){
+		int end = start;
+		while(end < valid && items[end].entry == items[start].entry){
+			temps[end - start] = items[end].temperature;
+			end++;
+		}
+		uint64_t groupLsn = 0;
+		changed |= applyTemps(items[start].entry, curr_hour, epochHour, temps, end - start, &groupLsn);
+		if(groupLsn > *lsn){
+			*lsn = groupLsn;
+		}
+		start = end;
+	}
+	// The whole batch invalidates the show snapshot at most once
+	if(changed){
+		__atomic_add_fetch(state_version, 1, __ATOMIC_RELEASE);
+	}
+	return valid;
+}
+
+/**
+ * Formats the data in the client message as a temperature struct.
+ * A message is formatted request, city, hour, and then temperature.
+ * @param msg the message from which to create a temperature struct
+ * @return the temperature struct for this message
+ */
+struct Temp_Data getData(char *msg)
+{
+	struct Temp_Data data;
+	char *token;
+	char *save;
+	strtok_r(msg, ":", &save); // request
+	// Check for invalid city
+	if((token = strtok_r(NULL, ":", &save)) == NULL || strlen(token) > MAX_CITY_LEN){
+		strcpy(data.city, "inv");
+	} else {
+		strcpy(data.city, token); // city
+	}
+	// Check for invalid hourstamp
+	if((token = strtok_r(NULL, ":", &save)) == NULL){
+		data.hourstamp = 25;
+	} else {
+		data.hourstamp = (unsigned short) atoi(token);
+	}
+	if((token = strtok_r(NULL, ":", &save)) == NULL){
+		data.temperature = 0;
+	} else {
+		data.temperature = (unsigned short) atoi(token);
+	}
+	
+	// Return a temperature struct
+	return data;
+} 
+ 
+/**
+ * Captures every city in checkpoint format: a header followed by one record
+ * and one history per city. Each city is copied under its own lock along with
+ * the last record applied to it, so records after the boundary can be applied
+ * on top without applying any twice.
+ * @param boundary every record up to this one is reflected in the image
+ * @param len receives the size of the image
+ * @return the image, to be freed by the caller
+ */
+char *captureState(uint64_t boundary, size_t *len)
+{
+	struct Checkpoint_Header header = { CHECKPOINT_MAGIC, CHECKPOINT_VERSION, boundary, (uint32_t) num_cities, 0 };
+	size_t recordsLen = num_cities * sizeof(struct Checkpoint_Record);
+	*len = sizeof(header) + recordsLen + num_cities * sizeof(struct History);
+	char *image = calloc(1, *len);
+	struct Checkpoint_Record *records = (struct Checkpoint_Record *) (image + sizeof(header));
+	struct History *histories = (struct History *) ((char *) records + recordsLen);
+	for(int i = 0; i < num_cities; i++){
+		struct Temp_Data *entry = &temp_array[i];
+		lockCity(entry);
+		strcpy(records[i].city, entry->city);
+		records[i].lsn = entry->lsn;
+		records[i].count = entry->count;
+		records[i].sumTemps = entry->sumTemps;
+		records[i].temperature = entry->temperature;
+		records[i].hourstamp = entry->hourstamp;
+		records[i].epochHour = entry->epochHour;
+		memcpy(&histories[i], &history_array[i], sizeof(struct History));
+		unlockCity(entry);
+	}
+	header.checksum = checksum(records, *len - sizeof(header));
+	memcpy(image, &header, sizeof(header));
+	return image;
+}
+
+/**
+ * Replaces the state of every city found in a checkpoint image. Cities not
+ * handled by this server are skipped.
+ * @param image the image
+ * @param size the size of the image
+ * @param boundary receives the log boundary of the image
+ * @return 0 on success, or -1 if the image is invalid
+ */
+int restoreState(const char *image, size_t size, uint64_t *boundary)
+{
+	struct Checkpoint_Header header;
+	if(size < sizeof(header)){
+		return -1;
+	}
+	memcpy(&header, image, sizeof(header));
+	const struct Checkpoint_Record *records = (const struct Checkpoint_Record *) (image + sizeof(header));
+	size_t recordsLen = header.count * sizeof(struct Checkpoint_Record);
+	// Version 1 checkpoints have no history section
+	size_t len = recordsLen + (header.version >= 2 ? header.count * sizeof(struct History) : 0);
+	const struct History *histories = (const struct History *) (image + sizeof(header) + recordsLen);
+	if(header.magic != CHECKPOINT_MAGIC || header.version == 0 || header.version > CHECKPOINT_VERSION
+	   || size != sizeof(header) + len || checksum(records, len) != header.checksum){
+		return -1;
+	}
+	for(uint32_t i = 0; i < header.count; i++){
+		struct Temp_Data *entry = isValidCity(records[i].city);
+		if(entry == NULL){
+			continue;
+		}
+		lockCity(entry);
+		entry->lsn = records[i].lsn;
+		entry->count = records[i].count;
+		entry->sumTemps = records[i].sumTemps;
+		entry->hourstamp = records[i].hourstamp;
+		entry->epochHour = records[i].epochHour;
+		if(entry->temperature != records[i].temperature){
+			__atomic_store_n(&entry->temperature, records[i].temperature, __ATOMIC_RELAXED);
+			__atomic_add_fetch(&entry->changes, 1, __ATOMIC_RELEASE);
+		}
+		if(header.version >= 2){
+			memcpy(&history_array[entry - temp_array], &histories[i], sizeof(struct History));
+		}
+		unlockCity(entry);
+	}
+	*boundary = header.lsn;
+	return 0;
+}
+
+/**
+ * Writes a checkpoint of every city. The log is first rotated, so every record
+ * up to the returned boundary lives in older segments. Each city is copied under
+ * its own lock along with the last record applied to it, so recovery can replay
+ * newer segments without applying a record twice, even for reports that arrive
+ * while the checkpoint is taken. The checkpoint replaces the previous one
+ * atomically, after which the older segments are deleted.
+ */
+void writeCheckpoint(void)
+{
+	char tmpPath[MAX_PATH_LEN];
+	char path[MAX_PATH_LEN];
+	uint64_t boundary = walRotate();
+	size_t len;
+	char *image = captureState(boundary, &len);
+
+	snprintf(tmpPath, sizeof(tmpPath), "%s/checkpoint.tmp", data_dir);
+	snprintf(path, sizeof(path), "%s/checkpoint.bin", data_dir);
+	int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0 || writeAll(fd, image, len) < 0
+	   || fsync(fd) < 0 || close(fd) < 0 || rename(tmpPath, path) < 0){
+		logFormat(LOG_ERROR, "Unable to write checkpoint: %s", strerror(errno));
+		free(image);
+		return;
+	}
+	free(image);
+	// Make the rename durable before discarding the log it replaces
+	int dirFd = open(data_dir, O_RDONLY | O_DIRECTORY);
+	if(dirFd >= 0){
+		fsync(dirFd);
+		close(dirFd);
+	}
+
+	DIR *dir = opendir(data_dir);
+	struct dirent *file;
+	while(dir != NULL && (file = readdir(dir)) != NULL){
+		unsigned long long first;
+		if(sscanf(file->d_name, "wal-%20llu.log", &first) == 1 && first <= boundary){
+			snprintf(path, sizeof(path), "%s/%s", data_dir, file->d_name);
+			unlink(path);
+		}
+	}
+	if(dir != NULL){
+		closedir(dir);
+	}
+}
+
+/**
+ * Checkpoint thread. Writes a checkpoint every checkpoint_interval seconds, so
+ * recovery never replays more than one interval of the log.
+ * @param args unused
+ */
+void *checkpointMain(void *args)
+{
+	uint64_t checkpointed = 0;
+	while(1){
+		sleep(checkpoint_interval);
+		// Skip the checkpoint if nothing was reported since the last one
+		pthread_mutex_lock(&wal.lock);
+		uint64_t last = wal.nextLsn - 1;
+		pthread_mutex_unlock(&wal.lock);
+		if(last != checkpointed){
+			writeCheckpoint();
+			checkpointed = last;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Loads the most recent checkpoint, if any, by mapping it into memory. Cities
+ * no longer handled by the server are skipped.
+ * @return the log boundary of the checkpoint, or 0 if there is none
+ */
+uint64_t loadCheckpoint(void)
+{
+	char path[MAX_PATH_LEN];
+	struct stat st;
+	snprintf(path, sizeof(path), "%s/checkpoint.bin", data_dir);
+	int fd = open(path, O_RDONLY);
+	if(fd < 0){
+		return 0;
+	}
+	if(fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(struct Checkpoint_Header)){
+		printf("Ignoring truncated checkpoint %s\n", path);
+		close(fd);
+		return 0;
+	}
+	const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED){
+		printf("Unable to map checkpoint %s\n", path);
+		return 0;
+	}
+	uint64_t boundary = 0;
+	if(restoreState(map, st.st_size, &boundary) < 0){
+		printf("Ignoring invalid checkpoint %s\n", path);
+	}
+	munmap((void *) map, st.st_size);
+	return boundary;
+}
+
+/**
+ * Orders log segment names, which sort in log order.
+ * @param a the first name
+ * @param b the second name
+ * @return negative, zero, or positive as a sorts before, with, or after b
+ */
+int compareSegments(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/**
+ * Replays one log segment. Records already reflected in the checkpoint, or
+ * applied to their city by an earlier record, are skipped. Replay stops at the
+ * first torn or corrupt record.
+ * @param path the segment to replay
+ * @return the last log sequence number in the segment
+ */
+uint64_t replaySegment(const char *path)
+{
+	uint64_t last = 0;
+	struct Wal_Record rec;
+	FILE *file = fopen(path, "r");
+	if(file == NULL){
+		return 0;
+	}
+	while(fread(&rec, sizeof(rec), 1, file) == 1){
+		if(rec.checksum != checksum(&rec, offsetof(struct Wal_Record, checksum)) || rec.city[MAX_CITY_LEN] != '\0'){
+			printf("Ignoring corrupt log tail in %s\n", path);
+			break;
+		}
+		last = rec.lsn;
+		struct Temp_Data *entry = isValidCity(rec.city);
+		if(entry != NULL && rec.lsn > entry->lsn){
+			uint64_t lsn = rec.lsn;
+			applyTemps(entry, rec.hourstamp, rec.epochHour, &rec.temperature, 1, &lsn);
+		}
+	}
+	fclose(file);
+	return last;
+}
+
+/**
+ * Restores the state kept in the data directory and starts logging. Loads the
+ * checkpoint, replays the log segments written since, and opens a new segment
+ * for the reports to come. Starts the log writer and checkpoint threads.
+ */
+void recoverState(void)
+{
+	if(mkdir(data_dir, 0755) < 0 && errno != EEXIST){
+		printf("Unable to create data directory %s\n", data_dir);
+		exit(1);
+	}
+	uint64_t last = loadCheckpoint();
+
+	// Replay the remaining segments in log order
+	char **names = NULL;
+	int count = 0;
+	DIR *dir = opendir(data_dir);
+	struct dirent *file;
+	while(dir != NULL && (file = readdir(dir)) != NULL){
+		unsigned long long first;
+		if(sscanf(file->d_name, "wal-%20llu.log", &first) == 1){
+			names = realloc(names, (count + 1) * sizeof(char *));
+			names[count++] = strdup(file->d_name);
+		}
+	}
+	if(dir != NULL){
+		closedir(dir);
+	}
+	qsort(names, count, sizeof(char *), compareSegments);
+	for(int i = 0; i < count; i++){
+		char path[MAX_PATH_LEN];
+		snprintf(path, sizeof(path), "%s/%s", data_dir, names[i]);
+		uint64_t segLast = replaySegment(path);
+		if(segLast > last){
+			last = segLast;
+		}
+		free(names[i]);
+	}
+	free(names);
+	for(int i = 0; i < num_cities; i++){
+		if(temp_array[i].lsn > last){
+			last = temp_array[i].lsn;
+		}
+	}
+
+	wal.enabled = 1;
+	wal.nextLsn = last + 1;
+	wal.durableLsn = last;
+	wal.rotatedLsn = last;
+	wal.fd = openSegment(wal.nextLsn);
+	pthread_t threadID;
+	if(pthread_create(&threadID, NULL, walWriter, NULL) != 0
+	   || pthread_create(&threadID, NULL, checkpointMain, NULL) != 0){
+		printf("Error creating thread\n");
+		exit(1);
+	}
+	printf("Recovered state up to log record %llu from %s\n", (unsigned long long) last, data_dir);
+}
+
+/**
+ * Summarizes a city's reports over the most recent hours, including the current one.
+ * @param city the city to query
+ * @param hours the number of hours to cover, from 1 to MAX_HISTORY_RANGE
+ * @param result receives the combined aggregate
+ * @return WP_OK, WP_ERR_CITY for an invalid city, or WP_ERR_MALFORMED for an invalid range
+ */
+int submitHistoryQuery(const char *city, long hours, struct Aggregate *result)
+{
+	struct Temp_Data *entry = isValidCity(city);
+	if(entry == NULL){
+		return WP_ERR_CITY;
+	}
+	if(hours < 1 || hours > MAX_HISTORY_RANGE){
+		return WP_ERR_MALFORMED;
+	}
+	uint32_t now = clockEpochHour(readClock());
+	lockCity(entry);
+	queryHistory(&history_array[entry - temp_array], now - (uint32_t) hours + 1, now, now, result);
+	unlockCity(entry);
+	return WP_OK;
+}
+
+/**
+ * Validates and records a reported temperature.
+ * @param data the temperature struct providing a temperature to report
+ * @param lsn receives the log sequence number of the report, if logged
+ * @return WP_OK if recorded, WP_ERR_CITY for an invalid city, or WP_ERR_HOUR
+ *         for an invalid hourstamp
+ */
+int submitReport(struct Temp_Data data, uint64_t *lsn)
+{
+	struct Thread_Stats *ts = threadStats();
+	statAdd(&ts->reports, 1);
+	// Replicas only change through their primary
+	if(primary_host != NULL){
+		return WP_ERR_READONLY;
+	}
+	// Check if the city is invalid
+	struct Temp_Data *entry = isValidCity(data.city);
+	if(entry == NULL){
+		statAdd(&ts->cityErrors, 1);
+		return WP_ERR_CITY;
+	}
+	// Check if the timestamp is valid
+	uint64_t clock = readClock();
+	if(!isValidTimestamp(data, clockHour(clock))){
+		statAdd(&ts->hourErrors, 1);
+		return WP_ERR_HOUR;
+	}
+	// Record the temperature for the given city
+	uint64_t recorded = recordTemp(entry, data, clockEpochHour(clock));
+	if(recorded > *lsn){
+		*lsn = recorded;
+	}
+	return WP_OK;
+}
+
+/**
+ * Sends all queued replies with a single writev() and releases the snapshots
+ * they reference. If replies are committed synchronously, first waits for the
+ * reports they acknowledge to reach the log on disk.
+ * @param conn the connection whose replies to send
+ * @return 0 on success, or -1 if the client can no longer be written to
+ */
+int flushReplies(struct Connection *conn)
+{
+	// Replies to reports may only be sent once the reports are durable
+	if(conn->commitLsn != 0 && wal.enabled && wal.syncCommit){
+		walWait(conn->commitLsn);
+	}
+	conn->commitLsn = 0;
+	struct iovec *iov = conn->iov;
+	int count = conn->iovCount;
+	int result = 0;
+	while(count > 0){
+		ssize_t sent = writev(conn->sock, iov, count);
+		if(sent >= 0){
+			statAdd(&threadStats()->bytesOut, sent);
+		}
+		if(sent < 0){
+			LOG_TEXT(LOG_WARN, "send() failed");
+			result = -1;
+			break;
+		}
+		// Skip past everything written, which may end partway through a reply
+		while(count > 0 && (size_t) sent >= iov->iov_len){
+			sent -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if(count > 0){
+			iov->iov_base = (char *) iov->iov_base + sent;
+			iov->iov_len -= sent;
+		}
+	}
+	for(int i = 0; i < conn->heldCount; i++){
+		releaseSnapshot(conn->held[i]);
+	}
+	conn->iovCount = 0;
+	conn->heldCount = 0;
+	conn->outLen = 0;
+	return result;
+}
+
+/**
+ * Queues a copy of a small reply, merging it with the previous reply when both
+ * are in the connection's reply buffer.
+ * @param conn the connection to reply on
+ * @param data the reply
+ * @param len the length of the reply
+ * @return 0 on success, or -1 if the queue had to be flushed and that failed
+ */
+int queueReply(struct Connection *conn, const void *data, size_t len)
+{
+	if(conn->outLen + len > OUT_BUF_LEN || conn->iovCount == MAX_IOV){
+		if(flushReplies(conn) < 0){
+			return -1;
+		}
+	}
+	char *dest = conn->out + conn->outLen;
+	memcpy(dest, data, len);
+	conn->outLen += len;
+	struct iovec *last = conn->iovCount > 0 ? &conn->iov[conn->iovCount - 1] : NULL;
+	if(last != NULL && (char *) last->iov_base + last->iov_len == dest){
+		last->iov_len += len;
+	} else {
+		conn->iov[conn->iovCount].iov_base = dest;
+		conn->iov[conn->iovCount++].iov_len = len;
+	}
+	return 0;
+}
+
+/**
+ * Queues part of a snapshot as a reply. The snapshot is sent in place and
+ * released once written.
+ * @param conn the connection to reply on
+ * @param snap the snapshot, whose reference passes to the connection
+ * @param data the part of the snapshot to send
+ * @param len the length to send
+ * @return 0 on success, or -1 if the queue had to be flushed and that failed
+ */
+int queueSnapshot(struct Connection *conn, struct Snapshot *snap, const char *data, int len)
+{
+	if(conn->iovCount == MAX_IOV && flushReplies(conn) < 0){
+		releaseSnapshot(snap);
+		return -1;
+	}
+	conn->iov[conn->iovCount].iov_base = (void *) data;
+	conn->iov[conn->iovCount++].iov_len = len;
+	conn->held[conn->heldCount++] = snap;
+	return 0;
+}
+
+/**
+ * Queues a binary reply frame.
+ * @param conn the connection to reply on
+ * @param opcode the opcode of the request being answered
+ * @param status the status of the reply
+ * @param payload the payload of the reply
+ * @param len the length of the payload
+ * @return 0 on success, or -1 if the reply could not be queued
+ */
+int queueFrame(struct Connection *conn, int opcode, int status, const void *payload, size_t len)
+{
+	if(status == WP_ERR_MALFORMED || status == WP_ERR_VERSION || status == WP_ERR_OPCODE){
+		statAdd(&threadStats()->malformed, 1);
+	}
+	struct wp_header header = { WP_MAGIC, (uint8_t) conn->version, (uint8_t) (opcode | WP_REPLY), (uint8_t) status, htonl((uint32_t) len) };
+	if(queueReply(conn, &header, WP_HEADER_LEN) < 0){
+		return -1;
+	}
+	return len > 0 ? queueReply(conn, payload, len) : 0;
+}
+
+/**
+ * Queues pushes of the current temperature of the given cities. Text pushes read
+ * "p:<city> <temp>\t..." and end with a null character; binary pushes are WP_PUSH
+ * frames laid out like a show reply. Large sets are split over several pushes.
+ * @param conn the connection to push to
+ * @param cities the cities to push, as indexes into temp_array
+ * @param count the number of cities
+ * @param binary whether to push binary frames
+ * @return 0 on success, or -1 if the pushes could not be queued
+ */
+int queuePush(struct Connection *conn, const int *cities, int count, int binary)
+{
+	char msg[OUT_BUF_LEN];
+	statAdd(&threadStats()->pushes, count > 0);
+	int perMsg = binary ? (int) ((OUT_BUF_LEN - WP_HEADER_LEN - sizeof(struct wp_show)) / sizeof(struct wp_show_entry))
+	                    : (OUT_BUF_LEN - 3) / SHOW_ENTRY_LEN;
+	for(int start = 0; start < count; start += perMsg){
+		int n = count - start < perMsg ? count - start : perMsg;
+		int len = 0;
+		if(binary){
+			struct wp_show show = { htonl((uint32_t) __atomic_load_n(state_version, __ATOMIC_ACQUIRE)), htonl((uint32_t) n) };
+			memcpy(msg, &show, sizeof(show));
+			len = sizeof(show);
+			for(int i = 0; i < n; i++){
+				struct Temp_Data *entry = &temp_array[cities[start + i]];
+				struct wp_show_entry item;
+				memset(item.city, 0, WP_CITY_LEN);
+				strcpy(item.city, entry->city);
+				item.temperature = htons(__atomic_load_n(&entry->temperature, __ATOMIC_RELAXED));
+				item.hourstamp = htons(__atomic_load_n(&entry->hourstamp, __ATOMIC_RELAXED));
+				memcpy(msg + len, &item, sizeof(item));
+				len += sizeof(item);
+			}
+			if(queueFrame(conn, WP_PUSH, WP_OK, msg, len) < 0){
+				return -1;
+			}
+		} else {
+			len = sprintf(msg, "p:");
+			for(int i = 0; i < n; i++){
+				struct Temp_Data *entry = &temp_array[cities[start + i]];
+				len += sprintf(msg + len, "%s %u\t", entry->city, __atomic_load_n(&entry->temperature, __ATOMIC_RELAXED));
+			}
+			if(queueReply(conn, msg, len + 1) < 0){
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/**
+ * Subscribes a connection to changes of the given cities. Cities already
+ * subscribed to are skipped and removed from the given array.
+ * @param conn the connection subscribing
+ * @param cities the cities to subscribe to, as indexes into temp_array; on return,
+ *               holds only the newly subscribed cities
+ * @param count the number of cities
+ * @param binary whether the connection wants binary pushes
+ * @return the number of newly subscribed cities
+ */
+int subscribe(struct Connection *conn, int *cities, int count, int binary)
+{
+	int added = 0;
+	if(conn->eventFd < 0){
+		conn->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		conn->isDirty = calloc(num_cities, 1);
+		conn->dirty = malloc(num_cities * sizeof(int));
+		conn->subscribed = malloc(num_cities * sizeof(int));
+	}
+	conn->binaryPush = binary;
+
+	pthread_rwlock_wrlock(&subs_lock);
+	for(int i = 0; i < count; i++){
+		struct Subscriber_List *list = &subscribers[cities[i]];
+		int present = 0;
+		for(int j = 0; j < list->count && !present; j++){
+			present = list->conns[j] == conn;
+		}
+		if(present){
+			continue;
+		}
+		if(list->count == list->cap){
+			list->cap = list->cap ? list->cap * 2 : 4;
+			list->conns = realloc(list->conns, list->cap * sizeof(struct Connection *));
+		}
+		list->conns[list->count++] = conn;
+		conn->subscribed[conn->subCount++] = cities[i];
+		cities[added++] = cities[i];
+	}
+	pthread_rwlock_unlock(&subs_lock);
+	return added;
+}
+
+/**
+ * Removes every subscription of a connection about to close. Once this returns,
+ * the notifier no longer refers to the connection.
+ * @param conn the closing connection
+ */
+void unsubscribe(struct Connection *conn)
+{
+	if(conn->eventFd < 0){
+		return;
+	}
+	pthread_rwlock_wrlock(&subs_lock);
+	for(int i = 0; i < conn->subCount; i++){
+		struct Subscriber_List *list = &subscribers[conn->subscribed[i]];
+		for(int j = 0; j < list->count; j++){
+			if(list->conns[j] == conn){
+				list->conns[j] = list->conns[--list->count];
+				break;
+			}
+		}
+	}
+	pthread_rwlock_unlock(&subs_lock);
+	close(conn->eventFd);
+	free(conn->isDirty);
+	free(conn->dirty);
+	free(conn->subscribed);
+}
+
+/**
+ * Pushes the cities that changed since the last push to a subscribed connection.
+ * The current temperature is read when pushing, so any number of changes to a
+ * city between pushes costs a subscriber a single entry.
+ * @param conn the subscribed connection
+ * @return 0 on success, or -1 if the pushes could not be queued
+ */
+int pushChanges(struct Connection *conn)
+{
+	uint64_t signals;
+	int *cities = malloc(num_cities * sizeof(int));
+	int count;
+	if(read(conn->eventFd, &signals, sizeof(signals)) < 0 && errno != EAGAIN){
+		free(cities);
+		return -1;
+	}
+	pthread_mutex_lock(&conn->pushLock);
+	count = conn->dirtyCount;
+	memcpy(cities, conn->dirty, count * sizeof(int));
+	for(int i = 0; i < count; i++){
+		conn->isDirty[cities[i]] = 0;
+	}
+	conn->dirtyCount = 0;
+	pthread_mutex_unlock(&conn->pushLock);
+	int result = queuePush(conn, cities, count, conn->binaryPush);
+	free(cities);
+	return result;
+}
+
+/**
+ * Notifier thread. Once per tick, finds the cities whose temperature changed
+ * since the previous tick, marks them on each of their subscribers, and wakes
+ * every subscriber with something to push once. Writers never wait on the
+ * notifier or on subscribers, and the notifier never writes to a socket, so a
+ * slow subscriber only delays its own pushes, which coalesce in the meantime.
+ * @param args unused
+ */
+void *notifierMain(void *args)
+{
+	unsigned long *seen = calloc(num_cities, sizeof(unsigned long));
+	struct Connection **woken = NULL;
+	int wokenCap = 0;
+	unsigned long lastVersion = 0;
+	while(1){
+		usleep(PUSH_TICK_MS * 1000);
+		// Nothing to do if no temperature changed since the last tick
+		unsigned long version = __atomic_load_n(state_version, __ATOMIC_ACQUIRE);
+		if(version == lastVersion){
+			continue;
+		}
+		lastVersion = version;
+
+		int wokenCount = 0;
+		pthread_rwlock_rdlock(&subs_lock);
+		for(int i = 0; i < num_cities; i++){
+			unsigned long changes = __atomic_load_n(&temp_array[i].changes, __ATOMIC_ACQUIRE);
+			if(changes == seen[i]){
+				continue;
+			}
+			seen[i] = changes;
+			struct Subscriber_List *list = &subscribers[i];
+			for(int j = 0; j < list->count; j++){
+				struct Connection *conn = list->conns[j];
+				pthread_mutex_lock(&conn->pushLock);
+				if(!conn->isDirty[i]){
+					conn->isDirty[i] = 1;
+					conn->dirty[conn->dirtyCount++] = i;
+					// Wake each subscriber once per tick, when its first city changes
+					if(conn->dirtyCount == 1){
+						if(wokenCount == wokenCap){
+							wokenCap = wokenCap ? wokenCap * 2 : 16;
+							woken = realloc(woken, wokenCap * sizeof(struct Connection *));
+						}
+						woken[wokenCount++] = conn;
+					}
+				}
+				pthread_mutex_unlock(&conn->pushLock);
+			}
+		}
+		for(int i = 0; i < wokenCount; i++){
+			uint64_t one = 1;
+			if(write(woken[i]->eventFd, &one, sizeof(one)) < 0){
+				// The counter only saturates if the subscriber is already due to wake
+			}
+		}
+		pthread_rwlock_unlock(&subs_lock);
+	}
+	return NULL;
+}
+
+/**
+ * Parses a text subscription, "w:<city>[:<city>...]", subscribing the connection
+ * to pushes of those cities' temperatures whenever they change. Replies with the
+ * number of cities now subscribed to, followed by a push of their current values.
+ * @param conn the connection the request arrived on
+ * @param msg the null terminated subscription, which is modified
+ * @return 0 on success, or -1 if the reply could not be queued
+ */
+int parseSubscribe(struct Connection *conn, char *msg)
+{
+	int cities[MAX_DATA_LEN / 2];
+	int count = 0;
+	int invalid = 0;
+	char reply[MAX_DATA_LEN];
+	char *save;
+	char *token;
+	strtok_r(msg, ":", &save); // request
+	while((token = strtok_r(NULL, ":", &save)) != NULL){
+		struct Temp_Data *entry = strlen(token) <= MAX_CITY_LEN ? isValidCity(token) : NULL;
+		if(entry == NULL){
+			invalid++;
+		} else {
+			cities[count++] = (int) (entry - temp_array);
+		}
+	}
+	if(count == 0){
+		strcpy(reply, "Error city code!");
+		return queueReply(conn, reply, strlen(reply) + 1);
+	}
+	// Reply, then push the current value of each new city as a baseline
+	count = subscribe(conn, cities, count, 0);
+	sprintf(reply, "Watching %d cities (%d invalid)", conn->subCount, invalid);
+	if(queueReply(conn, reply, strlen(reply) + 1) < 0){
+		return -1;
+	}
+	return queuePush(conn, cities, count, 0);
+}
+
+/**
+ * Parses the reports of a text batch, "<city>:<hourstamp>:<temp>[:<city>:<hourstamp>:<temp>...]",
+ * continuing a strtok_r() tokenization of the request.
+ * @param save the strtok_r() state, positioned after the request letter
+ * @param reports receives the reports
+ * @param max the most reports to parse
+ * @return the number of reports parsed, or -1 if there are more than max
+ */
+int parseReports(char **save, struct Temp_Data *reports, int max)
+{
+	char *token;
+	int n = 0;
+	while((token = strtok_r(NULL, ":", save)) != NULL){
+		if(n == max){
+			return -1;
+		}
+		struct Temp_Data *data = &reports[n++];
+		if(strlen(token) > MAX_CITY_LEN){
+			strcpy(data->city, "inv");
+		} else {
+			strcpy(data->city, token);
+		}
+		data->hourstamp = (token = strtok_r(NULL, ":", save)) ? (unsigned short) atoi(token) : 25;
+		data->temperature = (token = strtok_r(NULL, ":", save)) ? (unsigned short) atoi(token) : 0;
+	}
+	return n;
+}
+
+/**
+ * Parses a text batch report, "b:<city>:<hourstamp>:<temp>[:<city>:<hourstamp>:<temp>...]",
+ * and replies with the number of reports recorded followed by one status letter per
+ * report: 'O' if recorded, 'C' for an invalid city, or 'H' for an invalid hourstamp.
+ * A batch of more reports than fit in a request is rejected whole.
+ * @param conn the connection the request arrived on
+ * @param msg the null terminated batch request, which is modified
+ * @return 0 on success, or -1 if the reply could not be queued
+ */
+int parseBatch(struct Connection *conn, char *msg)
+{
+	/** Status letters indexed by enum WP_STATUS */
+	static const char letters[] = { [WP_OK] = 'O', [WP_ERR_CITY] = 'C', [WP_ERR_HOUR] = 'H', [WP_ERR_READONLY] = 'R' };
+	struct Temp_Data reports[MAX_DATA_LEN / 4];
+	char reply[MAX_DATA_LEN];
+	char *save;
+	strtok_r(msg, ":", &save); // request
+	int n = parseReports(&save, reports, MAX_DATA_LEN / 4);
+	if(n < 0){
+		statAdd(&threadStats()->malformed, 1);
+		strcpy(reply, "Error batch too long!");
+		return queueReply(conn, reply, strlen(reply) + 1);
+	}
+	int recorded = submitBatch(reports, n, conn->batch, conn->statuses, &conn->commitLsn);
+	int len = sprintf(reply, "Recorded %d of %d: ", recorded, n);
+	for(int i = 0; i < n; i++){
+		reply[len++] = letters[conn->statuses[i]];
+	}
+	reply[len++] = '\0';
+	return queueReply(conn, reply, len);
+}
+
+/**
+ * Parses a text history query, "h:<city>:<hours>", and replies with the average,
+ * lowest, and highest temperature reported for the city over that many hours,
+ * including the current one.
+ * @param conn the connection the request arrived on
+ * @param msg the null terminated query, which is modified
+ * @return 0 on success, or -1 if the reply could not be queued
+ */
+int parseHistory(struct Connection *conn, char *msg)
+{
+	char reply[MAX_DATA_LEN];
+	struct Aggregate result;
+	char *save;
+	strtok_r(msg, ":", &save); // request
+	char *city = strtok_r(NULL, ":", &save);
+	char *token = strtok_r(NULL, ":", &save);
+	// Echo the parsed range, never the raw token, which may be nearly as long as the request
+	long hours = token ? atol(token) : 0;
+	int status = submitHistoryQuery(city && strlen(city) <= MAX_CITY_LEN ? city : "inv", hours, &result);
+	if(status == WP_ERR_CITY){
+		strcpy(reply, "Error city code!");
+	} else if(status != WP_OK){
+		snprintf(reply, sizeof(reply), "Error history range! (1 to %d hours)", MAX_HISTORY_RANGE);
+	} else if(result.count == 0){
+		snprintf(reply, sizeof(reply), "%s last %ldh: no reports", city, hours);
+	} else {
+		snprintf(reply, sizeof(reply), "%s last %ldh: avg %llu min %u max %u reports %u", city, hours,
+		        (unsigned long long) (result.sum / result.count), result.min, result.max, result.count);
+	}
+	return queueReply(conn, reply, strlen(reply) + 1);
+}
+
+/**
+ * Parses a text request. If the request is "stats", replies with the server
+ * statistics. If the the request is {s,S}, queues the snapshot
+ * of the current temperature for each city. If the request is {b,B}, records a batch
+ * of reports. If the request is {h,H}, summarizes a city's history. If the request
+ * is {w,W}, subscribes to changes. Else, interprets the client's message as
+ * a report and generates a temperature struct for that message. If the client reports
+ * an invalid city, replies "Error city code!". If the client reports an invalid
+ * hourstamp, replies "Error hourstamp!". Else, replies "Successfully report temperature!".
+ * Text replies end with a null character.
+ * @param conn the connection the request arrived on
+ * @param msg the client's request to parse, which need not be null terminated
+ * @param len the length of the request
+ * @return 0 on success, or -1 if the reply could not be queued
+ */
+int parseMessage(struct Connection *conn, const char *msg, size_t len)
+{
+	if(len == 5 && strncmp(msg, "stats", 5) == 0){
+		char stats[4096];
+		int statsLen = renderStats(stats, sizeof(stats));
+		return queueReply(conn, stats, statsLen + 1);
+	}
+	// Determine if message is to show or receive temperatures
+	if(msg[0] == 's' || msg[0] == 'S'){
+		// Send the pre-rendered temps
+		struct Snapshot *snap = acquireSnapshot();
+		return queueSnapshot(conn, snap, snap->text, snap->len);
+	}
+	// Make a null terminated copy of this string
+	char cpy[MAX_DATA_LEN];
+	memcpy(cpy, msg, len);
+	cpy[len] = '\0';
+	if(msg[0] == 'b' || msg[0] == 'B'){
+		return parseBatch(conn, cpy);
+	}
+	if(msg[0] == 'h' || msg[0] == 'H'){
+		return parseHistory(conn, cpy);
+	}
+	if(msg[0] == 'w' || msg[0] == 'W'){
+		return parseSubscribe(conn, cpy);
+	}
+	// Report a temperature
+	// Get the reported temperature data and record it
+	const char *reply = report_replies[submitReport(getData(cpy), &conn->commitLsn)];
+	return queueReply(conn, reply, strlen(reply) + 1);
+}
+
+/**
+ * Copies a fixed-width report into a temperature struct. City codes too long
+ * for the server fill the field without a null and are made invalid.
+ * @param report the report as received
+ * @param data the temperature struct to fill
+ */
+void decodeReport(const struct wp_report *report, struct Temp_Data *data)
+{
+	memcpy(data->city, report->city, MAX_CITY_LEN);
+	data->city[MAX_CITY_LEN] = '\0';
+	if(report->city[MAX_CITY_LEN] != '\0'){
+		strcpy(data->city, "inv");
+	}
+	data->hourstamp = ntohs(report->hourstamp);
+	data->temperature = ntohs(report->temperature);
+}
+
+/**
+ * Handles a binary batch report frame. The reply payload is the number of
+ * reports followed by the enum WP_STATUS of each.
+ * @param conn the connection the frame arrived on
+ * @param header the frame header, with its length in host byte order
+ * @param payload the frame payload
+ * @return 0 on success, or -1 if the reply could not be queued
+ */
+int handleBatchFrame(struct Connection *conn, struct wp_header *header, const char *payload)
+{
+	uint32_t count;
+	if(header->length < sizeof(count)){
+		return queueFrame(conn, WP_BATCH, WP_ERR_MALFORMED, NULL, 0);
+	}
+	memcpy(&count, payload, sizeof(count));
+	count = ntohl(count);
+	if(count > MAX_BATCH || header->length != sizeof(count) + count * sizeof(struct wp_report)){
+		return queueFrame(conn, WP_BATCH, WP_ERR_MALFORMED, NULL, 0);
+	}
+	struct Temp_Data *reports = malloc((count + 1) * sizeof(struct Temp_Data));
+	for(uint32_t i = 0; i < count; i++){
+		struct wp_report report;
+		memcpy(&report, payload + sizeof(count) + i * sizeof(report), sizeof(report));
+		decodeReport(&report, &reports[i]);
+	}
+	submitBatch(reports, (int) count, conn->batch, conn->statuses + sizeof(count), &conn->commitLsn);
+	free(reports);
+	uint32_t netCount = htonl(count);
+	memcpy(conn->statuses, &netCount, sizeof(netCount));
+	return queueFrame(conn, WP_BATCH, WP_OK, conn->statuses, sizeof(count) + count);
+}
+
+/**
+ * Handles a binary subscription frame. The reply payload is the number of
+ * cities now subscribed to, and is followed by WP_PUSH frames of their current
+ * values. Unknown cities are skipped; if none is known the reply is WP_ERR_CITY.
+ * @param conn the connection the frame arrived on
+ * @param header the frame header, with its length in host byte order
+ * @param payload the frame payload
+ * @return 0 on success, or -1 if the reply could not be queued
+ */
+int handleSubscribeFrame(struct Connection *conn, struct wp_header *header, const char *payload)
+{
+	uint32_t count;
+	if(header->length < sizeof(count)){
+		return queueFrame(conn, WP_SUBSCRIBE, WP_ERR_MALFORMED, NULL, 0);
+	}
+	memcpy(&count, payload, sizeof(count));
+	count = ntohl(count);
+	if(header->length != sizeof(count) + (size_t) count * WP_CITY_LEN){
+		return queueFrame(conn, WP_SUBSCRIBE, WP_ERR_MALFORMED, NULL, 0);
+	}
+	int *cities = malloc((count + 1) * sizeof(int));
+	int valid = 0;
+	for(uint32_t i = 0; i < count; i++){
+		char city[WP_CITY_LEN + 1];
+		memcpy(city, payload + sizeof(count) + i * WP_CITY_LEN, WP_CITY_LEN);
+		city[WP_CITY_LEN] = '\0';
+		struct Temp_Data *entry = strlen(city) <= MAX_CITY_LEN ? isValidCity(city) : NULL;
+		if(entry != NULL){
+			cities[valid++] = (int) (entry - temp_array);
+		}
+	}
+	int result;
+	if(valid == 0){
+		result = queueFrame(conn, WP_SUBSCRIBE, WP_ERR_CITY, NULL, 0);
+	} else {
+		// Reply, then push the current value of each new city as a baseline
+		valid = subscribe(conn, cities, valid, 1);
+		uint32_t total = htonl((uint32_t) conn->subCount);
+		result = queueFrame(conn, WP_SUBSCRIBE, WP_OK, &total, sizeof(total));
+		if(result == 0){
+			result = queuePush(conn, cities, valid, 1);
+		}
+	}
+	free(cities);
+	return result;
+}
+
+/**
+ * Handles one binary frame, queuing its reply.
+ * @param conn the connection the frame arrived on
+ * @param header the frame header, with its length in host byte order
+ * @param payload the frame payload
+ * @return 0 on success, or -1 if the reply could not be queued
+ */
+int handleFrame(struct Connection *conn, struct wp_header *header, const char *payload)
+{
+	if(header->opcode == WP_HELLO){
+		// Agree on the highest version both sides understand
+		conn->version = header->version < WP_VERSION ? header->version : WP_VERSION;
+		return queueFrame(conn, WP_HELLO, conn->version > 0 ? WP_OK : WP_ERR_VERSION, NULL, 0);
+	}
+	if(header->version == 0 || header->version > WP_VERSION){
+		return queueFrame(conn, header->opcode, WP_ERR_VERSION, NULL, 0);
+	}
+	switch(header->opcode){
+		case WP_SHOW: {
+			struct Snapshot *snap = acquireSnapshot();
+			return queueSnapshot(conn, snap, snap->bin, snap->binLen);
+		}
+		case WP_REPORT: {
+			struct wp_report report;
+			struct Temp_Data data;
+			if(header->length != sizeof(report)){
+				return queueFrame(conn, WP_REPORT, WP_ERR_MALFORMED, NULL, 0);
+			}
+			memcpy(&report, payload, sizeof(report));
+			decodeReport(&report, &data);
+			return queueFrame(conn, WP_REPORT, submitReport(data, &conn->commitLsn), NULL, 0);
+		}
+		case WP_BATCH:
+			return handleBatchFrame(conn, header, payload);
+		case WP_SUBSCRIBE:
+			return handleSubscribeFrame(conn, header, payload);
+		case WP_REPLICATE: {
+			struct wp_replicate request;
+			if(!wal.replicate){
+				return queueFrame(conn, WP_REPLICATE, WP_ERR_READONLY, NULL, 0);
+			}
+			if(header->length != sizeof(request)){
+				return queueFrame(conn, WP_REPLICATE, WP_ERR_MALFORMED, NULL, 0);
+			}
+			// The connection's thread streams to the replica once the requests are handled
+			memcpy(&request, payload, sizeof(request));
+			conn->replicaFrom = be64toh(request.from);
+			conn->replicaEpoch = be64toh(request.epoch);
+			conn->replica = 1;
+			return 0;
+		}
+		case WP_STATS: {
+			char stats[4096];
+			int statsLen = renderStats(stats, sizeof(stats));
+			return queueFrame(conn, WP_STATS, WP_OK, stats, statsLen);
+		}
+		case WP_HISTORY: {
+			struct wp_history_query query;
+			struct wp_history reply;
+			struct Aggregate result;
+			char city[MAX_CITY_LEN + 1];
+			if(header->length != sizeof(query)){
+				return queueFrame(conn, WP_HISTORY, WP_ERR_MALFORMED, NULL, 0);
+			}
+			memcpy(&query, payload, sizeof(query));
+			memcpy(city, query.city, MAX_CITY_LEN);
+			city[MAX_CITY_LEN] = '\0';
+			int status = submitHistoryQuery(query.city[MAX_CITY_LEN] ? "inv" : city, (long) ntohl(query.hours), &result);
+			if(status != WP_OK){
+				return queueFrame(conn, WP_HISTORY, status, NULL, 0);
+			}
+			reply.sum = htobe64(result.sum);
+			reply.count = htonl(result.count);
+			reply.min = htons(result.min);
+			reply.max = htons(result.max);
+			return queueFrame(conn, WP_HISTORY, WP_OK, &reply, sizeof(reply));
+		}
+		default:
+			return queueFrame(conn, header->opcode, WP_ERR_OPCODE, NULL, 0);
+	}
+}
+
+/**
+ * Returns the enum Request_Type of a binary frame.
+ * @param opcode the frame's opcode
+ * @return the type of request
+ */
+int frameType(int opcode)
+{
+	switch(opcode){
+		case WP_HELLO: return REQ_HELLO;
+		case WP_SHOW: return REQ_SHOW;
+		case WP_REPORT: return REQ_REPORT;
+		case WP_BATCH: return REQ_BATCH;
+		case WP_HISTORY: return REQ_HISTORY;
+		case WP_SUBSCRIBE: return REQ_SUBSCRIBE;
+		case WP_STATS: return REQ_STATS;
+		default: return REQ_OTHER;
+	}
+}
+
+/**
+ * Returns the enum Request_Type of a text request.
+ * @param msg the request
+ * @param len the length of the request
+ * @return the type of request
+ */
+int textType(const char *msg, size_t len)
 {
-	// Check if hour stamp is not valid
-	if(data.hourstamp < 0 || data.hourstamp > 23){
-		return 0;
+	if(len == 5 && strncmp(msg, "stats", 5) == 0){
+		return REQ_STATS;
 	}
-	// Get the current hour and convert from GMT to EST (Note: GMT is 5 hours ahead)
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
-	int curr_sec = (int) tv.tv_sec; // in seconds
-	// Convert to current hour of the day
-	unsigned short curr_hour = (unsigned short) (curr_sec / SEC_IN_HOUR % 24 - 5); // in hours
-	// Check if current hour and requested hour are unequal
-	if(curr_hour != data.hourstamp){
-		return 0;
+	switch(msg[0]){
+		case 's': case 'S': return REQ_SHOW;
+		case 'b': case 'B': return REQ_BATCH;
+		case 'h': case 'H': return REQ_HISTORY;
+		case 'w': case 'W': return REQ_SUBSCRIBE;
+		default: return REQ_REPORT;
 	}
-	// Hour is current, so return valid
-	return 1;
 }
 
 /**
- * Records the temperature for the given city. If this is the initial reported temperature
- * for the given city, the current temperature is overwritten. Else, averages all reported
- * temperatures for this hour and assigns as the current temperature. If a new hour passes,
- * resets all cities' temperatures to their defaults and updates the current hourstamp.
- * @param data the temperature struct providing a temperature to report
+ * Parses every complete request in the connection's receive buffer, queuing a
+ * reply for each in order. A binary frame is complete once its header and payload
+ * have arrived. A text request ends at a null or newline character; text longer
+ * than a message is cut at MAX_DATA_LEN - 1 characters, and the rest of it, up
+ * to its delimiter, is discarded, even across reads, so every request gets one
+ * reply. Any partial request is kept for the next read.
+ * @param conn the connection whose requests to parse
+ * @return 0 on success, or -1 if the connection should be closed
  */
-void recordTemp(struct Temp_Data data)
-{
-	printf("\nRecording temp\n");
-	// Locate the city to record
-	for(int i = 0; i < NUM_CITIES; i++){
-		printf("I'm in the loop\n");
-		pthread_mutex_lock(&lock); // lock and parse
-		if(strcmp(data.city, temp_array[i].city) == 0){
-			// Check if a new hour has passed
-			if(temp_array[i].hourstamp != data.hourstamp){
-				// At a new hour, so overwrite with current hour and reset sumTemps
-				temp_array[i].hourstamp = data.hourstamp;
-				temp_array[i].sumTemps = 0;
-				temp_array[i].count = 0;
-			}
-			// Check if this is the first overwrite for the hour
-			if(temp_array[i].count == 0){ // No overwrites yet
-				// Overwrite temp and update count
-				temp_array[i].temperature = data.temperature;
-				temp_array[i].hourstamp = data.hourstamp;
-				temp_array[i].sumTemps += (unsigned long) data.temperature;
-				(temp_array[i].count)++;
-				pthread_mutex_unlock(&lock); // unlock before breaking
+int processRequests(struct Connection *conn)
+{
+	size_t pos = 0;
+	while(pos < conn->inLen){
+		const char *msg = conn->in + pos;
+		size_t avail = conn->inLen - pos;
+		if(conn->skipping){
+			// Discard the rest of a cut request, whatever its bytes, through its delimiter
+			const char *end = msg;
+			while(end < msg + avail && *end != '\0' && *end != '\n'){
+				end++;
+			}
+			conn->skipping = end == msg + avail;
+			pos += (size_t) (end - msg) + (end < msg + avail);
+		} else if((unsigned char) msg[0] == WP_MAGIC){
+			struct wp_header header;
+			if(avail < WP_HEADER_LEN){
 				break;
-			} else {
-				printf("Here we are, after count 1\n");
-				// Sum recorded temps and average, then floor
-				(temp_array[i].count)++;
-				temp_array[i].sumTemps += (unsigned long) data.temperature;
-				temp_array[i].temperature = (unsigned short) floor(((double) temp_array[i].sumTemps / temp_array[i].count));
-				temp_array[i].hourstamp = data.hourstamp;
-				pthread_mutex_unlock(&lock); // unlock before breaking
+			}
+			memcpy(&header, msg, WP_HEADER_LEN);
+			header.length = ntohl(header.length);
+			if(header.length > WP_MAX_PAYLOAD){
+				return -1;
+			}
+			if(avail < WP_HEADER_LEN + header.length){
 				break;
 			}
+			uint64_t start = nowNanos();
+			if(handleFrame(conn, &header, msg + WP_HEADER_LEN) < 0){
+				return -1;
+			}
+			statRequest(frameType(header.opcode), nowNanos() - start);
+			pos += WP_HEADER_LEN + header.length;
+		} else {
+			size_t limit = avail < MAX_DATA_LEN - 1 ? avail : MAX_DATA_LEN - 1;
+			size_t len = 0;
+			while(len < limit && msg[len] != '\0' && msg[len] != '\n'){
+				len++;
+			}
+			if(len == limit && len < MAX_DATA_LEN - 1){
+				break; // rest of the text has not arrived
+			}
+			// Skip empty messages, such as the newline after a null character
+			if(len > 0){
+				uint64_t start = nowNanos();
+				if(parseMessage(conn, msg, len) < 0){
+					return -1;
+				}
+				statRequest(textType(msg, len), nowNanos() - start);
+			}
+			// Step over the delimiter, or start discarding the rest of a cut request
+			if(len < avail && (msg[len] == '\0' || msg[len] == '\n')){
+				pos += len + 1;
+			} else {
+				pos += len;
+				conn->skipping = 1;
+			}
 		}
-		pthread_mutex_unlock(&lock);
 	}
+	// Keep any partial request at the front of the buffer
+	conn->inLen -= pos;
+	memmove(conn->in, conn->in + pos, conn->inLen);
+	return 0;
 }
 
 /**
- * Formats the data in the client message as a temperature struct.
- * A message is formatted request, city, hour, and then temperature.
- * @param msg the message from which to create a temperature struct
- * @return the temperature struct for this message
+ * Picks a random identity for this run of the primary. A primary restarted
+ * without a data directory numbers its log from 1 again, so replicas tell runs
+ * apart by epoch rather than by log position.
+ * @return the epoch, never 0
  */
-struct Temp_Data getData(char *msg)
+uint64_t newEpoch(void)
 {
-	struct Temp_Data data;
-	char *token;
-	strtok(msg, ":"); // request
-	// Check for invalid city
-	if((token = strtok(NULL, ":")) == NULL){
-		strcpy(data.city, "inv");
-	} else {
-		strcpy(data.city, token); // city
+	uint64_t epoch = 0;
+	int fd = open("/dev/urandom", O_RDONLY);
+	if(fd < 0 || read(fd, &epoch, sizeof(epoch)) != sizeof(epoch)){
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		epoch = ((uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec) ^ ((uint64_t) getpid() << 32);
 	}
-	// Check for invalid hourstamp
-	if((token = strtok(NULL, ":")) == NULL){
-		data.hourstamp = 25;
-	} else {
-		data.hourstamp = (unsigned short) atoi(token);
+	if(fd >= 0){
+		close(fd);
 	}
-	if((token = strtok(NULL, ":")) == NULL){
-		data.temperature = 0;
-	} else {
-		data.temperature = (unsigned short) atoi(token);
+	return epoch != 0 ? epoch : 1;
+}
+
+/**
+ * Sends one frame to a replica.
+ * @param sock the replica's socket
+ * @param opcode the frame's opcode
+ * @param first the start of the payload
+ * @param firstLen the length of the start of the payload
+ * @param rest the rest of the payload
+ * @param restLen the length of the rest of the payload
+ * @return 0 on success, or -1 if the replica can no longer be written to
+ */
+int sendReplicaFrame(int sock, int opcode, const void *first, size_t firstLen, const void *rest, size_t restLen)
+{
+	struct wp_header header = { WP_MAGIC, WP_VERSION, (uint8_t) (opcode | WP_REPLY), WP_OK, htonl((uint32_t) (firstLen + restLen)) };
+	if(writeAll(sock, &header, WP_HEADER_LEN) < 0 || writeAll(sock, first, firstLen) < 0
+	   || (restLen > 0 && writeAll(sock, rest, restLen) < 0)){
+		return -1;
 	}
-	
-	// Return a temperature struct
-	return data;
-} 
- 
+	statAdd(&threadStats()->bytesOut, WP_HEADER_LEN + firstLen + restLen);
+	return 0;
+}
+
 /**
- * Parses the client's request. If the the request is {s,S}, displays the current
- * temperature for each city. Else, interprets the client's message as a report and
- * generates a temperature struct for that message. If the client reports an invalid
- * city, sets the return message to "Error city code!". If the client reports an invalid
- * hourstamp, sets the return message to "Error hourstamp!". Else, sets the return message
- * to "Successfully report temperature!" to reply to the client.
- * @param msg the client's request to parse
+ * Streams this primary's updates to a replica until it disconnects. A replica
+ * that has applied nothing, that followed another run of the primary (whose
+ * log positions may repeat this run's), or that has fallen behind the records
+ * kept in memory, is first sent the whole state, captured like a checkpoint; records after its
+ * boundary follow in log order, at most REPL_BATCH per frame. An idle replica
+ * is sent a heartbeat every REPL_HEARTBEAT_MS, so it can measure its lag and
+ * notice a lost primary.
+ * @param conn the replica's connection
  */
-void parseMessage(char *msg)
+void streamToReplica(struct Connection *conn)
 {
-	// Determine if message is to show or receive temperatures
-	if(msg[0] == 's' || msg[0] == 'S'){
-		// Clear out first character
-		msg[0] = '\0';
-		// Generate the string of temps
-		getTemps(msg);
-	} else { // Report a temperature
-		// Make a copy of this string
-		int len = (int) sizeof(msg);
-		char cpy[len];
-		strcpy(cpy, msg);
-		// Get the reported temperature data
-		struct Temp_Data data = getData(cpy);
-		// Check if the city is invalid
-		if(!isValidCity(data)){
-			pthread_mutex_lock(&lock);
-			strcpy(msg, "Error city code!");
-			pthread_mutex_unlock(&lock); // unlock before breaking
-			return;
-		}
-		// Reset message and check if the timestamp is valid
-		if(!isValidTimestamp(data)){
-			pthread_mutex_lock(&lock);
-			strcpy(msg, "Error hourstamp!");
-			pthread_mutex_unlock(&lock);
-			return;
-		}
-		// Record the temperature for the given city
-		recordTemp(data);
-		pthread_mutex_lock(&lock);
-		strcpy(msg, "Successfully report temperature!");
-		pthread_mutex_unlock(&lock);
-	}
-}
-
-/**
- * Handles a client's request. Initially receives a message from a client
- * and parses it. Once parsed, acquires the resulting updated message and replies
- * back to the client. Then, waits to receive further messages from that client.
- * If the client terminates, closes the client socket.
+	uint64_t sent = conn->replicaFrom;
+	int needState = sent == 0 || conn->replicaEpoch != replication.epoch;
+	size_t updatesLen = sizeof(struct wp_updates) + REPL_BATCH * sizeof(struct wp_update);
+	char *updates = malloc(updatesLen);
+	struct wp_update *items = (struct wp_update *) (updates + sizeof(struct wp_updates));
+	__atomic_add_fetch(&replication.replicas, 1, __ATOMIC_RELAXED);
+	logFormat(LOG_INFO, "Replica connected from log record %llu", (unsigned long long) sent);
+	while(1){
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += REPL_HEARTBEAT_MS * 1000000L;
+		if(deadline.tv_nsec >= 1000000000L){
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_mutex_lock(&wal.lock);
+		while(wal.nextLsn - 1 == sent && pthread_cond_timedwait(&wal.appended, &wal.lock, &deadline) == 0){
+		}
+		uint64_t head = wal.nextLsn - 1;
+		uint64_t oldest = head >= REPL_RING_LEN ? head - REPL_RING_LEN + 1 : 1;
+		int sendState = needState || sent > head || sent + 1 < oldest;
+		uint32_t count = 0;
+		while(!sendState && sent + count < head && count < REPL_BATCH){
+			const struct Wal_Record *rec = &wal.ring[(sent + count + 1) & (REPL_RING_LEN - 1)];
+			struct wp_update *item = &items[count++];
+			item->lsn = htobe64(rec->lsn);
+			memcpy(item->city, rec->city, WP_CITY_LEN);
+			item->epochHour = htonl(rec->epochHour);
+			item->hourstamp = htons(rec->hourstamp);
+			item->temperature = htons(rec->temperature);
+		}
+		pthread_mutex_unlock(&wal.lock);
+
+		if(sendState){
+			size_t len;
+			char *image = captureState(head, &len);
+			uint64_t boundary[2] = { htobe64(replication.epoch), htobe64(head) };
+			int result = sendReplicaFrame(conn->sock, WP_STATE, boundary, sizeof(boundary), image, len);
+			free(image);
+			if(result < 0){
+				break;
+			}
+			__atomic_add_fetch(&replication.states, 1, __ATOMIC_RELAXED);
+			sent = head;
+			needState = 0;
+			continue;
+		}
+		struct wp_updates frame = { htobe64(head), htobe64(replication.epoch), htonl(count), 0 };
+		memcpy(updates, &frame, sizeof(frame));
+		if(sendReplicaFrame(conn->sock, WP_UPDATES, updates, sizeof(frame) + count * sizeof(struct wp_update), NULL, 0) < 0){
+			break;
+		}
+		__atomic_add_fetch(&replication.streamed, count, __ATOMIC_RELAXED);
+		sent += count;
+	}
+	__atomic_sub_fetch(&replication.replicas, 1, __ATOMIC_RELAXED);
+	LOG_TEXT(LOG_INFO, "Replica disconnected");
+	free(updates);
+}
+
+/**
+ * Handles a client's requests. Receives as much as the client has sent, parses
+ * every complete request, and sends all of the replies back together with a single
+ * writev(). Show requests are answered straight from the shared snapshot without
+ * copying it. Then, waits to receive further messages from that client, or, once
+ * the client subscribes, for changes to push. If the client terminates, closes
+ * the client socket.
  * @param clntSocket the socket of the client in which to receive and send messages
  */
 void HandleTCPClient(int clntSocket)
 {
-	char echoBuffer[MAX_DATA_LEN];
+	struct Connection *conn = calloc(1, sizeof(struct Connection));
 	int rcvMsgSize;
+	conn->sock = clntSocket;
+	conn->version = WP_VERSION;
+	conn->eventFd = -1;
+	pthread_mutex_init(&conn->pushLock, NULL);
+	struct Thread_Stats *ts = threadStats();
+	statAdd(&ts->connections, 1);
 	
-	// Receive message from client
-	if((rcvMsgSize = recv(clntSocket, echoBuffer, MAX_DATA_LEN, 0)) < 0){
-		pthread_mutex_lock(&lock);
-		printf("recv() failed\n");
-		pthread_mutex_unlock(&lock); // unlock before breaking
-	}
-	
-	while(rcvMsgSize > 0){
-		parseMessage(echoBuffer);
-		// Calculate the new message length to send
-		rcvMsgSize = (int) sizeof(echoBuffer);
-		// Send the result back to client
-		if(send(clntSocket, echoBuffer, rcvMsgSize, 0) != rcvMsgSize){
-			pthread_mutex_lock(&lock);
-			printf("send() failed");
-			pthread_mutex_unlock(&lock); // unlock before breaking
+	while(1){
+		// Once subscribed, also wait for changes to push
+		if(conn->eventFd >= 0){
+			struct pollfd fds[2] = { { clntSocket, POLLIN, 0 }, { conn->eventFd, POLLIN, 0 } };
+			if(poll(fds, 2, -1) < 0 && errno != EINTR){
+				break;
+			}
+			if(fds[1].revents & POLLIN){
+				if(pushChanges(conn) < 0 || flushReplies(conn) < 0){
+					break;
+				}
+			}
+			if(!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))){
+				continue;
+			}
 		}
-		
-		// Receive the next message
-		if((rcvMsgSize = recv(clntSocket, (void *) echoBuffer, MAX_DATA_LEN, 0)) < 0){
-			pthread_mutex_lock(&lock);
-			printf("recv() failed\n");
-			pthread_mutex_unlock(&lock); // unlock before breaking
+		// Receive the next messages
+		if((rcvMsgSize = recv(clntSocket, conn->in + conn->inLen, IN_BUF_LEN - conn->inLen, 0)) <= 0){
+			if(rcvMsgSize < 0){
+				LOG_TEXT(LOG_WARN, "recv() failed");
+			}
+			break;
+		}
+		conn->inLen += rcvMsgSize;
+		statAdd(&ts->bytesIn, rcvMsgSize);
+		// Reply to everything received so far
+		if(processRequests(conn) < 0 || flushReplies(conn) < 0){
+			break;
+		}
+		if(conn->replica){
+			streamToReplica(conn);
+			break;
 		}
 	}
 	
 	// Close the client socket
+	unsubscribe(conn);
+	flushReplies(conn);
+	pthread_mutex_destroy(&conn->pushLock);
+	free(conn);
   close(clntSocket);
+	statAdd(&ts->closed, 1);
+	releaseThreadStats();
+	releaseThreadLog();
 }
 
 /**
@@ -315,6 +2958,366 @@ void *ThreadMain(void *args)
 	return (NULL);
 }
 
+/**
+ * Reads exactly len bytes.
+ * @param fd the file to read
+ * @param buf the buffer to fill
+ * @param len the number of bytes to read
+ * @return 0 on success, or -1 on end of file, timeout, or error
+ */
+int readAll(int fd, void *buf, size_t len)
+{
+	size_t got = 0;
+	while(got < len){
+		ssize_t count = read(fd, (char *) buf + got, len - got);
+		if(count <= 0){
+			if(count < 0 && errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		got += count;
+	}
+	return 0;
+}
+
+/**
+ * Applies a frame of updates from the primary, skipping records a city already
+ * reflects. The show snapshot is invalidated at most once per frame.
+ * @param payload the frame payload
+ * @param len the length of the payload
+ * @return 0 on success, or -1 if the frame is malformed or from another run of
+ * the primary than the whole state applied
+ */
+int applyUpdates(const char *payload, size_t len)
+{
+	struct wp_updates frame;
+	if(len < sizeof(frame)){
+		return -1;
+	}
+	memcpy(&frame, payload, sizeof(frame));
+	uint32_t count = ntohl(frame.count);
+	if(len != sizeof(frame) + count * sizeof(struct wp_update)
+	   || be64toh(frame.epoch) != __atomic_load_n(&replication.epoch, __ATOMIC_RELAXED)){
+		return -1;
+	}
+	int changed = 0;
+	uint64_t applied = __atomic_load_n(&replication.applied, __ATOMIC_RELAXED);
+	for(uint32_t i = 0; i < count; i++){
+		struct wp_update item;
+		memcpy(&item, payload + sizeof(frame) + i * sizeof(item), sizeof(item));
+		char city[MAX_CITY_LEN + 1];
+		memcpy(city, item.city, MAX_CITY_LEN);
+		city[MAX_CITY_LEN] = '\0';
+		uint64_t lsn = be64toh(item.lsn);
+		unsigned short temperature = ntohs(item.temperature);
+		struct Temp_Data *entry = isValidCity(city);
+		if(entry != NULL && lsn > entry->lsn){
+			changed |= applyTemps(entry, ntohs(item.hourstamp), ntohl(item.epochHour), &temperature, 1, &lsn);
+		}
+		applied = lsn;
+	}
+	if(changed){
+		__atomic_add_fetch(state_version, 1, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&replication.applied, applied, __ATOMIC_RELAXED);
+	__atomic_store_n(&replication.head, be64toh(frame.head), __ATOMIC_RELAXED);
+	__atomic_add_fetch(&replication.received, count, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/**
+ * Connects to the primary and asks to follow it from the last record applied,
+ * naming the run of the primary that numbered it.
+ * @return the connected socket, or -1 on failure
+ */
+int connectToPrimary(void)
+{
+	struct sockaddr_in addr;
+	int sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if(sock < 0){
+		return -1;
+	}
+	// A primary silent for longer than its heartbeats is presumed lost
+	struct timeval timeout = { REPL_TIMEOUT, 0 };
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(primary_port);
+	addr.sin_addr.s_addr = inet_addr(primary_host);
+	struct wp_replicate request = { htobe64(__atomic_load_n(&replication.applied, __ATOMIC_RELAXED)),
+	                                htobe64(__atomic_load_n(&replication.epoch, __ATOMIC_RELAXED)) };
+	struct wp_header header = { WP_MAGIC, WP_VERSION, WP_REPLICATE, 0, htonl(sizeof(request)) };
+	if(connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0
+	   || writeAll(sock, &header, WP_HEADER_LEN) < 0 || writeAll(sock, &request, sizeof(request)) < 0){
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/**
+ * Replication thread of a replica. Follows the primary, applying its whole
+ * state and then its updates as they stream in, and reconnects after a lost
+ * connection, resuming from the last record applied. Shows and history queries
+ * are served from the replicated cities like on any server.
+ * @param args unused
+ */
+void *replicaMain(void *args)
+{
+	char *payload = NULL;
+	size_t payloadCap = 0;
+	while(1){
+		int sock = connectToPrimary();
+		if(sock < 0){
+			sleep(1);
+			continue;
+		}
+		__atomic_store_n(&replication.connected, 1, __ATOMIC_RELAXED);
+		logFormat(LOG_INFO, "Replicating %s:%u", primary_host, primary_port);
+		uint64_t windowStart = nowNanos();
+		uint64_t windowReceived = __atomic_load_n(&replication.received, __ATOMIC_RELAXED);
+		while(1){
+			struct wp_header header;
+			if(readAll(sock, &header, WP_HEADER_LEN) < 0){
+				break;
+			}
+			header.length = ntohl(header.length);
+			if(header.length > payloadCap){
+				payloadCap = header.length;
+				payload = realloc(payload, payloadCap);
+			}
+			if(header.magic != WP_MAGIC || header.status != WP_OK || readAll(sock, payload, header.length) < 0){
+				if(header.status == WP_ERR_READONLY){
+					LOG_TEXT(LOG_ERROR, "The primary does not serve replicas; run it with -R");
+				}
+				break;
+			}
+			statAdd(&threadStats()->bytesIn, WP_HEADER_LEN + header.length);
+			int result = -1;
+			uint64_t epoch;
+			uint64_t boundary;
+			if(header.opcode == (WP_UPDATES | WP_REPLY)){
+				result = applyUpdates(payload, header.length);
+			} else if(header.opcode == (WP_STATE | WP_REPLY) && header.length >= sizeof(epoch) + sizeof(boundary)
+			          && restoreState(payload + sizeof(epoch) + sizeof(boundary), header.length - sizeof(epoch) - sizeof(boundary),
+			                          &boundary) == 0){
+				// Later updates must come from the run this state was captured in
+				memcpy(&epoch, payload, sizeof(epoch));
+				__atomic_store_n(&replication.epoch, be64toh(epoch), __ATOMIC_RELAXED);
+				__atomic_add_fetch(state_version, 1, __ATOMIC_RELEASE);
+				__atomic_store_n(&replication.applied, boundary, __ATOMIC_RELAXED);
+				__atomic_store_n(&replication.head, boundary, __ATOMIC_RELAXED);
+				__atomic_add_fetch(&replication.states, 1, __ATOMIC_RELAXED);
+				result = 0;
+			}
+			if(result < 0){
+				LOG_TEXT(LOG_ERROR, "Malformed frame from the primary");
+				break;
+			}
+			uint64_t now = nowNanos();
+			__atomic_store_n(&replication.lastFrame, now, __ATOMIC_RELAXED);
+			if(now - windowStart >= 1000000000ull){
+				uint64_t received = __atomic_load_n(&replication.received, __ATOMIC_RELAXED);
+				__atomic_store_n(&replication.rate, (received - windowReceived) * 1000000000ull / (now - windowStart), __ATOMIC_RELAXED);
+				windowStart = now;
+				windowReceived = received;
+			}
+		}
+		close(sock);
+		__atomic_store_n(&replication.connected, 0, __ATOMIC_RELAXED);
+		LOG_TEXT(LOG_WARN, "Lost the primary, reconnecting");
+		sleep(1);
+	}
+	return NULL;
+}
+
+/** Reports received over UDP and not yet submitted */
+struct Udp_Batch {
+	int count; // number of reports
+	struct Temp_Data reports[MAX_BATCH]; // the reports
+	struct Batch_Item items[MAX_BATCH]; // scratch space for submitBatch()
+	uint8_t statuses[MAX_BATCH]; // statuses from submitBatch(), which go unreported
+};
+
+/**
+ * Submits the reports gathered from UDP datagrams through the same path as a
+ * batch report. Datagrams are fire and forget, so the statuses are only
+ * counted and nobody waits for the reports to become durable.
+ * @param batch the gathered reports, emptied on return
+ */
+void flushUdpBatch(struct Udp_Batch *batch)
+{
+	uint64_t lsn = 0;
+	if(batch->count > 0){
+		submitBatch(batch->reports, batch->count, batch->items, batch->statuses, &lsn);
+		batch->count = 0;
+	}
+}
+
+/**
+ * Parses the reports of one UDP datagram into the batch, submitting the batch
+ * whenever it fills. A datagram holds either one text report or batch report,
+ * formatted as on a connection, or any number of binary REPORT and BATCH frames.
+ * @param batch the batch to add to
+ * @param data the datagram, with room for one more byte after it
+ * @param len the length of the datagram
+ * @return 0 on success, or -1 if the datagram is malformed
+ */
+int parseDatagram(struct Udp_Batch *batch, char *data, size_t len)
+{
+	if(len > 0 && (unsigned char) data[0] != WP_MAGIC){
+		struct Temp_Data reports[UDP_DATAGRAM_LEN / 4];
+		char *save;
+		data[len] = '\0';
+		if(data[0] != 'r' && data[0] != 'R' && data[0] != 'b' && data[0] != 'B'){
+			return -1;
+		}
+		if(data[0] == 'r' || data[0] == 'R'){
+			reports[0] = getData(data);
+			len = 1;
+		} else {
+			strtok_r(data, ":", &save); // request
+			int n = parseReports(&save, reports, UDP_DATAGRAM_LEN / 4);
+			if(n < 0){
+				return -1;
+			}
+			len = (size_t) n;
+		}
+		for(size_t i = 0; i < len; i++){
+			if(batch->count == MAX_BATCH){
+				flushUdpBatch(batch);
+			}
+			batch->reports[batch->count++] = reports[i];
+		}
+		return 0;
+	}
+	size_t pos = 0;
+	while(pos < len){
+		struct wp_header header;
+		if(len - pos < WP_HEADER_LEN){
+			return -1;
+		}
+		memcpy(&header, data + pos, WP_HEADER_LEN);
+		header.length = ntohl(header.length);
+		const char *payload = data + pos + WP_HEADER_LEN;
+		uint32_t count = 1;
+		if(header.magic != WP_MAGIC || header.length > len - pos - WP_HEADER_LEN){
+			return -1;
+		}
+		if(header.opcode == WP_BATCH){
+			if(header.length < sizeof(count)){
+				return -1;
+			}
+			memcpy(&count, payload, sizeof(count));
+			count = ntohl(count);
+			payload += sizeof(count);
+			if(header.length != sizeof(count) + count * sizeof(struct wp_report)){
+				return -1;
+			}
+		} else if(header.opcode != WP_REPORT || header.length != sizeof(struct wp_report)){
+			return -1;
+		}
+		for(uint32_t i = 0; i < count; i++){
+			struct wp_report report;
+			if(batch->count == MAX_BATCH){
+				flushUdpBatch(batch);
+			}
+			memcpy(&report, payload + i * sizeof(report), sizeof(report));
+			decodeReport(&report, &batch->reports[batch->count++]);
+		}
+		pos += WP_HEADER_LEN + header.length;
+	}
+	return 0;
+}
+
+/**
+ * UDP ingestion thread. Receives up to UDP_BATCH datagrams per recvmmsg() call,
+ * gathers every report they hold, and submits them together, so each city is
+ * locked and logged once per call rather than once per report. The kernel's
+ * count of datagrams dropped on a full receive buffer arrives with each datagram.
+ * @param args the UDP socket, cast to a pointer
+ */
+void *udpMain(void *args)
+{
+	int sock = (int) (intptr_t) args;
+	struct Thread_Stats *ts = threadStats();
+	struct Udp_Batch *batch = calloc(1, sizeof(struct Udp_Batch));
+	char *bufs = malloc(UDP_BATCH * (UDP_DATAGRAM_LEN + 1));
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iovs[UDP_BATCH];
+	char controls[UDP_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+	uint32_t lastDropped = 0;
+	while(1){
+		memset(msgs, 0, sizeof(msgs));
+		for(int i = 0; i < UDP_BATCH; i++){
+			iovs[i].iov_base = bufs + i * (UDP_DATAGRAM_LEN + 1);
+			iovs[i].iov_len = UDP_DATAGRAM_LEN;
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_control = controls[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+		}
+		// Block for the first datagram, then take whatever else is queued
+		int got = recvmmsg(sock, msgs, UDP_BATCH, MSG_WAITFORONE, NULL);
+		if(got < 0){
+			if(errno != EINTR){
+				logFormat(LOG_ERROR, "recvmmsg() failed: %s", strerror(errno));
+			}
+			continue;
+		}
+		statAdd(&ts->datagrams, got);
+		for(int i = 0; i < got; i++){
+			struct msghdr *hdr = &msgs[i].msg_hdr;
+			for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(hdr, cmsg)){
+				if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL){
+					uint32_t dropped;
+					memcpy(&dropped, CMSG_DATA(cmsg), sizeof(dropped));
+					statAdd(&ts->dropped, dropped - lastDropped);
+					lastDropped = dropped;
+				}
+			}
+			statAdd(&ts->bytesIn, msgs[i].msg_len);
+			if((hdr->msg_flags & MSG_TRUNC) || parseDatagram(batch, iovs[i].iov_base, msgs[i].msg_len) < 0){
+				statAdd(&ts->malformed, 1);
+			}
+		}
+		flushUdpBatch(batch);
+	}
+	return NULL;
+}
+
+/**
+ * Creates the UDP socket for fire and forget reports, with a large receive
+ * buffer and the kernel's drop count enabled.
+ * @param port the local port to receive on
+ * @return the socket ID, or -1 on failure
+ */
+int CreateUDPServerSocket(unsigned short port)
+{
+	int sock;
+	int on = 1;
+	int rcvbuf = UDP_RCVBUF;
+	struct sockaddr_in addr;
+
+	if((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0){
+		printf("socket() failed\n");
+		return -1;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if(bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0){
+		printf("bind() failed\n");
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
 /**
  * Creates the server socket for the stream. Binds the server to the local
  * address listens for some socket to connect to. Returns the socket ID for
@@ -334,6 +3337,11 @@ int CreateTCPServerSocket(unsigned short port)
 		printf("socket() failed\n");
 	}
       
+	// Allow a restarted server, such as a primary its replicas reconnect to, to
+	// bind while connections of its previous run linger in TIME_WAIT
+	int on = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+      
   // Construct local address structure
   memset(&echoServAddr, 0, sizeof(echoServAddr)); // zero out structure
   echoServAddr.sin_family = AF_INET; //Internet address family
@@ -371,7 +3379,7 @@ int AcceptTCPConnection(int servSock)
 	// Accept the client's connection
 	clntLen = sizeof(echoClntAddr);
 	if((clntSock = accept(servSock, (struct sockaddr *) &echoClntAddr, &clntLen)) < 0){
-		printf("accept() failed\n");
+		LOG_TEXT(LOG_WARN, "accept() failed");
 	}
 	
 	// Return the updated client socket
@@ -379,31 +3387,28 @@ int AcceptTCPConnection(int servSock)
 }
 
 /**
- * Main method for server program. Initiates connection with a client and handles multiple
- * active clients using multi-threading. Each thread then processes its own message and
- * terminates once its associated client disconnects from the server.
- * @param argc number of command line arguments
- * @param argv array of command line arguments
+ * Serves clients from this process: starts the server threads, then accepts
+ * connections on the listening socket, each handled by its own thread.
+ * @param servSock the listening socket
+ * @param udpSock the UDP socket for reports, or -1 if not receiving them
  */
-int main(int argc, char * argv[]) {
-	int servSock;
+void runServer(int servSock, int udpSock)
+{
 	int clntSock;
-	unsigned short echoServPort;
 	pthread_t threadID;
 	struct ThreadArgs *threadArgs;
 
-	signal(SIGPIPE,SIG_IGN);
-	init_array(temp_array);
-
-	if (argc != 2) {
-		printf("Usage: ./server <port>\n");
+	publishSnapshot();
+	if(pthread_create(&threadID, NULL, logMain, NULL) != 0
+	   || pthread_create(&threadID, NULL, clockMain, NULL) != 0
+	   || pthread_create(&threadID, NULL, notifierMain, NULL) != 0
+	   || (stats_interval > 0 && pthread_create(&threadID, NULL, statsMain, NULL) != 0)
+	   || (udpSock >= 0 && pthread_create(&threadID, NULL, udpMain, (void *) (intptr_t) udpSock) != 0)
+	   || (primary_host != NULL && pthread_create(&threadID, NULL, replicaMain, NULL) != 0)){
+		printf("Error creating thread\n");
 		exit(1);
 	}
 
-	// Set the server port
-	echoServPort = atoi(argv[1]);
-	servSock = CreateTCPServerSocket(echoServPort);
-	
 	while(1){
 		clntSock = AcceptTCPConnection(servSock);
 		
@@ -415,12 +3420,192 @@ int main(int argc, char * argv[]) {
 		
 		// Create client thread
 		if(pthread_create (&threadID, NULL, ThreadMain, (void *) threadArgs) != 0){
-			printf("Error creating thread\n");
+			LOG_TEXT(LOG_ERROR, "Error creating thread");
+		}
+	}
+}
+
+/**
+ * Forks a worker process that serves clients with the shared city table.
+ * @param servSock the listening socket
+ * @param udpSock the UDP socket for reports, or -1 if not receiving them
+ * @return the worker's process ID, or -1 if it could not be forked
+ */
+pid_t startWorker(int servSock, int udpSock)
+{
+	// Nothing buffered in the supervisor may be printed again by the worker
+	fflush(stdout);
+	pid_t pid = fork();
+	if(pid == 0){
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		runServer(servSock, udpSock);
+	}
+	return pid;
+}
+
+/** Set by a signal asking the supervisor to stop */
+volatile sig_atomic_t stopping;
+
+/**
+ * Asks the supervisor to stop.
+ * @param sig the signal received
+ */
+void stopSupervisor(int sig)
+{
+	stopping = 1;
+}
+
+/**
+ * Supervises the worker processes. Forks num_workers workers, all accepting
+ * on the same listening socket, and forks a new one whenever a worker exits.
+ * A worker that dies holding a city's lock leaves it to the next worker to
+ * lock the city. On SIGINT or SIGTERM, stops the workers and removes the
+ * shared memory segment.
+ * @param servSock the listening socket
+ * @param udpSock the UDP socket for reports, or -1 if not receiving them
+ */
+void superviseWorkers(int servSock, int udpSock)
+{
+	pid_t *workers = calloc(num_workers, sizeof(pid_t));
+	time_t *started = calloc(num_workers, sizeof(time_t));
+	struct sigaction action = { .sa_handler = stopSupervisor };
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	for(int i = 0; i < num_workers; i++){
+		workers[i] = startWorker(servSock, udpSock);
+		started[i] = time(NULL);
+	}
+	printf("Started %d workers sharing %s\n", num_workers, shm_name);
+	fflush(stdout);
+	while(!stopping){
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+		if(pid < 0){
+			if(errno == EINTR){
+				continue;
+			}
+			break;
+		}
+		for(int i = 0; i < num_workers; i++){
+			if(workers[i] != pid){
+				continue;
+			}
+			if(WIFSIGNALED(status)){
+				printf("Worker %d killed by signal %d, restarting\n", (int) pid, WTERMSIG(status));
+			} else {
+				printf("Worker %d exited with status %d, restarting\n", (int) pid, WEXITSTATUS(status));
+			}
+			// Keep a worker that fails at once from restarting in a tight loop
+			if(time(NULL) - started[i] < 1){
+				sleep(1);
+			}
+			workers[i] = startWorker(servSock, udpSock);
+			started[i] = time(NULL);
+		}
+	}
+	for(int i = 0; i < num_workers; i++){
+		if(workers[i] > 0){
+			kill(workers[i], SIGTERM);
+		}
+	}
+	while(wait(NULL) > 0){
+	}
+	shm_unlink(shm_name);
+	free(workers);
+	free(started);
+}
+
+/**
+ * Main method for server program. Initiates connection with a client and handles multiple
+ * active clients using multi-threading. Each thread then processes its own message and
+ * terminates once its associated client disconnects from the server. With "-w", several
+ * worker processes share the city table and serve clients this way, under a supervisor.
+ * @param argc number of command line arguments
+ * @param argv array of command line arguments
+ */
+int main(int argc, char * argv[]) {
+	int servSock;
+	unsigned short echoServPort;
+	int opt;
+	int udpPort = 0;
+	int udpSock = -1;
+
+	signal(SIGPIPE,SIG_IGN);
+
+	while((opt = getopt(argc, argv, "d:i:aS:u:vw:Rr:")) != -1){
+		switch(opt){
+			case 'd': // keep state in this directory
+				data_dir = optarg;
+				break;
+			case 'i': // seconds between checkpoints
+				checkpoint_interval = atoi(optarg);
+				break;
+			case 'a': // reply before reports are durable
+				wal.syncCommit = 0;
+				break;
+			case 'S': // seconds between statistics dumps
+				stats_interval = atoi(optarg);
+				break;
+			case 'u': // also receive reports over UDP on this port
+				udpPort = atoi(optarg);
+				break;
+			case 'v': // log every report
+				log_level = LOG_DEBUG;
+				break;
+			case 'w': // serve from this many worker processes
+				num_workers = atoi(optarg);
+				break;
+			case 'R': // serve replicas
+				wal.replicate = 1;
+				break;
+			case 'r': { // replicate the primary at host:port
+				char *colon = strrchr(optarg, ':');
+				if(colon == NULL){
+					argc = 0;
+					break;
+				}
+				*colon = '\0';
+				primary_host = optarg;
+				primary_port = (unsigned short) atoi(colon + 1);
+				break;
+			}
+			default:
+				argc = 0;
 		}
 	}
+	// The log has a single writer, so workers do not keep state on disk
+	if ((argc - optind != 1 && argc - optind != 2) || checkpoint_interval <= 0 || num_workers < 0
+	    || (num_workers > 0 && (data_dir != NULL || wal.replicate)) || (primary_host != NULL
+	    && (data_dir != NULL || num_workers > 0 || wal.replicate || udpPort > 0))) {
+		printf("Usage: ./server [-d data dir] [-i checkpoint secs] [-a] [-R] [-S stats secs] [-u udp port] [-v] <port> [city file]\n");
+		printf("       ./server -w workers [-S stats secs] [-u udp port] [-v] <port> [city file]\n");
+		printf("       ./server -r primary ip:port [-S stats secs] [-v] <port> [city file]\n");
+		exit(1);
+	}
+	init_array(argc - optind == 2 ? argv[optind + 1] : NULL);
+	tickClock();
+	if(wal.replicate){
+		wal.ring = calloc(REPL_RING_LEN, sizeof(struct Wal_Record));
+		replication.epoch = newEpoch();
+	}
+	if(data_dir != NULL){
+		recoverState();
+	}
+	if(udpPort > 0 && (udpSock = CreateUDPServerSocket((unsigned short) udpPort)) < 0){
+		printf("Error starting UDP listener\n");
+		exit(1);
+	}
+
+	// Set the server port
+	echoServPort = atoi(argv[optind]);
+	servSock = CreateTCPServerSocket(echoServPort);
+	if(num_workers > 0){
+		superviseWorkers(servSock, udpSock);
+	} else {
+		runServer(servSock, udpSock);
+	}
 	
 	// Code begins to differ here
 	return EXIT_SUCCESS;
 }
-
-
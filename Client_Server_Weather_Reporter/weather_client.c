@@ -0,0 +1,666 @@
+/* jegood Joshua Good */
+
+/**
+ * @file weather_client.c
+ * Non-blocking client library for the weather information service. See
+ * weather_client.h for its use.
+ */
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "weather_proto.h"
+#include "weather_client.h"
+
+/** Longest text command accepted by the server, including its null character */
+#define MAX_TEXT_LEN 128
+/** Bytes read from a connection at a time */
+#define READ_CHUNK 65536
+
+/** Connection states */
+enum Conn_State {
+	CONN_WAITING, // disconnected, waiting to reconnect
+	CONN_CONNECTING, // non-blocking connect in progress
+	CONN_UP // connected
+};
+
+/** A request awaiting its reply */
+struct Request {
+	wc_callback callback; // called with the reply, or NULL
+	void *arg; // passed to the callback
+	size_t len; // length of the request on the wire
+	int subscribe; // whether the request is a subscription
+};
+
+/** A subscription, sent again after each reconnect */
+struct Subscription {
+	char *data; // the request as sent
+	size_t len; // length of the request
+};
+
+/** One connection of a pool */
+struct Conn {
+	int fd; // socket, or -1 while waiting
+	int state; // enum Conn_State
+	uint64_t retryAt; // monotonic time in milliseconds of the next connect attempt
+	int backoffMs; // delay before the next connect attempt after a failure
+	char *out; // bytes of requests not yet written
+	size_t outLen; // bytes used in out
+	size_t outCap; // capacity of out
+	struct Request *requests; // ring of requests awaiting replies, in order
+	size_t head; // index of the oldest request in requests
+	size_t count; // number of requests in requests
+	size_t cap; // capacity of requests (a power of two)
+	size_t written; // requests at the front written in full
+	size_t partial; // bytes written of the first request not written in full
+	char *in; // bytes received but not yet parsed
+	size_t inLen; // bytes used in in
+	size_t inCap; // capacity of in
+	struct Subscription *subs; // subscriptions sent on this connection
+	int subCount; // number of subscriptions
+	int resend; // subscriptions, from the first, to send again on connecting
+};
+
+/** Pool of connections to one server */
+struct wc_pool {
+	struct wc_config config; // settings, with defaults filled in
+	struct sockaddr_in addr; // server address
+	struct Conn *conns; // the connections
+	wc_callback onPush; // called with each push, or NULL
+	void *pushArg; // passed to onPush
+	int callbacks; // callbacks run by the current wcPoll()
+};
+
+/** Reply to a request, to be waited for */
+struct wc_future {
+	int done; // whether the reply arrived
+	int abandoned; // whether the future was freed before the reply arrived
+	struct wc_reply reply; // the reply, once done
+	char *data; // copy of the reply data
+};
+
+/**
+ * Returns the current time of the monotonic clock in milliseconds.
+ * @return the current time
+ */
+static uint64_t nowMillis(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Returns a request of a connection.
+ * @param conn the connection
+ * @param i the position of the request, 0 for the oldest
+ * @return the request
+ */
+static struct Request *requestAt(struct Conn *conn, size_t i)
+{
+	return &conn->requests[(conn->head + i) & (conn->cap - 1)];
+}
+
+/**
+ * Runs a request's callback.
+ * @param pool the pool
+ * @param request the request
+ * @param reply the reply
+ */
+static void complete(struct wc_pool *pool, const struct Request *request, const struct wc_reply *reply)
+{
+	if(request->callback != NULL){
+		request->callback(request->arg, reply);
+		pool->callbacks++;
+	}
+}
+
+/**
+ * Fails the requests of a connection from the oldest up to a position.
+ * @param pool the pool
+ * @param conn the connection
+ * @param n the number of requests to fail
+ * @param status the enum WC_STATUS to fail them with
+ */
+static void failRequests(struct wc_pool *pool, struct Conn *conn, size_t n, int status)
+{
+	struct wc_reply reply = { status, 0, 0, 0, "", 0 };
+	for(size_t i = 0; i < n; i++){
+		struct Request request = *requestAt(conn, 0);
+		conn->head = (conn->head + 1) & (conn->cap - 1);
+		conn->count--;
+		complete(pool, &request, &reply);
+	}
+}
+
+/**
+ * Appends bytes to a buffer, growing it as needed.
+ * @param buf the buffer
+ * @param len the bytes used in the buffer
+ * @param cap the capacity of the buffer
+ * @param data the bytes to append
+ * @param dataLen the number of bytes to append
+ */
+static void append(char **buf, size_t *len, size_t *cap, const void *data, size_t dataLen)
+{
+	if(*len + dataLen > *cap){
+		*cap = *len + dataLen > 2 * *cap ? *len + dataLen : 2 * *cap;
+		*buf = realloc(*buf, *cap);
+	}
+	memcpy(*buf + *len, data, dataLen);
+	*len += dataLen;
+}
+
+/**
+ * Adds a request to the back or the front of a connection's queue. Requests
+ * only go to the front ahead of everything else, when nothing has been written.
+ * @param conn the connection
+ * @param request the request
+ * @param front whether to add it to the front
+ */
+static void pushRequest(struct Conn *conn, const struct Request *request, int front)
+{
+	if(conn->count == conn->cap){
+		size_t cap = conn->cap ? 2 * conn->cap : 16;
+		struct Request *requests = malloc(cap * sizeof(struct Request));
+		for(size_t i = 0; i < conn->count; i++){
+			requests[i] = *requestAt(conn, i);
+		}
+		free(conn->requests);
+		conn->requests = requests;
+		conn->cap = cap;
+		conn->head = 0;
+	}
+	if(front){
+		conn->head = (conn->head - 1) & (conn->cap - 1);
+		conn->requests[conn->head] = *request;
+	} else {
+		*requestAt(conn, conn->count) = *request;
+	}
+	conn->count++;
+}
+
+/**
+ * Drops a connection and schedules a reconnect. Requests written in whole or
+ * in part fail; the rest stay queued for the next connection.
+ * @param pool the pool
+ * @param conn the connection
+ */
+static void dropConn(struct wc_pool *pool, struct Conn *conn)
+{
+	if(conn->fd >= 0){
+		close(conn->fd);
+		conn->fd = -1;
+	}
+	size_t failed = conn->written;
+	if(conn->partial > 0){
+		// The rest of a partly written request leads out
+		size_t rest = requestAt(conn, conn->written)->len - conn->partial;
+		memmove(conn->out, conn->out + rest, conn->outLen - rest);
+		conn->outLen -= rest;
+		failed++;
+	}
+	conn->written = 0;
+	conn->partial = 0;
+	conn->inLen = 0;
+	failRequests(pool, conn, failed, WC_ERR_DISCONNECTED);
+	// Subscriptions still queued go out anyway; the ones written must be sent again
+	int pending = 0;
+	for(size_t i = 0; i < conn->count; i++){
+		pending += requestAt(conn, i)->subscribe;
+	}
+	conn->resend = conn->subCount - pending;
+	conn->state = CONN_WAITING;
+	// Spread reconnects of many clients with up to 50% jitter
+	conn->retryAt = nowMillis() + conn->backoffMs / 2 + rand() % (conn->backoffMs / 2 + 1);
+	conn->backoffMs = 2 * conn->backoffMs < pool->config.maxBackoffMs ? 2 * conn->backoffMs : pool->config.maxBackoffMs;
+}
+
+/**
+ * Starts a non-blocking connect.
+ * @param pool the pool
+ * @param conn the connection
+ */
+static void startConnect(struct wc_pool *pool, struct Conn *conn)
+{
+	int on = 1;
+	conn->fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if(conn->fd < 0){
+		dropConn(pool, conn);
+		return;
+	}
+	fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+	setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	if(connect(conn->fd, (struct sockaddr *) &pool->addr, sizeof(pool->addr)) == 0){
+		conn->state = CONN_UP;
+	} else if(errno == EINPROGRESS){
+		conn->state = CONN_CONNECTING;
+	} else {
+		dropConn(pool, conn);
+	}
+}
+
+/**
+ * Finishes connecting: resets the backoff and queues the subscriptions written
+ * on the previous connection ahead of every waiting request.
+ * @param conn the connection
+ * @param minBackoffMs the delay before the first reconnect attempt
+ */
+static void connected(struct Conn *conn, int minBackoffMs)
+{
+	conn->state = CONN_UP;
+	conn->backoffMs = minBackoffMs;
+	size_t len = 0;
+	for(int i = 0; i < conn->resend; i++){
+		len += conn->subs[i].len;
+	}
+	if(len == 0){
+		return;
+	}
+	char *out = malloc(len + conn->outLen);
+	size_t pos = 0;
+	for(int i = 0; i < conn->resend; i++){
+		memcpy(out + pos, conn->subs[i].data, conn->subs[i].len);
+		pos += conn->subs[i].len;
+	}
+	memcpy(out + pos, conn->out, conn->outLen);
+	free(conn->out);
+	conn->out = out;
+	conn->outLen += len;
+	conn->outCap = conn->outLen;
+	for(int i = conn->resend - 1; i >= 0; i--){
+		struct Request request = { NULL, NULL, conn->subs[i].len, 1 };
+		pushRequest(conn, &request, 1);
+	}
+	conn->resend = 0;
+}
+
+/**
+ * Writes as much of a connection's queued requests as the socket takes.
+ * @param pool the pool
+ * @param conn the connection
+ */
+static void flushConn(struct wc_pool *pool, struct Conn *conn)
+{
+	while(conn->outLen > 0){
+		ssize_t sent = send(conn->fd, conn->out, conn->outLen, MSG_NOSIGNAL);
+		if(sent < 0){
+			if(errno != EAGAIN && errno != EINTR){
+				dropConn(pool, conn);
+			}
+			return;
+		}
+		memmove(conn->out, conn->out + sent, conn->outLen - sent);
+		conn->outLen -= sent;
+		// Account the bytes to the requests they belong to
+		size_t n = (size_t) sent + conn->partial;
+		while(conn->written < conn->count && n >= requestAt(conn, conn->written)->len){
+			n -= requestAt(conn, conn->written)->len;
+			conn->written++;
+		}
+		conn->partial = n;
+	}
+}
+
+/**
+ * Handles one reply or push received on a connection.
+ * @param pool the pool
+ * @param conn the connection
+ * @param reply the reply
+ * @param push whether it is a push
+ * @return 0 on success, or -1 if no request awaits the reply
+ */
+static int handleReply(struct wc_pool *pool, struct Conn *conn, const struct wc_reply *reply, int push)
+{
+	if(push){
+		if(pool->onPush != NULL){
+			pool->onPush(pool->pushArg, reply);
+			pool->callbacks++;
+		}
+		return 0;
+	}
+	if(conn->written == 0){
+		return -1;
+	}
+	struct Request request = *requestAt(conn, 0);
+	conn->head = (conn->head + 1) & (conn->cap - 1);
+	conn->count--;
+	conn->written--;
+	complete(pool, &request, reply);
+	return 0;
+}
+
+/**
+ * Parses every complete reply received on a connection. Binary replies start
+ * with WP_MAGIC; text replies end with a null character, and text pushes start
+ * with "p:".
+ * @param pool the pool
+ * @param conn the connection
+ * @return 0 on success, or -1 if the server sent something unexpected
+ */
+static int parseReplies(struct wc_pool *pool, struct Conn *conn)
+{
+	size_t pos = 0;
+	int result = 0;
+	while(pos < conn->inLen && result == 0){
+		char *msg = conn->in + pos;
+		size_t avail = conn->inLen - pos;
+		struct wc_reply reply = { WC_OK, 0, 0, 0, NULL, 0 };
+		if((unsigned char) msg[0] == WP_MAGIC){
+			struct wp_header header;
+			if(avail < WP_HEADER_LEN){
+				break;
+			}
+			memcpy(&header, msg, WP_HEADER_LEN);
+			uint32_t length = ntohl(header.length);
+			if(avail - WP_HEADER_LEN < length){
+				break;
+			}
+			reply.binary = 1;
+			reply.opcode = header.opcode & ~WP_REPLY;
+			reply.frameStatus = header.status;
+			reply.data = msg + WP_HEADER_LEN;
+			reply.len = length;
+			pos += WP_HEADER_LEN + length;
+			result = handleReply(pool, conn, &reply, reply.opcode == WP_PUSH);
+		} else {
+			char *end = memchr(msg, '\0', avail);
+			if(end == NULL){
+				break;
+			}
+			reply.data = msg;
+			reply.len = end - msg;
+			pos += reply.len + 1;
+			result = handleReply(pool, conn, &reply, strncmp(msg, "p:", 2) == 0);
+		}
+	}
+	memmove(conn->in, conn->in + pos, conn->inLen - pos);
+	conn->inLen -= pos;
+	return result;
+}
+
+/**
+ * Reads everything a connection has received and handles the replies.
+ * @param pool the pool
+ * @param conn the connection
+ */
+static void readConn(struct wc_pool *pool, struct Conn *conn)
+{
+	while(conn->state == CONN_UP){
+		if(conn->inCap - conn->inLen < READ_CHUNK){
+			conn->inCap = conn->inLen + READ_CHUNK;
+			conn->in = realloc(conn->in, conn->inCap);
+		}
+		ssize_t got = recv(conn->fd, conn->in + conn->inLen, conn->inCap - conn->inLen, 0);
+		if(got < 0 && (errno == EAGAIN || errno == EINTR)){
+			return;
+		}
+		if(got <= 0){
+			dropConn(pool, conn);
+			return;
+		}
+		conn->inLen += got;
+		if(parseReplies(pool, conn) < 0){
+			dropConn(pool, conn);
+		}
+	}
+}
+
+/**
+ * Picks the connection for a new request: the connected one with the fewest
+ * requests outstanding, or, while none is connected, the one with the fewest
+ * requests queued.
+ * @param pool the pool
+ * @return the connection
+ */
+static struct Conn *pickConn(struct wc_pool *pool)
+{
+	struct Conn *best = &pool->conns[0];
+	for(int i = 1; i < pool->config.connections; i++){
+		struct Conn *conn = &pool->conns[i];
+		int up = conn->state == CONN_UP;
+		int bestUp = best->state == CONN_UP;
+		if(up > bestUp || (up == bestUp && conn->count < best->count)){
+			best = conn;
+		}
+	}
+	return best;
+}
+
+/**
+ * Queues a request on a connection and writes it if the connection is up.
+ * @param pool the pool
+ * @param first the start of the request
+ * @param firstLen the length of the start
+ * @param rest the rest of the request
+ * @param restLen the length of the rest
+ * @param subscribe whether the request is a subscription to send again after reconnecting
+ * @param callback called with the reply, or NULL
+ * @param arg passed to the callback
+ */
+static void queueRequest(struct wc_pool *pool, const void *first, size_t firstLen, const void *rest, size_t restLen,
+                         int subscribe, wc_callback callback, void *arg)
+{
+	struct Conn *conn = pickConn(pool);
+	struct Request request = { callback, arg, firstLen + restLen, subscribe };
+	append(&conn->out, &conn->outLen, &conn->outCap, first, firstLen);
+	append(&conn->out, &conn->outLen, &conn->outCap, rest, restLen);
+	pushRequest(conn, &request, 0);
+	if(subscribe){
+		conn->subs = realloc(conn->subs, (conn->subCount + 1) * sizeof(struct Subscription));
+		conn->subs[conn->subCount].data = malloc(request.len);
+		memcpy(conn->subs[conn->subCount].data, conn->out + conn->outLen - request.len, request.len);
+		conn->subs[conn->subCount++].len = request.len;
+	}
+	if(conn->state == CONN_UP){
+		flushConn(pool, conn);
+	}
+}
+
+struct wc_pool *wcOpen(const struct wc_config *config)
+{
+	struct wc_pool *pool = calloc(1, sizeof(struct wc_pool));
+	pool->config = *config;
+	if(pool->config.connections <= 0){
+		pool->config.connections = 1;
+	}
+	if(pool->config.minBackoffMs <= 0){
+		pool->config.minBackoffMs = 100;
+	}
+	if(pool->config.maxBackoffMs < pool->config.minBackoffMs){
+		pool->config.maxBackoffMs = pool->config.minBackoffMs > 5000 ? pool->config.minBackoffMs : 5000;
+	}
+	pool->addr.sin_family = AF_INET;
+	pool->addr.sin_port = htons(config->port);
+	if(config->host == NULL || inet_pton(AF_INET, config->host, &pool->addr.sin_addr) != 1){
+		free(pool);
+		return NULL;
+	}
+	pool->conns = calloc(pool->config.connections, sizeof(struct Conn));
+	for(int i = 0; i < pool->config.connections; i++){
+		pool->conns[i].fd = -1;
+		pool->conns[i].backoffMs = pool->config.minBackoffMs;
+		startConnect(pool, &pool->conns[i]);
+	}
+	return pool;
+}
+
+void wcClose(struct wc_pool *pool)
+{
+	for(int i = 0; i < pool->config.connections; i++){
+		struct Conn *conn = &pool->conns[i];
+		if(conn->fd >= 0){
+			close(conn->fd);
+		}
+		failRequests(pool, conn, conn->count, WC_ERR_CLOSED);
+		for(int j = 0; j < conn->subCount; j++){
+			free(conn->subs[j].data);
+		}
+		free(conn->subs);
+		free(conn->requests);
+		free(conn->out);
+		free(conn->in);
+	}
+	free(pool->conns);
+	free(pool);
+}
+
+void wcOnPush(struct wc_pool *pool, wc_callback callback, void *arg)
+{
+	pool->onPush = callback;
+	pool->pushArg = arg;
+}
+
+int wcSendText(struct wc_pool *pool, const char *command, wc_callback callback, void *arg)
+{
+	size_t len = strlen(command) + 1;
+	if(len > MAX_TEXT_LEN){
+		return -1;
+	}
+	queueRequest(pool, command, len, NULL, 0, command[0] == 'w' || command[0] == 'W', callback, arg);
+	return 0;
+}
+
+int wcSendFrame(struct wc_pool *pool, int opcode, const void *payload, size_t len, wc_callback callback, void *arg)
+{
+	if(len > WP_MAX_PAYLOAD){
+		return -1;
+	}
+	struct wp_header header = { WP_MAGIC, WP_VERSION, (uint8_t) opcode, 0, htonl((uint32_t) len) };
+	queueRequest(pool, &header, WP_HEADER_LEN, payload, len, opcode == WP_SUBSCRIBE, callback, arg);
+	return 0;
+}
+
+int wcPoll(struct wc_pool *pool, int timeoutMs)
+{
+	int n = pool->config.connections;
+	struct pollfd fds[n];
+	uint64_t now = nowMillis();
+	pool->callbacks = 0;
+	// Start due reconnects, and wait no longer than the next one
+	for(int i = 0; i < n; i++){
+		struct Conn *conn = &pool->conns[i];
+		if(conn->state == CONN_WAITING && conn->retryAt <= now){
+			startConnect(pool, conn);
+			if(conn->state == CONN_UP){
+				connected(conn, pool->config.minBackoffMs);
+			}
+		}
+		if(conn->state == CONN_WAITING){
+			int wait = (int) (conn->retryAt - now);
+			if(timeoutMs < 0 || wait < timeoutMs){
+				timeoutMs = wait;
+			}
+		}
+		fds[i].fd = conn->fd;
+		fds[i].events = conn->state == CONN_CONNECTING || conn->outLen > 0 ? POLLOUT : 0;
+		fds[i].events |= conn->state == CONN_UP ? POLLIN : 0;
+		fds[i].revents = 0;
+	}
+	if(poll(fds, n, timeoutMs) < 0){
+		return errno == EINTR ? pool->callbacks : -1;
+	}
+	for(int i = 0; i < n; i++){
+		struct Conn *conn = &pool->conns[i];
+		if(fds[i].revents == 0 || conn->fd != fds[i].fd){
+			continue;
+		}
+		if(conn->state == CONN_CONNECTING){
+			int err = 0;
+			socklen_t errLen = sizeof(err);
+			if(getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &errLen) < 0 || err != 0){
+				dropConn(pool, conn);
+				continue;
+			}
+			connected(conn, pool->config.minBackoffMs);
+		}
+		if(fds[i].revents & (POLLIN | POLLHUP | POLLERR)){
+			readConn(pool, conn);
+		}
+		if(conn->state == CONN_UP && conn->outLen > 0){
+			flushConn(pool, conn);
+		}
+	}
+	return pool->callbacks;
+}
+
+/**
+ * Completes a future with a reply, or frees it if it was abandoned.
+ * @param arg the future
+ * @param reply the reply
+ */
+static void completeFuture(void *arg, const struct wc_reply *reply)
+{
+	struct wc_future *future = arg;
+	if(future->abandoned){
+		free(future);
+		return;
+	}
+	future->reply = *reply;
+	future->data = malloc(reply->len + 1);
+	memcpy(future->data, reply->data, reply->len);
+	future->data[reply->len] = '\0';
+	future->reply.data = future->data;
+	future->done = 1;
+}
+
+struct wc_future *wcRequestText(struct wc_pool *pool, const char *command)
+{
+	struct wc_future *future = calloc(1, sizeof(struct wc_future));
+	if(wcSendText(pool, command, completeFuture, future) < 0){
+		free(future);
+		return NULL;
+	}
+	return future;
+}
+
+struct wc_future *wcRequestFrame(struct wc_pool *pool, int opcode, const void *payload, size_t len)
+{
+	struct wc_future *future = calloc(1, sizeof(struct wc_future));
+	if(wcSendFrame(pool, opcode, payload, len, completeFuture, future) < 0){
+		free(future);
+		return NULL;
+	}
+	return future;
+}
+
+const struct wc_reply *wcWait(struct wc_pool *pool, struct wc_future *future, int timeoutMs)
+{
+	uint64_t deadline = nowMillis() + (timeoutMs < 0 ? 0 : timeoutMs);
+	while(!future->done){
+		int left = -1;
+		if(timeoutMs >= 0){
+			uint64_t now = nowMillis();
+			if(now >= deadline){
+				return NULL;
+			}
+			left = (int) (deadline - now);
+		}
+		if(wcPoll(pool, left) < 0){
+			return NULL;
+		}
+	}
+	return &future->reply;
+}
+
+void wcFutureFree(struct wc_future *future)
+{
+	if(future == NULL){
+		return;
+	}
+	if(!future->done){
+		future->abandoned = 1;
+		return;
+	}
+	free(future->data);
+	free(future);
+}
@@ -0,0 +1,151 @@
+/* jegood Joshua Good */
+
+/**
+ * @file weather_client.h
+ * Non-blocking client library for the weather information service. A pool keeps
+ * several connections to one server, spreads requests over them, and pipelines
+ * them: each request is written as soon as its connection can take it, and its
+ * callback runs when the reply arrives, in order per connection. Futures wrap the
+ * callbacks for callers that would rather wait. Connections are non-blocking and
+ * reconnect on their own, backing off exponentially between attempts.
+ *
+ * The library starts no threads: the caller drives all I/O with wcPoll(), which
+ * also runs the callbacks, so a gateway can call it from its own event loop. A
+ * pool must be used from one thread at a time.
+ *
+ * Requests written to a connection that then drops fail with WC_ERR_DISCONNECTED,
+ * since a report may or may not have been applied; requests not yet written wait
+ * for the next connection. Subscriptions are sent again after a reconnect.
+ */
+
+#ifndef WEATHER_CLIENT_H
+#define WEATHER_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Outcomes of a request, besides the status the server puts in a binary reply */
+enum WC_STATUS {
+	WC_OK = 0, // the server replied
+	WC_ERR_DISCONNECTED = 1, // the connection dropped after the request was written
+	WC_ERR_CLOSED = 2 // the pool was closed before the server replied
+};
+
+/** Settings of a pool */
+struct wc_config {
+	const char *host; // server IPv4 address
+	unsigned short port; // server port
+	int connections; // number of connections to keep, 1 if 0
+	int minBackoffMs; // delay before the first reconnect attempt, 100 if 0
+	int maxBackoffMs; // longest delay between reconnect attempts, 5000 if 0
+};
+
+/** A reply, or a push from the server */
+struct wc_reply {
+	int status; // enum WC_STATUS
+	int binary; // whether the reply is a binary frame rather than text
+	int opcode; // enum WP_OPCODE of a binary reply, without WP_REPLY
+	int frameStatus; // enum WP_STATUS of a binary reply
+	const char *data; // text reply, null terminated, or binary payload; valid during the callback
+	size_t len; // length of data, without the null character of a text reply
+};
+
+/** Called with each reply, or with each push */
+typedef void (*wc_callback)(void *arg, const struct wc_reply *reply);
+
+/** Pool of connections to one server */
+struct wc_pool;
+
+/** Reply to a request, to be waited for */
+struct wc_future;
+
+/**
+ * Creates a pool and starts connecting. Fails only on invalid settings; an
+ * unreachable server is retried.
+ * @param config the settings of the pool
+ * @return the pool, or NULL if the settings are invalid
+ */
+struct wc_pool *wcOpen(const struct wc_config *config);
+
+/**
+ * Closes every connection and frees the pool. Outstanding requests complete
+ * with WC_ERR_CLOSED.
+ * @param pool the pool
+ */
+void wcClose(struct wc_pool *pool);
+
+/**
+ * Sets the callback for pushes of subscribed cities, text or binary.
+ * @param pool the pool
+ * @param callback the callback, or NULL to ignore pushes
+ * @param arg passed to the callback
+ */
+void wcOnPush(struct wc_pool *pool, wc_callback callback, void *arg);
+
+/**
+ * Queues a text command, such as "s" or "r:RDU:12:70".
+ * @param pool the pool
+ * @param command the null terminated command
+ * @param callback called with the reply, or NULL to ignore it
+ * @param arg passed to the callback
+ * @return 0 on success, or -1 if the command is too long
+ */
+int wcSendText(struct wc_pool *pool, const char *command, wc_callback callback, void *arg);
+
+/**
+ * Queues a binary request frame.
+ * @param pool the pool
+ * @param opcode the enum WP_OPCODE of the request
+ * @param payload the request payload
+ * @param len the length of the payload
+ * @param callback called with the reply, or NULL to ignore it
+ * @param arg passed to the callback
+ * @return 0 on success, or -1 if the payload is too long
+ */
+int wcSendFrame(struct wc_pool *pool, int opcode, const void *payload, size_t len, wc_callback callback, void *arg);
+
+/**
+ * Waits for I/O on the pool's connections for at most the given time and
+ * handles it: connects, writes queued requests, reads replies, and runs their
+ * callbacks.
+ * @param pool the pool
+ * @param timeoutMs the longest time to wait, or -1 to wait for some I/O
+ * @return the number of callbacks run, or -1 on error
+ */
+int wcPoll(struct wc_pool *pool, int timeoutMs);
+
+/**
+ * Queues a text command and returns a future for its reply.
+ * @param pool the pool
+ * @param command the null terminated command
+ * @return the future, or NULL if the command is too long
+ */
+struct wc_future *wcRequestText(struct wc_pool *pool, const char *command);
+
+/**
+ * Queues a binary request frame and returns a future for its reply.
+ * @param pool the pool
+ * @param opcode the enum WP_OPCODE of the request
+ * @param payload the request payload
+ * @param len the length of the payload
+ * @return the future, or NULL if the payload is too long
+ */
+struct wc_future *wcRequestFrame(struct wc_pool *pool, int opcode, const void *payload, size_t len);
+
+/**
+ * Drives the pool until a future completes.
+ * @param pool the pool the future's request was queued on
+ * @param future the future
+ * @param timeoutMs the longest time to wait, or -1 to wait until it completes
+ * @return the completed reply, valid until the future is freed, or NULL on timeout
+ */
+const struct wc_reply *wcWait(struct wc_pool *pool, struct wc_future *future, int timeoutMs);
+
+/**
+ * Frees a future. A future whose request is still outstanding is freed once
+ * its reply arrives.
+ * @param future the future
+ */
+void wcFutureFree(struct wc_future *future);
+
+#endif
@@ -0,0 +1,89 @@
+/* jegood Joshua Good */
+
+/**
+ * @file weather_hist.h
+ * Log-linear latency histograms shared by the client's load generator and the
+ * server's statistics, so both bucket times the same way. Values below
+ * 2 * HIST_SUB_BUCKETS have a bucket each; above that, each power of two is
+ * split into HIST_SUB_BUCKETS equal buckets, so every bucket is within
+ * 1 / HIST_SUB_BUCKETS of its lowest value. Times are in nanoseconds of the
+ * monotonic clock.
+ */
+
+#ifndef WEATHER_HIST_H
+#define WEATHER_HIST_H
+
+#include <stdint.h>
+#include <time.h>
+
+/** Log base 2 of the sub-buckets per power of two */
+#define HIST_SUB_BITS 4
+/** Sub-buckets per power of two in a histogram, giving about 6% precision */
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+/** Number of buckets in a histogram, enough for any 64-bit value */
+#define HIST_BUCKETS (64 * HIST_SUB_BUCKETS)
+
+/**
+ * Returns the current time of the monotonic clock in nanoseconds.
+ * @return the current time
+ */
+static inline uint64_t nowNanos(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Returns the histogram bucket of a value.
+ * @param value the value
+ * @return the bucket index
+ */
+static inline int histBucket(uint64_t value)
+{
+	if(value < 2 * HIST_SUB_BUCKETS){
+		return (int) value;
+	}
+	int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+	return shift * HIST_SUB_BUCKETS + (int) (value >> shift);
+}
+
+/**
+ * Returns the lowest value falling in a histogram bucket.
+ * @param bucket the bucket index
+ * @return the lowest value of the bucket
+ */
+static inline uint64_t histValue(int bucket)
+{
+	if(bucket < 2 * HIST_SUB_BUCKETS){
+		return (uint64_t) bucket;
+	}
+	int shift = bucket / HIST_SUB_BUCKETS - 1;
+	return (uint64_t) (bucket - shift * HIST_SUB_BUCKETS) << shift;
+}
+
+/**
+ * Returns the value at a percentile of a histogram.
+ * @param counts the values recorded per bucket, HIST_BUCKETS of them
+ * @param total the number of values recorded
+ * @param percentile the percentile, from 0 to 100
+ * @return the lowest value of the bucket holding the percentile, or 0 if the
+ * histogram is empty
+ */
+static inline uint64_t histPercentile(const uint64_t *counts, uint64_t total, double percentile)
+{
+	uint64_t target = (uint64_t) (percentile / 100.0 * total + 0.5);
+	uint64_t seen = 0;
+	if(target == 0){
+		target = 1;
+	}
+	for(int i = 0; i < HIST_BUCKETS; i++){
+		seen += counts[i];
+		if(seen >= target){
+			return histValue(i);
+		}
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,141 @@
+/* jegood Joshua Good */
+
+/**
+ * @file weather_proto.h
+ * Binary framing for the weather information service. A binary frame starts with
+ * WP_MAGIC, which never begins a text command, so clients may mix binary frames
+ * with the original null-terminated text commands on the same connection. Every
+ * frame is a fixed header followed by a payload of the length given in the header.
+ * All multi-byte fields, including 64-bit ones, are in network byte order. Clients may send several frames
+ * without waiting; the server answers them in order.
+ */
+
+#ifndef WEATHER_PROTO_H
+#define WEATHER_PROTO_H
+
+#include <stdint.h>
+
+/** First byte of every binary frame */
+#define WP_MAGIC 0xB7
+/** Highest protocol version understood by this build */
+#define WP_VERSION 1
+/** Set in the opcode of every reply */
+#define WP_REPLY 0x80
+/** Size of a city code field, including its null padding */
+#define WP_CITY_LEN 8
+/** Largest payload accepted in a frame */
+#define WP_MAX_PAYLOAD 65000
+/** Most reports carried by one batch frame */
+#define WP_MAX_BATCH 4096
+
+/** Frame opcodes */
+enum WP_OPCODE {
+	WP_HELLO = 1, // negotiate the protocol version, no payload
+	WP_SHOW = 2, // request the temperature of every city, no payload
+	WP_REPORT = 3, // report a temperature, payload is one struct wp_report
+	WP_BATCH = 4, // report many temperatures, payload is a uint32_t count followed by
+	              // count struct wp_report; the reply payload is the count followed by
+	              // one enum WP_STATUS byte per report
+	WP_HISTORY = 5, // summarize a city's recent hours, payload is one struct wp_history_query,
+	                // reply payload is one struct wp_history
+	WP_SUBSCRIBE = 6, // subscribe to changes, payload is a uint32_t count followed by count
+	                  // null padded city codes; the reply payload is a uint32_t count of
+	                  // cities now subscribed to
+	WP_PUSH = 7, // sent by the server with WP_REPLY set, without a request, whenever
+	             // subscribed cities change; payload is laid out like a show reply
+	WP_STATS = 8, // request server statistics, no payload; the reply payload is the
+	              // statistics as text, without a terminating null
+	WP_REPLICATE = 9, // follow the server as a replica, payload is one struct wp_replicate;
+	                  // the server then streams WP_STATE and WP_UPDATES frames until the
+	                  // connection closes
+	WP_STATE = 10, // sent with WP_REPLY to a replica: the uint64_t epoch of the primary's
+	               // run and a uint64_t log position, followed by every city in the
+	               // server's checkpoint format, so replicas must share the primary's
+	               // architecture; may exceed WP_MAX_PAYLOAD
+	WP_UPDATES = 11 // sent with WP_REPLY to a replica: one struct wp_updates followed by
+	                // count struct wp_update, in log order; sent empty as a heartbeat
+};
+
+/** Reply statuses */
+enum WP_STATUS {
+	WP_OK = 0, // request succeeded
+	WP_ERR_CITY = 1, // unknown city code
+	WP_ERR_HOUR = 2, // hourstamp is not the current hour
+	WP_ERR_MALFORMED = 3, // payload has the wrong size
+	WP_ERR_VERSION = 4, // version not supported
+	WP_ERR_OPCODE = 5, // unknown opcode
+	WP_ERR_READONLY = 6 // the server is a replica, which takes no reports, or does not
+	                    // serve replicas
+};
+
+/** Header of every frame */
+struct wp_header {
+	uint8_t magic; // WP_MAGIC
+	uint8_t version; // protocol version of the frame
+	uint8_t opcode; // enum WP_OPCODE, with WP_REPLY set in replies
+	uint8_t status; // enum WP_STATUS in replies, 0 in requests
+	uint32_t length; // payload length
+};
+
+/** Payload of a report request */
+struct wp_report {
+	char city[WP_CITY_LEN]; // city code, null padded
+	uint16_t hourstamp; // hour of the report
+	uint16_t temperature; // reported temperature
+};
+
+/** Payload of a show reply: this header followed by count entries */
+struct wp_show {
+	uint32_t version; // state version the reply was rendered from
+	uint32_t count; // number of entries that follow
+};
+
+/** One city in a show reply */
+struct wp_show_entry {
+	char city[WP_CITY_LEN]; // city code, null padded
+	uint16_t temperature; // current temperature
+	uint16_t hourstamp; // hour of the current temperature
+};
+
+/** Payload of a history query */
+struct wp_history_query {
+	char city[WP_CITY_LEN]; // city code, null padded
+	uint32_t hours; // number of most recent hours to cover, including the current one
+};
+
+/** Payload of a history reply */
+struct wp_history {
+	uint64_t sum; // sum of the temperatures reported in the range
+	uint32_t count; // number of temperatures reported in the range
+	uint16_t min; // lowest temperature reported, if count is not 0
+	uint16_t max; // highest temperature reported, if count is not 0
+};
+
+/** Payload of a replicate request */
+struct wp_replicate {
+	uint64_t from; // last log position the replica applied, or 0 for the whole state
+	uint64_t epoch; // epoch of the primary run that numbered from, or 0 if none; positions
+	                // of another run mean nothing, so the replica is sent the whole state
+};
+
+/** Header of an updates frame */
+struct wp_updates {
+	uint64_t head; // last log position on the primary
+	uint64_t epoch; // random identity of the primary's run, which numbers its log
+	uint32_t count; // number of updates that follow
+	uint32_t reserved; // zero
+};
+
+/** One report applied by the primary */
+struct wp_update {
+	uint64_t lsn; // log position of the report
+	char city[WP_CITY_LEN]; // city code, null padded
+	uint32_t epochHour; // hour since the Unix epoch when the report was recorded
+	uint16_t hourstamp; // hour of the report
+	uint16_t temperature; // reported temperature
+};
+
+/** Size of a frame header on the wire */
+#define WP_HEADER_LEN ((int) sizeof(struct wp_header))
+
+#endif
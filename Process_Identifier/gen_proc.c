@@ -0,0 +1,178 @@
+/**
+ * @file gen_proc.c
+ * @author Joshua Good (jegood)
+ * Writes a synthetic process tree laid out like "/proc" into a directory, so
+ * p3 can be run with "-P<directory>" against a process table of any size that
+ * stays the same from run to run. Each process gets a directory named by its
+ * id holding a stat file, with every field proc(5) lists, and a statm file.
+ * Processes form a tree of the given depth in which each process has up to
+ * the given number of children, filled breadth first; processes that do not
+ * fit in it are children of process 1, like orphans adopted by init. Names
+ * include spaces and parentheses, as real ones may. The tree depends only on
+ * the arguments, so generating it twice gives the same files.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Default number of processes
+#define DEFAULT_PROCS 10000
+// Default number of levels in the tree, counting process 1
+#define DEFAULT_DEPTH 8
+// Default number of children of each process
+#define DEFAULT_FANOUT 4
+
+// Names given to processes, some with spaces and parentheses
+static const char *names[] = {
+  "systemd", "kthreadd", "kworker/0:1-events", "bash", "sshd", "(sd-pam)",
+  "Web Content", "tmux: server", "my (odd) app", "python3", "cron", ") x (",
+  "Isolated Web Co", "postgres", "node", "a b c"
+};
+
+// State of the pseudo-random generator
+static unsigned long long seed = 88172645463325252ULL;
+
+/**
+ * Returns the next pseudo-random number, from a xorshift generator with a
+ * fixed seed so every run generates the same tree.
+ * @return the number
+ */
+unsigned long long nextRandom()
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 7;
+  seed ^= seed << 17;
+  return seed;
+}
+
+/**
+ * Writes a file, replacing it if it exists.
+ * @param path the file
+ * @param text the contents
+ * @param len the length of the contents
+ */
+void writeFile(const char *path, const char *text, int len)
+{
+  /** The file */
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if(fd < 0 || write(fd, text, len) != len){
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  close(fd);
+}
+
+/**
+ * Creates a directory, unless it exists.
+ * @param path the directory
+ */
+void makeDirectory(const char *path)
+{
+  if(mkdir(path, 0755) < 0 && errno != EEXIST){
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * Main operation for the program. Generates the tree described by the
+ * command line: "gen_proc <directory> [processes] [depth] [fan-out]".
+ * @param argc number of command line arguments
+ * @param argv command line arguments
+ * @return exit status
+ */
+int main(int argc, char *argv[])
+{
+  /** Number of processes */
+  int count = argc > 2 ? atoi(argv[2]) : DEFAULT_PROCS;
+  /** Number of levels in the tree */
+  int depth = argc > 3 ? atoi(argv[3]) : DEFAULT_DEPTH;
+  /** Number of children of each process */
+  int fanout = argc > 4 ? atoi(argv[4]) : DEFAULT_FANOUT;
+  /** Path of a file being written */
+  char path[4096];
+  /** Contents of a file being written */
+  char text[1024];
+
+  if(argc < 2 || count < 1 || depth < 1 || fanout < 1){
+    fprintf(stderr, "usage: %s <directory> [processes] [depth] [fan-out]\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  /** Process ids */
+  int *pids = malloc(count * sizeof(int));
+  /** Level of each process in the tree, 0 for process 1 */
+  int *levels = malloc(count * sizeof(int));
+  /** Number of children given to each process */
+  int *children = calloc(count, sizeof(int));
+  /** Next process to be given children */
+  int next = 0;
+
+  makeDirectory(argv[1]);
+  // Entries of "/proc" that are not processes, which a scan skips
+  snprintf(path, sizeof(path), "%s/sys", argv[1]);
+  makeDirectory(path);
+  snprintf(path, sizeof(path), "%s/uptime", argv[1]);
+  writeFile(path, "12345.67 45678.90\n", 18);
+  for(int i = 0; i < count; i++){
+    /** The parent's index, or -1 for process 1 */
+    int parent = -1;
+    // Ids increase with small gaps, like those left by exited processes
+    pids[i] = i == 0 ? 1 : pids[i - 1] + 1 + (int) (nextRandom() % 3);
+    levels[i] = 0;
+    if(i > 0){
+      // Give children to processes breadth first, and the rest to process 1
+      while(next < i && (children[next] == fanout || levels[next] + 1 >= depth)){
+        next++;
+      }
+      parent = next < i ? next : 0;
+      children[parent]++;
+      levels[i] = levels[parent] + 1;
+    }
+
+    /** Name of the process */
+    const char *name = names[nextRandom() % (sizeof(names) / sizeof(names[0]))];
+    /** Ticks spent in user mode */
+    unsigned long utime = nextRandom() % 100000;
+    /** Ticks spent in kernel mode */
+    unsigned long stime = nextRandom() % 20000;
+    /** Pages resident */
+    unsigned long rss = 100 + nextRandom() % 50000;
+    /** Number of threads */
+    int threads = nextRandom() % 8 == 0 ? 2 + (int) (nextRandom() % 30) : 1;
+    /** Address of the program text */
+    unsigned long code = 0x55550000UL + (nextRandom() % 0x10000) * 0x1000;
+    /** Minor page faults */
+    unsigned long minor = 1000 + nextRandom() % 10000;
+    /** Major page faults */
+    unsigned long major = nextRandom() % 100;
+    /** State of the process */
+    char state = "SSSSSSSRID"[nextRandom() % 10];
+    snprintf(path, sizeof(path), "%s/%d", argv[1], pids[i]);
+    makeDirectory(path);
+    snprintf(path, sizeof(path), "%s/%d/stat", argv[1], pids[i]);
+    /** Length of the stat line */
+    int len = snprintf(text, sizeof(text),
+                       "%d (%s) %c %d %d %d 0 -1 4194560 %lu 0 %lu 0 %lu %lu 0 0 20 0 %d 0 %lu %lu %lu "
+                       "18446744073709551615 %lu %lu 140737488347136 0 0 0 0 4096 134234626 1 0 0 17 %d 0 0 "
+                       "0 0 0 %lu %lu %lu 140737488349000 140737488349100 140737488349100 140737488351000 0\n",
+                       pids[i], name, state, parent < 0 ? 0 : pids[parent], pids[i], pids[i], minor,
+                       major, utime, stime, threads, 100 + (unsigned long) i * 7, rss * 4096 * 4, rss, code, code + 0x20000, i % 8,
+                       code + 0x40000, code + 0x41000, code + 0x80000);
+    writeFile(path, text, len);
+    snprintf(path, sizeof(path), "%s/%d/statm", argv[1], pids[i]);
+    len = snprintf(text, sizeof(text), "%lu %lu %lu 32 0 %lu 0\n", rss * 4, rss, rss / 4, rss * 2);
+    writeFile(path, text, len);
+  }
+  free(pids);
+  free(levels);
+  free(children);
+  return EXIT_SUCCESS;
+}
@@ -5,14 +5,97 @@
  * of command line arguments. A user may optionally specify if he or she wishes to
  * print the process' schedule time (in user mode), the process' name, the address
  * above and below which the program text can run, and the process' parent id.
+ * Stat files may be parsed by several threads for very large process tables,
+ * and processes may be listed as a tree with the size of each subtree, or
+ * monitored with their CPU usage like top(1), or tracked as they fork, exec,
+ * and exit through the kernel's proc connector.
  */
  
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <dirent.h>
 #include <sys/types.h>
 #include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <fnmatch.h>
+#include <pwd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+
+// Size of the buffer a stat file is read into; a stat line is at most a few
+// hundred bytes, even with a full 16 character command name
+#define STAT_BUF_LEN 1024
+// Fields of /proc/[pid]/stat, numbered from 1 as in proc(5)
+#define STAT_STATE 3
+#define STAT_PPID 4
+#define STAT_UTIME 14
+#define STAT_STIME 15
+#define STAT_THREADS 20
+#define STAT_STARTTIME 22
+#define STAT_STARTCODE 26
+#define STAT_ENDCODE 27
+// Highest field of /proc/[pid]/stat that can be read
+#define STAT_MAX_FIELD STAT_ENDCODE
+// Size of the buffer a statm file is read into
+#define STATM_BUF_LEN 128
+// Size of a process directory name, including its null character
+#define NAME_LEN 16
+// Most threads a scan is split over
+#define MAX_THREADS 256
+// Marks an empty hash table slot, or a process without a parent node
+#define NO_NODE ((size_t) -1)
+// Size of the buffer proc connector messages are received into
+#define EVENT_BUF_LEN 8192
+// Size of the buffer output is gathered in before it is written
+#define OUT_BUF_LEN (1 << 20)
+// Most bytes one record can take in any output format, besides its indentation
+// in tree mode, which is reserved as it is written
+#define OUT_RECORD_MAX 4096
+// Length of the name field of a binary record, including its null padding
+#define BINARY_NAME_LEN 64
+// Most terms and operators in a filter
+#define MAX_FILTER_CODE 64
+// Most characters in a term's value
+#define FILTER_VALUE_LEN 64
+// Stages of a scan at which a filter is evaluated: once the directory is
+// listed (pid and uid), once the stat files are read, and once the tree is built
+#define STAGE_DIR 0
+#define STAGE_STAT 1
+#define STAGE_TREE 2
+// Values of a filter evaluated before all its fields are known
+#define FILTER_FALSE 0
+#define FILTER_TRUE 1
+#define FILTER_UNKNOWN 2
+// A snapshot is stored whole, rather than as changes, every this many snapshots
+#define KEYFRAME_EVERY 64
+// Flags of a process in a snapshot: whether it is stored whole, and which
+// fields changed since the previous snapshot
+#define SNAP_NEW 1
+#define SNAP_PPID 2
+#define SNAP_UTIME 4
+#define SNAP_STIME 8
+#define SNAP_RSS 16
+#define SNAP_THREADS 32
+#define SNAP_STATE 64
+#define SNAP_NAME 128
+// Output formats
+#define FORMAT_TEXT 0
+#define FORMAT_CSV 1
+#define FORMAT_JSON 2
+#define FORMAT_BINARY 3
 
 // Struct representing a process id
 struct ProcessID{
@@ -28,297 +111,2741 @@ struct ProcessID{
   unsigned long time;
   // Process' parent id
   int parid;
-};
-
-// Struct representing a node in a linked list
-struct NodeTag{
-  // PID to hold
-  struct ProcessID value;
-  // Pointer to the next PID in the list
-  struct NodeTag *next;
+  // Process schedule time in kernel mode
+  unsigned long stime;
+  // Time the process started after boot, in clock ticks
+  unsigned long long start;
+  // CPU usage over the last monitor interval, in percent
+  double cpu;
+  // Resident set size, in kilobytes
+  unsigned long rss;
+  // Number of threads
+  long threads;
+  // Process state, such as 'R' or 'S'
+  char state;
+  // Owner of the process, read only when a filter needs it
+  unsigned int uid;
+  // Bit i is set if the process is in the subtree of the filter's i-th subtree term
+  unsigned int subtrees;
 };
 
 // Shortcut for constructing PIDs
 typedef struct ProcessID PID; 
-// Shortcut for processing nodes
-typedef struct NodeTag Node;
+
+// Struct representing which files and fields a scan reads, planned once from
+// the selected options so that unselected fields cost nothing
+struct FieldPlan{
+  // Whether to copy the program name
+  int name;
+  // Highest stat field to split; fields past it are left unparsed
+  int maxField;
+  // Whether to read the statm file for the resident set size
+  int statm;
+  // Whether to read the owner of each process' directory
+  int uid;
+};
+
+// The plan every scan follows, set before the first scan
+static struct FieldPlan plan = { 1, STAT_MAX_FIELD, 0, 0 };
+
+// Struct representing one comparison in a filter, such as "ppid=1"
+struct FilterTerm{
+  // Field compared, one of the names in filterFields
+  int field;
+  // Comparison: '=', '!' (not equal), '<', 'l' (at most), '>', or 'g' (at least)
+  char op;
+  // Value compared against, for numeric fields
+  long long number;
+  // Value compared against, for the name (a glob pattern) and the state
+  char text[FILTER_VALUE_LEN];
+  // Bit of the process' subtrees field, for subtree terms
+  unsigned int bit;
+};
+
+// Struct representing a filter compiled into postfix code: each instruction
+// is a term index, or FILTER_AND, FILTER_OR, or FILTER_NOT
+struct Filter{
+  // The terms
+  struct FilterTerm terms[MAX_FILTER_CODE];
+  // Number of terms
+  int termCount;
+  // The code
+  int code[MAX_FILTER_CODE];
+  // Number of instructions
+  int length;
+  // Number of subtree terms
+  int subtreeTerms;
+  // Whether processes may be dropped while scanning; not when a subtree term
+  // needs every process to find descendants
+  int atScan;
+};
+
+// Instructions of a filter other than terms
+#define FILTER_AND -1
+#define FILTER_OR -2
+#define FILTER_NOT -3
+
+// Names of the fields a filter can compare, by field number
+static const char *filterFields[] = { "pid", "uid", "user", "name", "ppid", "state", "utime", "stime",
+                                      "time", "threads", "rss", "subtree" };
+// Stage at which each field is known
+static const int filterStages[] = { STAGE_DIR, STAGE_DIR, STAGE_DIR, STAGE_STAT, STAGE_STAT, STAGE_STAT,
+                                    STAGE_STAT, STAGE_STAT, STAGE_STAT, STAGE_STAT, STAGE_STAT, STAGE_TREE };
+
+// The filter every scan applies, compiled before the first scan; empty to keep every process
+static struct Filter filter;
+
+// Struct representing the first bytes of binary output
+struct BinaryHeader{
+  // "PIDB"
+  char magic[4];
+  // Size of each record that follows
+  uint32_t recordSize;
+};
+
+// Struct representing one process in binary output. Fields are in host byte
+// order; fields of options that were not selected are zero.
+struct BinaryRecord{
+  // The process id
+  int32_t pid;
+  // Process' parent id
+  int32_t parent;
+  // Schedule time in user mode, in clock ticks
+  uint64_t utime;
+  // Schedule time in kernel mode, in clock ticks
+  uint64_t stime;
+  // Start time after boot, in clock ticks
+  uint64_t start;
+  // Address above which program text can run
+  uint64_t above;
+  // Address below which program text can run
+  uint64_t below;
+  // Resident set size, in kilobytes
+  uint64_t rss;
+  // Number of threads
+  int32_t threads;
+  // Number of processes in the process' subtree, in tree mode
+  uint32_t subtree;
+  // Depth of the process in the tree, in tree mode
+  uint32_t depth;
+  // CPU usage over the last monitor interval, in percent
+  float cpu;
+  // Event the record reports: 0 none, then live, fork, exec, exit, and in a
+  // replay, new, reparent, cpu
+  uint8_t event;
+  // Process state, such as 'R' or 'S'
+  char state;
+  // Zero
+  char reserved[6];
+  // Program name without parentheses, null padded
+  char name[BINARY_NAME_LEN];
+};
+
+// Struct representing the first bytes of a snapshot file
+struct SnapFileHeader{
+  // "PIDS"
+  char magic[4];
+  // Format version, 1
+  uint32_t version;
+};
+
+// Struct representing the header of each snapshot in a snapshot file, which
+// is followed by length bytes of processes in pid order. Each process is its
+// pid as a varint difference from the previous process' pid, a byte of SNAP
+// flags, and then either every field (SNAP_NEW) or the fields that changed
+// since the previous snapshot: times as varint increases, the resident set
+// size and thread count as zigzag varint differences, the parent id as a
+// varint, the state as a byte, and the name as a varint length and its bytes.
+// Processes absent from a snapshot have exited. Fields are in host byte order.
+struct SnapHeader{
+  // "SNAP"
+  char magic[4];
+  // Length of the processes that follow
+  uint32_t length;
+  // Time of the snapshot, in nanoseconds since the Unix epoch
+  uint64_t time;
+  // Number of processes
+  uint32_t count;
+  // Whether every process is stored whole, so the snapshot stands alone
+  uint32_t keyframe;
+};
+
+// Struct representing one entry of a snapshot file's index, "<file>.idx",
+// which has one entry per snapshot in time order and is searched through mmap()
+struct SnapIndex{
+  // Time of the snapshot, in nanoseconds since the Unix epoch
+  uint64_t time;
+  // Offset of the snapshot's header in the snapshot file
+  uint64_t offset;
+  // Offset of the last keyframe at or before the snapshot, where decoding starts
+  uint64_t keyOffset;
+};
+
+// Struct representing a growable byte buffer
+struct ByteBuffer{
+  // The bytes
+  unsigned char *data;
+  // Number of bytes used
+  size_t len;
+  // Capacity of data
+  size_t capacity;
+};
+
+// Struct representing a decoded snapshot
+struct Snapshot{
+  // The processes, in pid order
+  PID *records;
+  // Number of processes
+  size_t count;
+  // Capacity of records
+  size_t capacity;
+  // Time of the snapshot, in nanoseconds since the Unix epoch
+  uint64_t time;
+};
+
+// Output format of the records, one of the FORMAT constants
+static int format = FORMAT_TEXT;
+// Output gathered but not yet written
+static char outBuf[OUT_BUF_LEN];
+// Number of bytes in outBuf
+static size_t outLen;
+// Clock ticks per second
+static long clockTicks;
+// Directory the process directories are listed from, "/proc" unless another
+// is given, such as a tree written by gen_proc
+static const char *procRoot = "/proc";
+
+// Struct representing the process hierarchy. Processes are kept in one
+// contiguous array, in directory order. Every process and every parent id
+// without a process of its own (such as 0) is a node; nodes are found by id
+// through an open addressing hash table, and each node's children are listed
+// contiguously in compressed sparse row form.
+struct ProcessTable{
+  // The proc directory, kept open between scans
+  DIR *proc;
+  // Names of the process directories last listed
+  char (*names)[NAME_LEN];
+  // Capacity of names
+  size_t nameCapacity;
+  // The processes, which are nodes 0 to count - 1
+  PID *records;
+  // Number of processes
+  size_t count;
+  // Capacity of records
+  size_t capacity;
+  // Processes the index arrays below have room for
+  size_t indexCapacity;
+  // Number of nodes, including parents without a process
+  size_t nodes;
+  // Id of each node
+  int *ids;
+  // Parent node of each process, in records order
+  size_t *parents;
+  // Hash table slots, each a node index or NO_NODE
+  size_t *slots;
+  // Number of hash table slots minus one (a power of two minus one)
+  size_t mask;
+  // Offset in children of each node's first child; node i's children end at start[i + 1]
+  size_t *start;
+  // Process indexes of each node's children, in directory order
+  size_t *children;
+};
+
+// Struct representing one thread's share of the process directories to parse
+struct Scan_Task{
+  // Descriptor of the proc directory
+  int procFd;
+  // Names of all process directories
+  char (*names)[NAME_LEN];
+  // Index of the first directory of this share
+  size_t start;
+  // Index after the last directory of this share
+  size_t end;
+  // Processes parsed, in directory order, written over this share of the
+  // table's records
+  PID *found;
+  // Number of processes parsed
+  size_t count;
+};
+ 
+/**
+ * Checks the command line arguments for correct format.
+ * A correctly formatted argument begins with a leading "-".
+ * @param argc number of command line arguments
+ * @param argv command line arguments
+ */
+ void checkFormat(int argc, char *argv[])
+{
+  // Loop through all command line arguments
+  for(int i = 1; i < argc; i++){
+    // Check for missing hyphen
+    if(argv[i][0] != '-'){
+      // Print usage message and exit
+      fprintf(stderr, "Usage: ./p3 <-options>\n");
+      exit(EXIT_FAILURE);
+    } else if(!isalpha(argv[i][1])){ // No letter is provided
+      // Print usage message and exit
+      fprintf(stderr, "Options require alphabetic characters.\n");
+      exit(EXIT_FAILURE);
+    }
+  } 
+} 
  
 /**
- * Checks the command line arguments for correct format.
- * A correctly formatted argument begins with a leading "-".
- * @param argc number of command line arguments
- * @param argv command line arguments
+ * Writes all gathered output to standard output.
+ */
+void flushOutput(void)
+{
+  /** Bytes written so far */
+  size_t done = 0;
+  
+  while(done < outLen){
+    /** Bytes written by this call */
+    ssize_t n = write(STDOUT_FILENO, outBuf + done, outLen - done);
+    if(n < 0 && errno == EINTR){
+      continue;
+    } else if(n < 0){
+      perror("write");
+      exit(EXIT_FAILURE);
+    }
+    done += n;
+  }
+  outLen = 0;
+}
+
+/**
+ * Makes room in the output buffer, writing it out if it is too full.
+ * @param n the number of bytes needed
+ */
+void reserveOutput(size_t n)
+{
+  if(outLen + n > OUT_BUF_LEN){
+    flushOutput();
+  }
+}
+
+/**
+ * Appends bytes to the output.
+ * @param bytes the bytes
+ * @param n the number of bytes
+ */
+void putBytes(const void *bytes, size_t n)
+{
+  memcpy(outBuf + outLen, bytes, n);
+  outLen += n;
+}
+
+/**
+ * Appends a string to the output.
+ * @param str the null terminated string
+ */
+void putString(const char *str)
+{
+  putBytes(str, strlen(str));
+}
+
+/**
+ * Appends a character to the output.
+ * @param c the character
+ */
+void putChar(char c)
+{
+  outBuf[outLen++] = c;
+}
+
+/**
+ * Appends a number in decimal to the output, right aligned in a field.
+ * @param value the number
+ * @param negative whether the number is negative
+ * @param width the least number of characters to take, padded with spaces
+ */
+void putNumber(unsigned long long value, int negative, int width)
+{
+  /** Digits of the number, from the last */
+  char digits[24];
+  /** Number of digits */
+  int n = 0;
+  
+  do{
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while(value > 0);
+  if(negative){
+    digits[n++] = '-';
+  }
+  while(width-- > n){
+    putChar(' ');
+  }
+  while(n > 0){
+    putChar(digits[--n]);
+  }
+}
+
+/**
+ * Appends an unsigned number in decimal to the output.
+ * @param value the number
+ */
+void putUnsigned(unsigned long long value)
+{
+  putNumber(value, 0, 0);
+}
+
+/**
+ * Appends a signed number in decimal to the output.
+ * @param value the number
+ */
+void putSigned(long long value)
+{
+  putNumber(value < 0 ? -(unsigned long long) value : (unsigned long long) value, value < 0, 0);
+}
+
+/**
+ * Appends a non-negative number with a fixed number of decimals, rounded,
+ * right aligned in a field.
+ * @param value the number
+ * @param decimals the number of decimals, 1 or 2
+ * @param width the least number of characters to take, padded with spaces
+ */
+void putFixed(double value, int decimals, int width)
+{
+  /** 10 to the number of decimals */
+  unsigned long long scale = decimals == 1 ? 10 : 100;
+  /** The number in units of its last decimal */
+  unsigned long long units = (unsigned long long) (value * scale + 0.5);
+  /** Digits of the whole part */
+  char whole[24];
+  /** Number of digits of the whole part */
+  int n = 0;
+  
+  units = value > 0 ? units : 0;
+  /** The whole part */
+  unsigned long long integer = units / scale;
+  do{
+    whole[n++] = '0' + integer % 10;
+    integer /= 10;
+  } while(integer > 0);
+  while(width-- > n + 1 + decimals){
+    putChar(' ');
+  }
+  while(n > 0){
+    putChar(whole[--n]);
+  }
+  putChar('.');
+  if(decimals == 2){
+    putChar('0' + units % 100 / 10);
+  }
+  putChar('0' + units % 10);
+}
+
+/**
+ * Appends formatted text to the output. Only used for headers and banners,
+ * never per process.
+ * @param fmt the printf() format
+ */
+void putFormat(const char *fmt, ...)
+{
+  /** The arguments to format */
+  va_list args;
+  
+  reserveOutput(OUT_RECORD_MAX);
+  va_start(args, fmt);
+  /** Length of the formatted text */
+  int n = vsnprintf(outBuf + outLen, OUT_RECORD_MAX, fmt, args);
+  va_end(args);
+  outLen += n < OUT_RECORD_MAX ? n : OUT_RECORD_MAX - 1;
+}
+
+/**
+ * Appends a string quoted for CSV or JSON output.
+ * @param str the string
+ * @param len the length of the string
+ */
+void putQuoted(const char *str, size_t len)
+{
+  putChar('"');
+  for(size_t i = 0; i < len; i++){
+    /** The character */
+    unsigned char c = str[i];
+    if(format == FORMAT_CSV){
+      // Quotes are doubled in CSV
+      if(c == '"'){
+        putChar('"');
+      }
+      putChar(c);
+    } else if(c == '"' || c == '\\'){
+      putChar('\\');
+      putChar(c);
+    } else if(c < 0x20){
+      // Control characters are escaped as \u00XX in JSON
+      putString("\\u00");
+      putChar("0123456789abcdef"[c >> 4]);
+      putChar("0123456789abcdef"[c & 15]);
+    } else {
+      putChar(c);
+    }
+  }
+  putChar('"');
+}
+
+/**
+ * Starts a field of a CSV or JSON record, or, for a CSV header, writes the
+ * field's name.
+ * @param key the name of the field
+ * @param index the position of the field in the record
+ * @param header whether a CSV header is being written
+ * @return whether the field's value should follow
+ */
+int putKey(const char *key, int index, int header)
+{
+  if(format == FORMAT_CSV){
+    if(index > 0){
+      putChar(',');
+    }
+    if(header){
+      putString(key);
+    }
+    return !header;
+  }
+  putChar(index > 0 ? ',' : '{');
+  putChar('"');
+  putString(key);
+  putString("\":");
+  return 1;
+}
+
+/**
+ * Writes one PID based on user - specified options, in the output format.
+ * By default, the process id for each pid will always be written. Called
+ * without a process, writes the CSV header instead.
+ * @param process the PID to print, or NULL for the CSV header
+ * @param bitmap the bitmap field in which to check selected options
+ * @param depth depth of the process in the tree, which indents its id
+ * @param subtree number of processes in the process' subtree, printed in tree mode
+ * @param event the event the process is reported for, or NULL
+ */
+void printPID(const PID *process, int bitmap, int depth, size_t subtree, const char *event)
+{
+  /** Whether a CSV header is being written */
+  int header = process == NULL;
+  /** Position of the next field in the record */
+  int n = 0;
+  /** The program name, without parentheses */
+  const char *name = plan.name && !header ? process->pname + 1 : "";
+  /** Length of the program name, which is empty if it could not be read */
+  size_t nameLen = plan.name && !header && strlen(process->pname) >= 2 ? strlen(process->pname) - 2 : 0;
+  
+  reserveOutput(OUT_RECORD_MAX);
+  if(format == FORMAT_BINARY){
+    /** The record */
+    struct BinaryRecord record;
+    /** Events, in the order of their codes */
+    static const char *events[] = { "live", "fork", "exec", "exit", "new", "reparent", "cpu" };
+    memset(&record, 0, sizeof(record));
+    record.pid = process->pid;
+    record.parent = process->parid;
+    record.utime = bitmap & 2 ? process->time : 0;
+    record.stime = bitmap & 256 ? process->stime : 0;
+    record.start = bitmap & 2048 ? process->start : 0;
+    record.above = bitmap & 4 ? process->above : 0;
+    record.below = bitmap & 4 ? process->below : 0;
+    record.rss = bitmap & 128 ? process->rss : 0;
+    record.threads = bitmap & 512 ? process->threads : 0;
+    record.subtree = subtree;
+    record.depth = depth;
+    record.cpu = bitmap & 32 ? process->cpu : 0;
+    record.state = bitmap & 1024 ? process->state : 0;
+    for(int i = 0; event != NULL && i < (int) (sizeof(events) / sizeof(events[0])); i++){
+      if(strcmp(event, events[i]) == 0){
+        record.event = i + 1;
+      }
+    }
+    memcpy(record.name, name, nameLen < BINARY_NAME_LEN ? nameLen : BINARY_NAME_LEN - 1);
+    putBytes(&record, sizeof(record));
+    return;
+  }
+  
+  if(format == FORMAT_TEXT){
+    if(event != NULL){
+      putString(event);
+      putChar('\t');
+    }
+    // Print the process id, indented by its depth, keeping room for the
+    // rest of the record however deep the tree
+    for(int i = 0; i < depth; i++){
+      reserveOutput(OUT_RECORD_MAX + 2);
+      putString("  ");
+    }
+    putSigned(process->pid);
+    putChar('\t');
+    if(bitmap & 32){ // CPU usage over the last monitor interval
+      putFixed(process->cpu, 1, 5);
+      putChar('\t');
+    }
+    // Check the bitflags for printing appropriate arguments
+    if(bitmap & 1) { // process name
+      // Print the process name
+      putString(process->pname);
+      putChar('\t');
+    }
+    if(bitmap & 4){ // process addresses above and below
+      // Print the process address
+      putUnsigned(process->above);
+      putString(", ");
+      putUnsigned(process->below);
+      putChar('\t');
+    }
+    if(bitmap & 2){ // process schedule time
+      // Print the schedule time in user mode
+      putUnsigned(process->time);
+      putChar('\t');
+    }
+    if(bitmap & 256){ // schedule time in kernel mode
+      putUnsigned(process->stime);
+      putChar('\t');
+    }
+    if(bitmap & 1024){ // process state
+      putChar(process->state);
+      putChar('\t');
+    }
+    if(bitmap & 512){ // number of threads
+      putSigned(process->threads);
+      putChar('\t');
+    }
+    if(bitmap & 128){ // resident set size
+      putUnsigned(process->rss);
+      putChar('\t');
+    }
+    if(bitmap & 2048){ // start time, in seconds after boot
+      putFixed((double) process->start / clockTicks, 2, 0);
+      putChar('\t');
+    }
+    if(bitmap & 8){ // process' parent id 
+      // Print the process' parent id
+      putSigned(process->parid);
+      putChar('\t');
+    }
+    if(bitmap & 16){ // size of the process' subtree
+      putUnsigned(subtree);
+      putChar('\t');
+    }
+    // End bit flag search
+    putChar('\n');
+    return;
+  }
+  
+  // CSV and JSON name the same fields, CSV in its header and JSON in each record
+  if(event != NULL && putKey("event", n++, header)){
+    putQuoted(event, strlen(event));
+  }
+  if(putKey("pid", n++, header)){
+    putSigned(process->pid);
+  }
+  if((bitmap & 32) && putKey("cpu", n++, header)){
+    putFixed(process->cpu, 1, 0);
+  }
+  if((bitmap & 1) && putKey("name", n++, header)){
+    putQuoted(name, nameLen);
+  }
+  if((bitmap & 4) && putKey("above", n++, header)){
+    putUnsigned(process->above);
+  }
+  if((bitmap & 4) && putKey("below", n++, header)){
+    putUnsigned(process->below);
+  }
+  if((bitmap & 2) && putKey("utime", n++, header)){
+    putUnsigned(process->time);
+  }
+  if((bitmap & 256) && putKey("stime", n++, header)){
+    putUnsigned(process->stime);
+  }
+  if((bitmap & 1024) && putKey("state", n++, header)){
+    putQuoted(&process->state, 1);
+  }
+  if((bitmap & 512) && putKey("threads", n++, header)){
+    putSigned(process->threads);
+  }
+  if((bitmap & 128) && putKey("rss", n++, header)){
+    putUnsigned(process->rss);
+  }
+  if((bitmap & 2048) && putKey("start", n++, header)){
+    putFixed((double) process->start / clockTicks, 2, 0);
+  }
+  if((bitmap & 8) && putKey("parent", n++, header)){
+    putSigned(process->parid);
+  }
+  if((bitmap & 16) && putKey("depth", n++, header)){
+    putUnsigned(depth);
+  }
+  if((bitmap & 16) && putKey("subtree", n++, header)){
+    putUnsigned(subtree);
+  }
+  putString(format == FORMAT_JSON ? "}\n" : "\n");
+}
+
+/**
+ * Print the header information based on user - selected options: a line of
+ * column names for text, which monitor mode repeats on every refresh, and
+ * once, the CSV header or the binary header. JSON records need no header.
+ * @param bitmap the bitmap field in which to check selected options
+ */ 
+void printHeader(int bitmap)
+{
+  /** Whether a CSV or binary header was written */
+  static int written;
+  
+  if(format == FORMAT_CSV && !written){
+    printPID(NULL, bitmap, 0, 0, bitmap & 64 ? "event" : NULL);
+  } else if(format == FORMAT_BINARY && !written){
+    /** The binary header */
+    struct BinaryHeader binary = { { 'P', 'I', 'D', 'B' }, sizeof(struct BinaryRecord) };
+    reserveOutput(sizeof(binary));
+    putBytes(&binary, sizeof(binary));
+  }
+  written = 1;
+  if(format != FORMAT_TEXT){
+    return;
+  }
+  putFormat("%spid\t", bitmap & 64 ? "event\t" : "");
+  if(bitmap & 32){
+    putFormat("%%cpu\t");
+  }
+  if(bitmap & 1) {
+    putFormat("pname\t");
+  }
+  if(bitmap & 4){
+    putFormat("address\t");
+  }
+  if(bitmap & 2){
+    putFormat("%8s\t", "time");
+  }
+  if(bitmap & 256){
+    putFormat("%8s\t", "stime");
+  }
+  if(bitmap & 1024){
+    putFormat("state\t");
+  }
+  if(bitmap & 512){
+    putFormat("threads\t");
+  }
+  if(bitmap & 128){
+    putFormat("%8s\t", "rss");
+  }
+  if(bitmap & 2048){
+    putFormat("%10s\t", "start");
+  }
+  if(bitmap & 8){
+    putFormat("parent\t");
+  }
+  if(bitmap & 16){
+    putFormat("subtree\t");
+  }
+  putFormat("\n");
+}
+
+/**
+ * Prints the PIDs grouped by parent id. Groups appear in the order their
+ * parent id is first seen in the directory, and processes within a group
+ * in directory order.
+ * @param table the process table
+ * @param bitmap the bitmap field in which to check selected options
+ */
+void printPIDs(const struct ProcessTable *table, int bitmap)
+{
+  /** Whether each node's children were printed */
+  char *printed = calloc(table->nodes, 1);
+  
+  // Print each group when its parent is first seen
+  for(size_t i = 0; i < table->count; i++){
+    /** The process' parent node */
+    size_t parent = table->parents[i];
+    if(!printed[parent]){
+      printed[parent] = 1;
+      for(size_t c = table->start[parent]; c < table->start[parent + 1]; c++){
+        printPID(&table->records[table->children[c]], bitmap, 0, 0, NULL);
+      }
+    }
+  }
+  free(printed);
+}
+
+/**
+ * Prints the PIDs as a forest: each process whose parent is not listed
+ * starts a tree, every child follows its parent indented one level deeper,
+ * and each process is printed with the size of its subtree. Trees appear in
+ * directory order of their roots, and children in directory order.
+ * @param table the process table
+ * @param bitmap the bitmap field in which to check selected options
+ */
+void printTree(const struct ProcessTable *table, int bitmap)
+{
+  /** Processes in the order they are printed */
+  size_t *order = malloc((table->count + 1) * sizeof(size_t));
+  /** Processes waiting to be visited */
+  size_t *stack = malloc((table->count + 1) * sizeof(size_t));
+  /** Depth of each process, by records index */
+  int *depth = malloc((table->count + 1) * sizeof(int));
+  /** Subtree size of each process, by records index */
+  size_t *subtree = malloc((table->count + 1) * sizeof(size_t));
+  /** Parent of each process in the printed forest, or NO_NODE for roots */
+  size_t *treeParent = malloc((table->count + 1) * sizeof(size_t));
+  /** Whether each process was reached */
+  char *visited = calloc(table->count + 1, 1);
+  /** Number of processes in order */
+  size_t ordered = 0;
+  
+  // Walk each tree depth first, pushing children in reverse so they are
+  // visited in directory order. Processes on a parent cycle, which no root
+  // reaches, are made roots once the real roots are done.
+  for(int pass = 0; pass < 2; pass++){
+    for(size_t root = 0; root < table->count; root++){
+      if(visited[root] || (pass == 0 && table->parents[root] < table->count)){
+        continue;
+      }
+      /** Number of processes on the stack */
+      size_t height = 0;
+      visited[root] = 1;
+      depth[root] = 0;
+      treeParent[root] = NO_NODE;
+      stack[height++] = root;
+      while(height > 0){
+        /** The process to print next */
+        size_t v = stack[--height];
+        order[ordered++] = v;
+        subtree[v] = 1;
+        for(size_t c = table->start[v + 1]; c > table->start[v]; c--){
+          /** A child of v */
+          size_t child = table->children[c - 1];
+          if(!visited[child]){
+            visited[child] = 1;
+            depth[child] = depth[v] + 1;
+            treeParent[child] = v;
+            stack[height++] = child;
+          }
+        }
+      }
+    }
+  }
+  
+  // Sum subtree sizes from the leaves up
+  for(size_t i = ordered; i > 0; i--){
+    /** The process whose size is final */
+    size_t v = order[i - 1];
+    if(treeParent[v] != NO_NODE){
+      subtree[treeParent[v]] += subtree[v];
+    }
+  }
+  for(size_t i = 0; i < ordered; i++){
+    printPID(&table->records[order[i]], bitmap, depth[order[i]], subtree[order[i]], NULL);
+  }
+  free(order);
+  free(stack);
+  free(depth);
+  free(subtree);
+  free(treeParent);
+  free(visited);
+}
+
+/**
+ * Parses an unsigned decimal field of a stat line. A field that begins with
+ * a minus sign is negated, like strtoul() would.
+ * @param field the start of the field
+ * @return the value of the field
+ */
+unsigned long parseField(const char *field)
+{
+  /** Whether the field is negative */
+  int negative = *field == '-';
+  /** The value of the field */
+  unsigned long value = 0;
+  
+  field += negative;
+  while(*field >= '0' && *field <= '9'){
+    value = value * 10 + (*field++ - '0');
+  }
+  return negative ? -value : value;
+}
+
+/**
+ * Parses the contents of a stat file into a process, following the field
+ * plan. The program name is taken as everything from the first "(" to the
+ * last ")", so names containing spaces or parentheses are kept whole; the
+ * fields after it are then split on single spaces, as the kernel writes them,
+ * up to the highest field the plan needs.
+ * @param buf the contents of the stat file, null terminated
+ * @param len the length of the contents
+ * @param process struct representing the process to fill in
+ * @return 0 on success, or -1 if the contents are not a stat line
+ */
+int parseStat(char *buf, size_t len, PID *process)
+{
+  /** Start of the program name */
+  char *open = strchr(buf, '(');
+  /** End of the program name */
+  char *close = memrchr(buf, ')', len);
+  /** Start of each field after the program name, by field number */
+  char *fields[STAT_MAX_FIELD + 1];
+  
+  if(open == NULL || close == NULL || close < open || close - open + 2 > (long) sizeof(process->pname)){
+    return -1;
+  }
+  process->pid = (int) parseField(buf);
+  if(plan.name){
+    // Keep the parentheses, as the name has always been printed with them
+    memcpy(process->pname, open, close - open + 1);
+    process->pname[close - open + 1] = '\0';
+  }
+  
+  // Split the fields from the state (field 3) up to the last one needed
+  /** Current position in the stat line */
+  char *pos = close + 1;
+  for(int field = 3; field <= plan.maxField; field++){
+    if(*pos != ' '){
+      return -1;
+    }
+    fields[field] = ++pos;
+    while(*pos != ' ' && *pos != '\n' && *pos != '\0'){
+      pos++;
+    }
+  }
+  // Parse only the fields that were split
+  switch(plan.maxField){
+    case STAT_ENDCODE:
+      process->below = parseField(fields[STAT_ENDCODE]);
+      process->above = parseField(fields[STAT_STARTCODE]);
+      /* falls through */
+    case STAT_STARTTIME:
+      process->start = parseField(fields[STAT_STARTTIME]);
+      /* falls through */
+    case STAT_THREADS:
+      process->threads = (long) parseField(fields[STAT_THREADS]);
+      /* falls through */
+    case STAT_STIME:
+      process->stime = parseField(fields[STAT_STIME]);
+      /* falls through */
+    case STAT_UTIME:
+      process->time = parseField(fields[STAT_UTIME]);
+      /* falls through */
+    default:
+      process->parid = (int) parseField(fields[STAT_PPID]);
+      process->state = *fields[STAT_STATE];
+  }
+  return 0;
+}
+
+/**
+ * Reads a small file of a process with a single read().
+ * @param procFd descriptor of the "/proc" directory
+ * @param name name of the process' directory in "/proc"
+ * @param file name of the file in the process' directory
+ * @param buf the buffer to read into, null terminated on success
+ * @param size the size of the buffer
+ * @return the number of bytes read, or -1 if the process exited
+ */
+ssize_t readProcFile(int procFd, const char *name, const char *file, char *buf, size_t size)
+{
+  /** Path of the file relative to "/proc" */
+  char path[64];
+  
+  snprintf(path, sizeof(path), "%s/%s", name, file);
+  /** The file */
+  int fd = openat(procFd, path, O_RDONLY);
+  if(fd < 0){
+    return -1;
+  }
+  /** Number of bytes read */
+  ssize_t len = read(fd, buf, size - 1);
+  close(fd);
+  if(len <= 0){
+    return -1;
+  }
+  buf[len] = '\0';
+  return len;
+}
+
+/**
+ * Reads the files of a process the field plan needs, each with a single
+ * read() into a stack buffer, and parses them.
+ * @param procFd descriptor of the "/proc" directory
+ * @param name name of the process' directory in "/proc"
+ * @param process struct representing the process to fill in
+ * @return 0 on success, or -1 if the process exited or its stat file is malformed
+ */
+int readStat(int procFd, const char *name, PID *process)
+{
+  /** Contents of the stat file */
+  char buf[STAT_BUF_LEN];
+  /** Number of bytes read */
+  ssize_t len = readProcFile(procFd, name, "stat", buf, sizeof(buf));
+  
+  if(len < 0 || parseStat(buf, len, process) < 0){
+    return -1;
+  }
+  if(plan.statm){
+    // The resident set size is the second field, in pages
+    if(readProcFile(procFd, name, "statm", buf, STATM_BUF_LEN) < 0){
+      return -1;
+    }
+    /** Start of the resident set size */
+    char *resident = strchr(buf, ' ');
+    process->rss = resident ? parseField(resident + 1) * (sysconf(_SC_PAGESIZE) / 1024) : 0;
+  }
+  return 0;
+}
+
+/**
+ * Reports a malformed filter and exits.
+ * @param message what is wrong
+ * @param at the rest of the filter where the problem was found
+ */
+void filterError(const char *message, const char *at)
+{
+  fprintf(stderr, "Filter: %s at \"%s\"\n", message, at);
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * Appends an instruction to the filter's code.
+ * @param instruction the term index or operator
+ */
+void emitFilter(int instruction)
+{
+  if(filter.length == MAX_FILTER_CODE){
+    filterError("too many terms", "");
+  }
+  filter.code[filter.length++] = instruction;
+}
+
+void compileOr(const char **pos);
+
+/**
+ * Compiles one comparison, a negation, or a parenthesized filter.
+ * @param pos the position in the filter, advanced past what was compiled
+ */
+void compileUnary(const char **pos)
+{
+  if(**pos == '!'){
+    (*pos)++;
+    compileUnary(pos);
+    emitFilter(FILTER_NOT);
+    return;
+  } else if(**pos == '('){
+    (*pos)++;
+    compileOr(pos);
+    if(**pos != ')'){
+      filterError("missing \")\"", *pos);
+    }
+    (*pos)++;
+    return;
+  }
+  
+  // A term is a field name, a comparison, and a value
+  if(filter.termCount == MAX_FILTER_CODE){
+    filterError("too many terms", *pos);
+  }
+  /** The term */
+  struct FilterTerm *term = &filter.terms[filter.termCount];
+  /** Length of the field name */
+  size_t len = 0;
+  while(isalpha((*pos)[len])){
+    len++;
+  }
+  term->field = -1;
+  for(int f = 0; f < (int) (sizeof(filterFields) / sizeof(filterFields[0])); f++){
+    if(strlen(filterFields[f]) == len && strncmp(filterFields[f], *pos, len) == 0){
+      term->field = f;
+    }
+  }
+  if(term->field < 0){
+    filterError("unknown field", *pos);
+  }
+  *pos += len;
+  if((*pos)[0] == '!' && (*pos)[1] == '='){
+    term->op = '!';
+  } else if((*pos)[0] == '<' && (*pos)[1] == '='){
+    term->op = 'l';
+  } else if((*pos)[0] == '>' && (*pos)[1] == '='){
+    term->op = 'g';
+  } else if((*pos)[0] == '=' || (*pos)[0] == '<' || (*pos)[0] == '>'){
+    term->op = (*pos)[0];
+  } else {
+    filterError("expected a comparison", *pos);
+  }
+  *pos += (*pos)[1] == '=' ? 2 : 1;
+  
+  // The value runs to the next operator, or is quoted; a backslash takes the
+  // next character as it is, so values may hold "&", "|", ")", and quotes
+  /** Whether the value is quoted */
+  int quoted = **pos == '"';
+  /** Start of the value */
+  const char *value = *pos;
+  *pos += quoted;
+  len = 0;
+  while(**pos != '\0' && (quoted ? **pos != '"' : strchr("&|)", **pos) == NULL)){
+    if(**pos == '\\' && (*pos)[1] != '\0'){
+      (*pos)++;
+    }
+    if(len == FILTER_VALUE_LEN - 1){
+      filterError("bad value", value);
+    }
+    term->text[len++] = *(*pos)++;
+  }
+  if(quoted && **pos != '"'){
+    filterError("missing closing quote", value);
+  }
+  *pos += quoted;
+  if(len == 0){
+    filterError("bad value", value);
+  }
+  term->text[len] = '\0';
+  if(strcmp(filterFields[term->field], "user") == 0){
+    // Users are resolved once, here, and compared by uid
+    /** The user's entry */
+    struct passwd *user = getpwnam(term->text);
+    if(user == NULL){
+      filterError("unknown user", term->text);
+    }
+    term->number = user->pw_uid;
+    term->field = 1;
+  } else if(strcmp(filterFields[term->field], "name") != 0 && strcmp(filterFields[term->field], "state") != 0){
+    /** End of the number */
+    char *end;
+    term->number = strtoll(term->text, &end, 10);
+    if(*end != '\0'){
+      filterError("expected a number", term->text);
+    }
+  }
+  if((strcmp(filterFields[term->field], "name") == 0 || strcmp(filterFields[term->field], "state") == 0
+      || strcmp(filterFields[term->field], "subtree") == 0) && term->op != '=' && term->op != '!'){
+    filterError("only = and != apply", term->text);
+  }
+  if(strcmp(filterFields[term->field], "subtree") == 0){
+    if(filter.subtreeTerms == 32){
+      filterError("too many subtree terms", term->text);
+    }
+    term->bit = 1u << filter.subtreeTerms++;
+  }
+  emitFilter(filter.termCount++);
+}
+
+/**
+ * Compiles terms joined by "&".
+ * @param pos the position in the filter, advanced past what was compiled
+ */
+void compileAnd(const char **pos)
+{
+  compileUnary(pos);
+  while(**pos == '&'){
+    (*pos)++;
+    compileUnary(pos);
+    emitFilter(FILTER_AND);
+  }
+}
+
+/**
+ * Compiles terms joined by "|", which binds looser than "&".
+ * @param pos the position in the filter, advanced past what was compiled
+ */
+void compileOr(const char **pos)
+{
+  compileAnd(pos);
+  while(**pos == '|'){
+    (*pos)++;
+    compileAnd(pos);
+    emitFilter(FILTER_OR);
+  }
+}
+
+/**
+ * Compiles a filter once, before any scan, into postfix code. A filter is
+ * comparisons such as "name=ssh*", "ppid=1", "user=root", "uid!=0",
+ * "time>=100", "state=R", or "subtree=1234", joined with "&" and "|",
+ * negated with "!", and grouped with parentheses.
+ * @param text the filter
+ */
+void compileFilter(const char *text)
+{
+  /** Position in the filter */
+  const char *pos = text;
+  
+  memset(&filter, 0, sizeof(filter));
+  compileOr(&pos);
+  if(*pos != '\0'){
+    filterError("unexpected text", pos);
+  }
+  filter.atScan = filter.subtreeTerms == 0;
+}
+
+/**
+ * Compares a process against one term.
+ * @param term the term
+ * @param process the process
+ * @return whether the process matches
+ */
+int matchTerm(const struct FilterTerm *term, const PID *process)
+{
+  /** The process' value of the field */
+  long long value = 0;
+  
+  switch(term->field){
+    case 0: value = process->pid; break;
+    case 1: value = process->uid; break;
+    case 3: // name, matched without its parentheses
+      {
+        /** The name without parentheses */
+        char name[sizeof(process->pname)];
+        size_t len = strlen(process->pname);
+        len = len < 2 ? 0 : len - 2;
+        memcpy(name, process->pname + 1, len);
+        name[len] = '\0';
+        return (fnmatch(term->text, name, 0) == 0) == (term->op == '=');
+      }
+    case 4: value = process->parid; break;
+    case 5: return (process->state == term->text[0]) == (term->op == '=');
+    case 6: value = process->time; break;
+    case 7: value = process->stime; break;
+    case 8: value = process->time + process->stime; break;
+    case 9: value = process->threads; break;
+    case 10: value = process->rss; break;
+    case 11: return ((process->subtrees & term->bit) != 0) == (term->op == '=');
+  }
+  switch(term->op){
+    case '=': return value == term->number;
+    case '!': return value != term->number;
+    case '<': return value < term->number;
+    case 'l': return value <= term->number;
+    case '>': return value > term->number;
+    default: return value >= term->number;
+  }
+}
+
+/**
+ * Evaluates the filter against a process as far as the fields known at a
+ * stage allow. Terms on fields not yet known are unknown, and so is any
+ * combination they decide, so a process is dropped as soon as no value of
+ * the unknown fields could make it match.
+ * @param process the process
+ * @param stage the stage of the scan, one of the STAGE constants
+ * @return FILTER_FALSE, FILTER_TRUE, or FILTER_UNKNOWN
+ */
+int evalFilter(const PID *process, int stage)
+{
+  /** Stack of values */
+  char stack[MAX_FILTER_CODE];
+  /** Number of values on the stack */
+  int height = 0;
+  
+  if(filter.length == 0){
+    return FILTER_TRUE;
+  }
+  for(int i = 0; i < filter.length; i++){
+    /** The instruction */
+    int op = filter.code[i];
+    if(op >= 0){
+      /** The term */
+      const struct FilterTerm *term = &filter.terms[op];
+      stack[height++] = filterStages[term->field] > stage ? FILTER_UNKNOWN : matchTerm(term, process);
+    } else if(op == FILTER_NOT){
+      stack[height - 1] = stack[height - 1] == FILTER_UNKNOWN ? FILTER_UNKNOWN : !stack[height - 1];
+    } else {
+      /** The right operand */
+      char b = stack[--height];
+      /** The left operand */
+      char a = stack[height - 1];
+      /** The value that decides the operator on its own */
+      char decides = op == FILTER_AND ? FILTER_FALSE : FILTER_TRUE;
+      if(a == decides || b == decides){
+        stack[height - 1] = decides;
+      } else if(a == FILTER_UNKNOWN || b == FILTER_UNKNOWN){
+        stack[height - 1] = FILTER_UNKNOWN;
+      } else {
+        stack[height - 1] = !decides;
+      }
+    }
+  }
+  return stack[0];
+}
+
+/**
+ * Reads the owner of a process' directory, without opening any file in it.
+ * @param procFd descriptor of the "/proc" directory
+ * @param name name of the process' directory in "/proc"
+ * @param process struct representing the process to fill in
+ * @return 0 on success, or -1 if the process exited
+ */
+int readOwner(int procFd, const char *name, PID *process)
+{
+  /** Status of the directory */
+  struct stat st;
+  
+  if(fstatat(procFd, name, &st, 0) < 0){
+    return -1;
+  }
+  process->uid = st.st_uid;
+  return 0;
+}
+
+/**
+ * Hashes a process id for the hash table.
+ * @param id the process id
+ * @return the hash, to be masked to a slot
+ */
+size_t hashID(int id)
+{
+  return (unsigned int) id * 2654435761u;
+}
+
+/**
+ * Probes the hash table for a process id.
+ * @param table the process table
+ * @param id the process id
+ * @return the slot holding the id's node, or the empty slot where it belongs
+ */
+size_t *probe(const struct ProcessTable *table, int id)
+{
+  /** The slot to probe */
+  size_t slot = hashID(id) & table->mask;
+  
+  while(table->slots[slot] != NO_NODE && table->ids[table->slots[slot]] != id){
+    slot = (slot + 1) & table->mask;
+  }
+  return &table->slots[slot];
+}
+
+/**
+ * Builds the process hierarchy of the table's records in O(n): indexes every
+ * process id in the hash table, then counts each node's children and places
+ * them, in directory order, in compressed sparse row form.
+ * @param table the process table, with its records filled in
+ */
+void buildTable(struct ProcessTable *table)
+{
+  // Size the index arrays for the records' capacity, so that a table
+  // scanned again reuses them until the process table grows
+  if(table->count + 1 > table->indexCapacity){
+    /** Most nodes: every process, plus one parent without a process each */
+    size_t most = 2 * table->capacity + 1;
+    /** Number of hash table slots, at least twice the nodes */
+    size_t size = 1;
+    while(size < 2 * most){
+      size *= 2;
+    }
+    table->indexCapacity = table->capacity;
+    table->mask = size - 1;
+    table->slots = realloc(table->slots, size * sizeof(size_t));
+    table->ids = realloc(table->ids, most * sizeof(int));
+    table->start = realloc(table->start, (most + 1) * sizeof(size_t));
+    table->parents = realloc(table->parents, table->capacity * sizeof(size_t));
+    table->children = realloc(table->children, table->capacity * sizeof(size_t));
+  }
+  memset(table->slots, 0xff, (table->mask + 1) * sizeof(size_t));
+  
+  // Process i is node i. A pid listed twice, which a racing scan could see,
+  // is found by its first node.
+  for(size_t i = 0; i < table->count; i++){
+    /** The process' slot */
+    size_t *slot = probe(table, table->records[i].pid);
+    table->ids[i] = table->records[i].pid;
+    if(*slot == NO_NODE){
+      *slot = i;
+    }
+  }
+  // Parent ids without a process become nodes after the processes
+  table->nodes = table->count;
+  for(size_t i = 0; i < table->count; i++){
+    /** The parent's slot */
+    size_t *slot = probe(table, table->records[i].parid);
+    if(*slot == NO_NODE){
+      table->ids[table->nodes] = table->records[i].parid;
+      *slot = table->nodes++;
+    }
+    table->parents[i] = *slot;
+  }
+  
+  // Count each node's children and sum the counts, so each node's start is
+  // the end of its children; then place them back to front, which leaves
+  // each start at the node's first child
+  memset(table->start, 0, (table->nodes + 1) * sizeof(size_t));
+  for(size_t i = 0; i < table->count; i++){
+    table->start[table->parents[i]]++;
+  }
+  for(size_t n = 0; n < table->nodes; n++){
+    table->start[n + 1] += table->start[n];
+  }
+  for(size_t i = table->count; i > 0; i--){
+    table->children[--table->start[table->parents[i - 1]]] = i - 1;
+  }
+}
+
+/**
+ * Applies a filter with subtree terms once the hierarchy is built: marks the
+ * subtree of each term's process, drops the processes that do not match, and
+ * builds the hierarchy of the rest.
+ * @param table the process table, with its hierarchy built
+ */
+void filterTree(struct ProcessTable *table)
+{
+  if(filter.subtreeTerms == 0){
+    return;
+  }
+  for(size_t i = 0; i < table->count; i++){
+    table->records[i].subtrees = 0;
+  }
+  /** Processes waiting to be marked, reusing the parents array as a stack */
+  size_t *stack = table->parents;
+  for(int t = 0; t < filter.termCount; t++){
+    if(strcmp(filterFields[filter.terms[t].field], "subtree") != 0){
+      continue;
+    }
+    /** The subtree's root */
+    size_t root = *probe(table, (int) filter.terms[t].number);
+    /** Number of processes on the stack */
+    size_t height = 0;
+    if(root < table->count){
+      stack[height++] = root;
+    }
+    while(height > 0){
+      /** The process to mark */
+      size_t v = stack[--height];
+      if(table->records[v].subtrees & filter.terms[t].bit){
+        continue;
+      }
+      table->records[v].subtrees |= filter.terms[t].bit;
+      for(size_t c = table->start[v]; c < table->start[v + 1]; c++){
+        stack[height++] = table->children[c];
+      }
+    }
+  }
+  /** Number of processes kept */
+  size_t kept = 0;
+  for(size_t i = 0; i < table->count; i++){
+    if(evalFilter(&table->records[i], STAGE_TREE) == FILTER_TRUE){
+      table->records[kept++] = table->records[i];
+    }
+  }
+  table->count = kept;
+  buildTable(table);
+}
+
+/**
+ * Frees a process table.
+ * @param table the process table
+ */
+void freeTable(struct ProcessTable *table)
+{
+  free(table->records);
+  free(table->ids);
+  free(table->parents);
+  free(table->slots);
+  free(table->start);
+  free(table->children);
+  free(table->names);
+  if(table->proc != NULL){
+    closedir(table->proc);
+  }
+}
+
+/**
+ * Parses the stat files of one share of the listed processes. Runs on its own
+ * thread in parallel mode, filling only its own task.
+ * @param arg the Scan_Task to run
+ * @return NULL
+ */
+void *scanMain(void *arg)
+{
+  /** The task to run */
+  struct Scan_Task *task = arg;
+  
+  task->count = 0;
+  for(size_t i = task->start; i < task->end; i++){
+    /** The process */
+    PID *process = &task->found[task->count];
+    // Filter on the pid and owner first, before any file is opened, then on
+    // the stat fields; skip processes that exited since the directory was listed
+    if(filter.atScan){
+      process->pid = atoi(task->names[i]);
+      if((plan.uid && readOwner(task->procFd, task->names[i], process) < 0)
+         || evalFilter(process, STAGE_DIR) == FILTER_FALSE){
+        continue;
+      }
+    } else if(plan.uid && readOwner(task->procFd, task->names[i], process) < 0){
+      continue;
+    }
+    if(readStat(task->procFd, task->names[i], process) == 0
+       && (!filter.atScan || evalFilter(process, STAGE_STAT) != FILTER_FALSE)){
+      task->count++;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Opens the "/proc" directory, or the one given with "-P", and reads through each directory,
+ * retrieving the process' id, program name, associated addresses, parent id,
+ * and schedule time in user mode into the records of a process table.
+ *
+ * The directory is listed first, then its entries are split into equal
+ * contiguous shares, one per thread, each parsed in place into the thread's
+ * own range of the records. The ranges are then closed up in share order, so
+ * the records are in directory order for any number of threads. A table
+ * scanned again keeps its directory and buffers, growing them only when the
+ * process table grows.
+ * @param table the process table to fill in, zeroed before its first scan
+ * @param threads the number of threads to parse stat files with
+ */
+void scanProcesses(struct ProcessTable *table, int threads)
+{
+  //open proc directory, or start over in the one already open
+  if(table->proc == NULL){
+    table->proc = opendir(procRoot);
+    if(table->proc == NULL){
+      perror(procRoot);
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    rewinddir(table->proc);
+  }
+  /** Number of process directories */
+  size_t count = 0;
+  /** The current directory accessed */
+  struct dirent *current;
+  
+  // List the process directories
+  while((current = readdir(table->proc)) != NULL){
+    // Check the current directory name for appropriate format
+    if(isdigit(current->d_name[0]) && strlen(current->d_name) < NAME_LEN){
+      if(count == table->nameCapacity){
+        table->nameCapacity = table->nameCapacity ? 2 * table->nameCapacity : 1024;
+        table->names = realloc(table->names, table->nameCapacity * NAME_LEN);
+      }
+      strcpy(table->names[count++], current->d_name);
+    }
+  }
+  if(count + 1 > table->capacity){
+    table->capacity = 2 * (count + 1);
+    table->records = (PID *) realloc(table->records, table->capacity * sizeof(PID));
+  }
+  
+  // Parse the stat files, in parallel when more than one thread is asked for
+  if(threads < 1){
+    threads = 1;
+  } else if(threads > MAX_THREADS){
+    threads = MAX_THREADS;
+  }
+  /** One share of the listing per thread */
+  struct Scan_Task tasks[threads];
+  /** The threads, the first of which is this one */
+  pthread_t ids[threads];
+  for(int t = 0; t < threads; t++){
+    tasks[t].procFd = dirfd(table->proc);
+    tasks[t].names = table->names;
+    tasks[t].start = count * t / threads;
+    tasks[t].end = count * (t + 1) / threads;
+    tasks[t].found = table->records + tasks[t].start;
+    if(t > 0 && pthread_create(&ids[t], NULL, scanMain, &tasks[t]) != 0){
+      perror("pthread_create");
+      exit(EXIT_FAILURE);
+    }
+  }
+  scanMain(&tasks[0]);
+  
+  // Close up the shares in order, over the gaps left by exited processes
+  table->count = 0;
+  for(int t = 0; t < threads; t++){
+    if(t > 0){
+      pthread_join(ids[t], NULL);
+    }
+    memmove(table->records + table->count, tasks[t].found, tasks[t].count * sizeof(PID));
+    table->count += tasks[t].count;
+  }
+}
+
+/** Records being ordered by monitor(), for compareCPU() */
+static const PID *sortRecords;
+
+/**
+ * Orders processes by CPU usage, highest first, then by process id.
+ * @param a index of the first process in sortRecords
+ * @param b index of the second process in sortRecords
+ * @return negative, zero, or positive as a sorts before, with, or after b
+ */
+int compareCPU(const void *a, const void *b)
+{
+  /** The first process */
+  const PID *x = &sortRecords[*(const size_t *) a];
+  /** The second process */
+  const PID *y = &sortRecords[*(const size_t *) b];
+  
+  if(x->cpu != y->cpu){
+    return x->cpu < y->cpu ? 1 : -1;
+  }
+  return x->pid - y->pid;
+}
+
+/**
+ * Lists the processes like top(1), refreshing every interval until the
+ * program is interrupted. Two process tables are kept, the previous sample
+ * and the current one, and swapped after each refresh so their buffers are
+ * reused. Each process' CPU usage is its utime and stime ticks since the
+ * previous sample, found by pid through the previous table's hash and
+ * matched by start time so a reused pid counts as a new process.
+ * @param bitmap the bitmap field in which to check selected options
+ * @param threads the number of threads to parse stat files with
+ * @param interval the seconds between refreshes
+ */
+void monitor(int bitmap, int threads, double interval)
+{
+  /** The previous and the current sample */
+  struct ProcessTable tables[2];
+  /** The previous sample */
+  struct ProcessTable *prev = &tables[0];
+  /** The current sample */
+  struct ProcessTable *cur = &tables[1];
+  /** Processes in printing order */
+  size_t *order = NULL;
+  /** Capacity of order */
+  size_t orderCapacity = 0;
+  /** Clock ticks per second */
+  double ticks = (double) sysconf(_SC_CLK_TCK);
+  /** Time between refreshes */
+  struct timespec pause = { (time_t) interval, (long) ((interval - (time_t) interval) * 1e9) };
+  /** Time of the previous and the current sample */
+  struct timespec last, now;
+  
+  memset(tables, 0, sizeof(tables));
+  scanProcesses(prev, threads);
+  buildTable(prev);
+  filterTree(prev);
+  clock_gettime(CLOCK_MONOTONIC, &last);
+  while(1){
+    nanosleep(&pause, NULL);
+    scanProcesses(cur, threads);
+    buildTable(cur);
+    filterTree(cur);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    /** Seconds since the previous sample */
+    double elapsed = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+    
+    // Compute each process' usage since the previous sample; a process not
+    // in it started since, so all of its time falls in the interval
+    if(cur->count > orderCapacity){
+      orderCapacity = cur->capacity;
+      order = realloc(order, orderCapacity * sizeof(size_t));
+    }
+    for(size_t i = 0; i < cur->count; i++){
+      /** The process */
+      PID *process = &cur->records[i];
+      /** The process' node in the previous sample */
+      size_t node = *probe(prev, process->pid);
+      /** Ticks used since the previous sample */
+      unsigned long used = process->time + process->stime;
+      if(node < prev->count && prev->records[node].start == process->start){
+        used -= prev->records[node].time + prev->records[node].stime;
+      }
+      process->cpu = 100.0 * used / ticks / elapsed;
+      order[i] = i;
+    }
+    sortRecords = cur->records;
+    qsort(order, cur->count, sizeof(size_t), compareCPU);
+    
+    // Fill the terminal, or print every process if the output is not one;
+    // other formats append every process on each refresh
+    /** Size of the terminal */
+    struct winsize window;
+    /** Number of processes to print */
+    size_t rows = cur->count;
+    if(format == FORMAT_TEXT){
+      if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &window) == 0 && window.ws_row > 2 && window.ws_row - 2 < rows){
+        rows = window.ws_row - 2;
+      }
+      putFormat("\033[H\033[2J%zu processes, refreshed every %.1f s\n", cur->count, interval);
+    }
+    printHeader(bitmap);
+    for(size_t i = 0; i < rows; i++){
+      printPID(&cur->records[order[i]], bitmap, 0, 0, NULL);
+    }
+    flushOutput();
+    
+    // The current sample becomes the previous one
+    /** The table to scan into next */
+    struct ProcessTable *next = prev;
+    prev = cur;
+    cur = next;
+    last = now;
+  }
+}
+
+/**
+ * Rebuilds the hash table of a live process table, which indexes only its
+ * processes, with room for its records' capacity.
+ * @param table the process table
+ */
+void liveRehash(struct ProcessTable *table)
+{
+  /** Number of hash table slots, at least four per record */
+  size_t size = 1;
+  
+  while(size < 4 * table->capacity){
+    size *= 2;
+  }
+  table->mask = size - 1;
+  table->slots = realloc(table->slots, size * sizeof(size_t));
+  memset(table->slots, 0xff, size * sizeof(size_t));
+  for(size_t i = 0; i < table->count; i++){
+    *probe(table, table->ids[i]) = i;
+  }
+  table->nodes = table->count;
+}
+
+/**
+ * Returns the record of a process in a live process table, adding an empty
+ * one if the process is not yet listed.
+ * @param table the process table
+ * @param pid the process id
+ * @return the process' record
+ */
+PID *liveAdd(struct ProcessTable *table, int pid)
+{
+  /** The process' slot */
+  size_t *slot = probe(table, pid);
+  
+  if(*slot != NO_NODE){
+    return &table->records[*slot];
+  }
+  if(table->count == table->capacity){
+    table->capacity *= 2;
+    table->records = (PID *) realloc(table->records, table->capacity * sizeof(PID));
+    table->ids = realloc(table->ids, table->capacity * sizeof(int));
+    // The hierarchy arrays no longer fit a rescan
+    table->indexCapacity = 0;
+    liveRehash(table);
+    slot = probe(table, pid);
+  }
+  *slot = table->count;
+  table->ids[table->count] = pid;
+  memset(&table->records[table->count], 0, sizeof(PID));
+  table->records[table->count].pid = pid;
+  table->nodes = table->count + 1;
+  return &table->records[table->count++];
+}
+
+/**
+ * Removes a process from a live process table. The last record moves into
+ * its place, and the slots after its own shift back so every probe still
+ * reaches its process.
+ * @param table the process table
+ * @param pid the process id
  */
- void checkFormat(int argc, char *argv[])
+void liveRemove(struct ProcessTable *table, int pid)
 {
-  // Loop through all command line arguments
-  for(int i = 1; i < argc; i++){
-    // Check for missing hyphen
-    if(argv[i][0] != '-'){
-      // Print usage message and exit
-      fprintf(stderr, "Usage: ./p3 <-options>\n");
-      exit(EXIT_FAILURE);
-    } else if(!isalpha(argv[i][1])){ // No letter is provided
-      // Print usage message and exit
-      fprintf(stderr, "Options require alphabetic characters.\n");
-      exit(EXIT_FAILURE);
+  /** The process' slot */
+  size_t hole = probe(table, pid) - table->slots;
+  /** The process' record */
+  size_t index = table->slots[hole];
+  
+  if(index == NO_NODE){
+    return;
+  }
+  for(size_t next = (hole + 1) & table->mask; table->slots[next] != NO_NODE; next = (next + 1) & table->mask){
+    /** Slot the process in next hashes to */
+    size_t home = hashID(table->ids[table->slots[next]]) & table->mask;
+    if(((next - home) & table->mask) >= ((next - hole) & table->mask)){
+      table->slots[hole] = table->slots[next];
+      hole = next;
     }
-  } 
-} 
- 
+  }
+  table->slots[hole] = NO_NODE;
+  table->count--;
+  if(index != table->count){
+    table->records[index] = table->records[table->count];
+    table->ids[index] = table->ids[table->count];
+    *probe(table, table->ids[index]) = index;
+  }
+  table->nodes = table->count;
+}
+
 /**
- * Print the header information based on user - selected options.
- * @param bitmap the bitmap field in which to check selected options
- */ 
-void printHeader(int bitmap)
+ * Subscribes to the kernel's proc connector, which multicasts an event for
+ * every fork, exec, and exit in the system.
+ * @return the netlink socket to receive events on
+ */
+int subscribeEvents(void)
 {
-  printf("pid\t");
-  if(bitmap & 1) {
-    printf("pname\t");
+  /** Subscription message: a netlink header, a connector header, and the operation */
+  char buf[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))];
+  /** The netlink header */
+  struct nlmsghdr *header = (struct nlmsghdr *) buf;
+  /** The connector header */
+  struct cn_msg *message = NLMSG_DATA(header);
+  /** The operation */
+  enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+  /** Address of the proc connector's multicast group */
+  struct sockaddr_nl addr;
+  /** The netlink socket */
+  int sock = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_CONNECTOR);
+  
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = CN_IDX_PROC;
+  addr.nl_pid = getpid();
+  if(sock < 0 || bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0){
+    perror("proc connector");
+    exit(EXIT_FAILURE);
   }
-  if(bitmap & 4){
-    printf("address\t");
+  memset(buf, 0, sizeof(buf));
+  header->nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(op));
+  header->nlmsg_type = NLMSG_DONE;
+  header->nlmsg_pid = getpid();
+  message->id.idx = CN_IDX_PROC;
+  message->id.val = CN_VAL_PROC;
+  message->len = sizeof(op);
+  memcpy(message->data, &op, sizeof(op));
+  if(send(sock, buf, header->nlmsg_len, 0) < 0){
+    perror("proc connector");
+    exit(EXIT_FAILURE);
   }
-  if(bitmap & 2){
-    printf("%8s\t", "time");
+  return sock;
+}
+
+/**
+ * Seeds a live process table from one scan of "/proc".
+ * @param table the process table, zeroed or already live
+ * @param threads the number of threads to parse stat files with
+ */
+void seedTable(struct ProcessTable *table, int threads)
+{
+  scanProcesses(table, threads);
+  buildTable(table);
+  liveRehash(table);
+}
+
+/**
+ * Decides whether a process that forked or executed is kept in the live
+ * table, which holds only processes matching the filter as far as it can be
+ * evaluated without the tree.
+ * @param table the live process table
+ * @param process the process, with its stat fields read
+ * @param name name of the process' directory in "/proc"
+ * @return whether the process is kept
+ */
+int keepEvent(struct ProcessTable *table, PID *process, const char *name)
+{
+  if(plan.uid){
+    readOwner(dirfd(table->proc), name, process);
   }
-  if(bitmap & 8){
-    printf("parent\t");
+  if(evalFilter(process, STAGE_STAT) == FILTER_FALSE){
+    liveRemove(table, process->pid);
+    return 0;
   }
-  printf("\n");
+  return 1;
 }
 
 /**
- * Prints the PIDs based on user - specified options.
- * By default, the process id for each pid will always be printed
- * @param head the head of the list
+ * Tracks processes through the kernel's proc connector until the program is
+ * interrupted. The table is seeded from one scan of "/proc" taken after
+ * subscribing, so no process is missed; each fork, exec, and exit then
+ * updates it in O(1), reading only the stat file of the process concerned,
+ * and is printed with the process. Events for threads other than a process'
+ * main thread are ignored, and so are processes the filter rejects. If the
+ * kernel drops events because they arrived faster than they were read, the
+ * table is seeded again.
  * @param bitmap the bitmap field in which to check selected options
+ * @param threads the number of threads to parse the seeding scan with
  */
-void printPIDs(Node *head, int bitmap)
+void trackEvents(int bitmap, int threads)
 {
-  // Print the user - specified information for each process id
-  for(Node *n = head; n; n = n->next){
-    // Print the process id
-    printf("%d\t", n->value.pid);
-    // Check the bitflags for printing appropriate arguments
-    if(bitmap & 1) { // process name
-      // Print the process name
-      printf("%s\t", n->value.pname);
+  /** The live processes */
+  struct ProcessTable table;
+  /** The netlink socket events arrive on */
+  int sock = subscribeEvents();
+  /** Buffer for received messages, aligned for netlink headers */
+  long buf[EVENT_BUF_LEN / sizeof(long)];
+  
+  memset(&table, 0, sizeof(table));
+  seedTable(&table, threads);
+  printHeader(bitmap);
+  for(size_t i = 0; i < table.count; i++){
+    printPID(&table.records[i], bitmap, 0, 0, "live");
+  }
+  flushOutput();
+  
+  while(1){
+    /** Length of the messages received */
+    ssize_t len = recv(sock, buf, sizeof(buf), 0);
+    if(len < 0 && errno == ENOBUFS){
+      // Events were lost, so the table may be stale
+      seedTable(&table, threads);
+      fprintf(stderr, "Events lost; rescanned %zu processes\n", table.count);
+      continue;
+    } else if(len < 0){
+      if(errno == EINTR){
+        continue;
+      }
+      perror("recv");
+      break;
     }
-    if(bitmap & 4){ // process addresses above and below
-      // Print the process address
-      printf("%lu, %lu\t", n->value.above, n->value.below);
+    for(struct nlmsghdr *header = (struct nlmsghdr *) buf; NLMSG_OK(header, (size_t) len);
+        header = NLMSG_NEXT(header, len)){
+      /** The connector message */
+      struct cn_msg *message = NLMSG_DATA(header);
+      /** The event */
+      struct proc_event *event = (struct proc_event *) message->data;
+      /** The process concerned */
+      PID *process;
+      /** Name of the process' directory in "/proc" */
+      char name[NAME_LEN];
+      
+      if(header->nlmsg_type != NLMSG_DONE || message->id.idx != CN_IDX_PROC){
+        continue;
+      }
+      switch(event->what){
+        case PROC_EVENT_FORK:
+          if(event->event_data.fork.child_pid != event->event_data.fork.child_tgid){
+            break;
+          }
+          process = liveAdd(&table, event->event_data.fork.child_pid);
+          snprintf(name, sizeof(name), "%d", process->pid);
+          // Until it can be read, the child looks like its parent; a child
+          // that already exited, of a parent not in the table, is dropped
+          if(readStat(dirfd(table.proc), name, process) < 0){
+            size_t parent = *probe(&table, event->event_data.fork.parent_tgid);
+            if(parent == NO_NODE){
+              liveRemove(&table, process->pid);
+              break;
+            }
+            if(plan.name){
+              strcpy(process->pname, table.records[parent].pname);
+            }
+            process->parid = event->event_data.fork.parent_tgid;
+          }
+          if(!keepEvent(&table, process, name)){
+            break;
+          }
+          printPID(process, bitmap, 0, 0, "fork");
+          break;
+        case PROC_EVENT_EXEC:
+          process = liveAdd(&table, event->event_data.exec.process_tgid);
+          snprintf(name, sizeof(name), "%d", process->pid);
+          // A process that exited before its new image could be read is dropped
+          if(readStat(dirfd(table.proc), name, process) < 0){
+            liveRemove(&table, process->pid);
+            break;
+          }
+          if(!keepEvent(&table, process, name)){
+            break;
+          }
+          printPID(process, bitmap, 0, 0, "exec");
+          break;
+        case PROC_EVENT_EXIT:
+          if(event->event_data.exit.process_pid != event->event_data.exit.process_tgid
+             || *probe(&table, event->event_data.exit.process_pid) == NO_NODE){
+            break;
+          }
+          process = liveAdd(&table, event->event_data.exit.process_pid);
+          printPID(process, bitmap, 0, 0, "exit");
+          liveRemove(&table, process->pid);
+          break;
+        default:
+          break;
+      }
     }
-    if(bitmap & 2){ // process schedule time
-      // Print the schedule time in user mode
-      printf("%lu\t", n->value.time);
+    flushOutput();
+  }
+  close(sock);
+  freeTable(&table);
+}
+
+/**
+ * Makes room in a byte buffer.
+ * @param buf the buffer
+ * @param n the number of bytes needed
+ */
+void growBuffer(struct ByteBuffer *buf, size_t n)
+{
+  if(buf->len + n > buf->capacity){
+    buf->capacity = 2 * (buf->len + n);
+    buf->data = realloc(buf->data, buf->capacity);
+  }
+}
+
+/**
+ * Appends an unsigned varint: seven bits per byte, low bits first, with the
+ * high bit set on every byte but the last.
+ * @param buf the buffer, with room for 10 bytes
+ * @param value the value
+ */
+void putVarint(struct ByteBuffer *buf, uint64_t value)
+{
+  while(value >= 0x80){
+    buf->data[buf->len++] = (unsigned char) (value | 0x80);
+    value >>= 7;
+  }
+  buf->data[buf->len++] = (unsigned char) value;
+}
+
+/**
+ * Appends a signed difference as a zigzag varint, so small differences of
+ * either sign take one byte.
+ * @param buf the buffer, with room for 10 bytes
+ * @param value the difference
+ */
+void putZigzag(struct ByteBuffer *buf, int64_t value)
+{
+  putVarint(buf, ((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+}
+
+/**
+ * Reads an unsigned varint.
+ * @param pos the position to read at, advanced past the varint
+ * @param end the end of the data
+ * @return the value; *pos is set to NULL if the data ends first
+ */
+uint64_t getVarint(const unsigned char **pos, const unsigned char *end)
+{
+  /** The value */
+  uint64_t value = 0;
+  
+  for(int shift = 0; *pos != NULL && shift < 64; shift += 7){
+    if(*pos == end){
+      *pos = NULL;
+      break;
     }
-    if(bitmap & 8){ // process' parent id 
-      // Print the process' parent id
-      printf("%d\t", n->value.parid);
+    /** The byte */
+    unsigned char byte = *(*pos)++;
+    value |= (uint64_t) (byte & 0x7f) << shift;
+    if(!(byte & 0x80)){
+      return value;
     }
-    // End bit flag search
-    printf("\n");
   }
+  *pos = NULL;
+  return 0;
 }
 
 /**
- * Returns the process id for this process
- * @param stat the stat file for the current process identifier
- * @return the process id
+ * Reads a zigzag varint.
+ * @param pos the position to read at, advanced past the varint
+ * @param end the end of the data
+ * @return the value; *pos is set to NULL if the data ends first
  */
-int getProcessID(FILE *stat){
-  /** The process id of this process */
-  int pid;
-  fscanf(stat, "%d", &pid);
-  return pid;
+int64_t getZigzag(const unsigned char **pos, const unsigned char *end)
+{
+  /** The encoded value */
+  uint64_t value = getVarint(pos, end);
+  return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
 }
 
 /**
- * Returns the program name for this process
- * @param stat the stat file for the current process identifier
- * @return the program name for this process
+ * Orders processes by process id.
+ * @param a the first process
+ * @param b the second process
+ * @return negative, zero, or positive as a sorts before, with, or after b
  */
-void getProcessName(FILE *stat, PID *process)
+int comparePID(const void *a, const void *b)
 {
-  /** The program name for this process */
-  char name[300];
-  // Scan stat file for program name
-  fscanf(stat, "%s ", name);
-  strcpy(process->pname, name);
+  return ((const PID *) a)->pid - ((const PID *) b)->pid;
 }
 
 /**
- * Returns the parent id for this process.
- * @param stat the stat file for the current process identifier
- * @return the parent of id for this process
+ * Appends the processes of a snapshot, each stored whole or as its changes
+ * since the previous snapshot.
+ * @param buf the buffer
+ * @param cur the processes, in pid order
+ * @param count the number of processes
+ * @param prev the previous snapshot's processes, in pid order, or NULL for a keyframe
+ * @param prevCount the number of processes in the previous snapshot
  */
-int getParentID(FILE *stat)
+void encodeSnapshot(struct ByteBuffer *buf, const PID *cur, size_t count, const PID *prev, size_t prevCount)
 {
-  /** The parent id for this process */
-  int parid;
-  fscanf(stat, "%*c %d", &parid);
-  return parid;
+  /** Position in the previous snapshot */
+  size_t j = 0;
+  /** The previous process' id */
+  int lastPid = 0;
+  
+  for(size_t i = 0; i < count; i++){
+    /** The process */
+    const PID *process = &cur[i];
+    /** Length of the name */
+    size_t nameLen = strlen(process->pname);
+    /** Flags of the process */
+    int flags = 0;
+    growBuffer(buf, 8 * 10 + 2 + nameLen);
+    while(prev != NULL && j < prevCount && prev[j].pid < process->pid){
+      j++;
+    }
+    /** The same process in the previous snapshot, unless its id was reused */
+    const PID *old = prev != NULL && j < prevCount && prev[j].pid == process->pid
+                     && prev[j].start == process->start ? &prev[j] : NULL;
+    putVarint(buf, (uint64_t) (process->pid - lastPid));
+    lastPid = process->pid;
+    if(old == NULL || process->time < old->time || process->stime < old->stime){
+      buf->data[buf->len++] = SNAP_NEW;
+      putVarint(buf, (uint64_t) process->parid);
+      putVarint(buf, process->start);
+      putVarint(buf, process->time);
+      putVarint(buf, process->stime);
+      putVarint(buf, process->rss);
+      putVarint(buf, (uint64_t) process->threads);
+      buf->data[buf->len++] = process->state;
+      putVarint(buf, nameLen);
+      memcpy(buf->data + buf->len, process->pname, nameLen);
+      buf->len += nameLen;
+      continue;
+    }
+    flags |= process->parid != old->parid ? SNAP_PPID : 0;
+    flags |= process->time != old->time ? SNAP_UTIME : 0;
+    flags |= process->stime != old->stime ? SNAP_STIME : 0;
+    flags |= process->rss != old->rss ? SNAP_RSS : 0;
+    flags |= process->threads != old->threads ? SNAP_THREADS : 0;
+    flags |= process->state != old->state ? SNAP_STATE : 0;
+    flags |= strcmp(process->pname, old->pname) != 0 ? SNAP_NAME : 0;
+    buf->data[buf->len++] = (unsigned char) flags;
+    if(flags & SNAP_PPID){
+      putVarint(buf, (uint64_t) process->parid);
+    }
+    if(flags & SNAP_UTIME){
+      putVarint(buf, process->time - old->time);
+    }
+    if(flags & SNAP_STIME){
+      putVarint(buf, process->stime - old->stime);
+    }
+    if(flags & SNAP_RSS){
+      putZigzag(buf, (int64_t) process->rss - (int64_t) old->rss);
+    }
+    if(flags & SNAP_THREADS){
+      putZigzag(buf, process->threads - old->threads);
+    }
+    if(flags & SNAP_STATE){
+      buf->data[buf->len++] = process->state;
+    }
+    if(flags & SNAP_NAME){
+      putVarint(buf, nameLen);
+      memcpy(buf->data + buf->len, process->pname, nameLen);
+      buf->len += nameLen;
+    }
+  }
 }
 
 /**
- * Returns the schedule time in user mode for this process
- * @param stat the stat file for the current process identifier
- * @return the schedule time in user mode for this process
+ * Decodes one snapshot from a snapshot file.
+ * @param header the snapshot's header, followed by its processes
+ * @param end the end of the snapshot file
+ * @param prev the previous snapshot, unused for a keyframe
+ * @param snap the snapshot to decode into
+ * @return 0 on success, or -1 if the snapshot is truncated or malformed
  */
-int getUserTime(FILE *stat)
+int decodeSnapshot(const unsigned char *header, const unsigned char *end, const struct Snapshot *prev,
+                   struct Snapshot *snap)
 {
-  /** The scheduled time in user mode for this process */
-  unsigned long time;
-  fscanf(stat, "%*d %*d %*d %*d %*u %*u %*u %*u %*u %lu", &time);
-  return time;
+  /** The header */
+  struct SnapHeader head;
+  
+  if(end - header < (long) sizeof(head)){
+    return -1;
+  }
+  memcpy(&head, header, sizeof(head));
+  if(memcmp(head.magic, "SNAP", 4) != 0 || (size_t) (end - header) - sizeof(head) < head.length){
+    return -1;
+  }
+  /** Position in the processes */
+  const unsigned char *pos = header + sizeof(head);
+  /** End of the processes */
+  const unsigned char *stop = pos + head.length;
+  /** Position in the previous snapshot */
+  size_t j = 0;
+  /** The previous process' id */
+  int lastPid = 0;
+  
+  if(head.count > snap->capacity){
+    snap->capacity = head.count;
+    snap->records = (PID *) realloc(snap->records, snap->capacity * sizeof(PID));
+  }
+  snap->time = head.time;
+  snap->count = 0;
+  while(snap->count < head.count){
+    /** The process */
+    PID *process = &snap->records[snap->count];
+    /** The process' id */
+    int pid = lastPid + (int) getVarint(&pos, stop);
+    if(pos == NULL || pos == stop){
+      return -1;
+    }
+    lastPid = pid;
+    /** Flags of the process */
+    int flags = *pos++;
+    /** Length of the name, if stored */
+    uint64_t nameLen;
+    if(flags & SNAP_NEW){
+      memset(process, 0, sizeof(*process));
+      process->pid = pid;
+      process->parid = (int) getVarint(&pos, stop);
+      process->start = getVarint(&pos, stop);
+      process->time = getVarint(&pos, stop);
+      process->stime = getVarint(&pos, stop);
+      process->rss = getVarint(&pos, stop);
+      process->threads = (long) getVarint(&pos, stop);
+      if(pos == NULL || pos == stop){
+        return -1;
+      }
+      process->state = (char) *pos++;
+      flags |= SNAP_NAME;
+    } else {
+      while(j < prev->count && prev->records[j].pid < pid){
+        j++;
+      }
+      if(head.keyframe || j == prev->count || prev->records[j].pid != pid){
+        return -1;
+      }
+      *process = prev->records[j];
+      if(flags & SNAP_PPID){
+        process->parid = (int) getVarint(&pos, stop);
+      }
+      if(flags & SNAP_UTIME){
+        process->time += getVarint(&pos, stop);
+      }
+      if(flags & SNAP_STIME){
+        process->stime += getVarint(&pos, stop);
+      }
+      if(flags & SNAP_RSS){
+        process->rss += getZigzag(&pos, stop);
+      }
+      if(flags & SNAP_THREADS){
+        process->threads += getZigzag(&pos, stop);
+      }
+      if((flags & SNAP_STATE) && pos != NULL && pos != stop){
+        process->state = (char) *pos++;
+      }
+    }
+    if(flags & SNAP_NAME){
+      nameLen = getVarint(&pos, stop);
+      if(pos == NULL || nameLen >= sizeof(process->pname) || (uint64_t) (stop - pos) < nameLen){
+        return -1;
+      }
+      memcpy(process->pname, pos, nameLen);
+      process->pname[nameLen] = '\0';
+      pos += nameLen;
+    }
+    if(pos == NULL){
+      return -1;
+    }
+    snap->count++;
+  }
+  return 0;
 }
 
 /**
- * Returns the address above and below which the program
- * text can run.
- * @param stat the stat file for the current process identifier
- * @param process struct representing the process' addresses to modify
+ * Opens a file for appending, writing its header if it is new.
+ * @param path the file
+ * @param header the header, or NULL for none
+ * @param len the length of the header
+ * @return the file descriptor
  */
-void getAddresses(FILE *stat, PID *process)
+int openAppend(const char *path, const void *header, size_t len)
 {
-  /** Address above which the program can run */
-  unsigned long abv;
-  /** Address below which the program can run */
-  unsigned long blw;
+  /** The file */
+  int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
   
-  // Scan addresses from stat and assign these values for this process
-  fscanf(stat, "%*u %*d %*d %*d %*d %*d %*d %*u %*u %*d %*u %lu %lu", &abv, &blw);
-  process->above = abv;
-  process->below = blw;
+  if(fd < 0){
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  if(lseek(fd, 0, SEEK_END) == 0 && len > 0 && write(fd, header, len) != (ssize_t) len){
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  return fd;
 }
 
 /**
- * Insert method for the list of PIDs. PIDs are ordered based
- * on their respective parent ids in ascending order.
- * @param head the head of the list
- * @param process the PID to insert into the list
+ * Appends snapshots of the process table to a snapshot file and its index,
+ * once or every interval until the program is interrupted. The first
+ * snapshot of each run, and every KEYFRAME_EVERY-th after it, stores every
+ * process whole; the others store only what changed since the previous one.
+ * Each snapshot is written with one write(), followed by its index entry, so
+ * a reader never finds an index entry for a snapshot that is not all there.
+ * @param path the snapshot file
+ * @param threads the number of threads to parse stat files with
+ * @param interval the seconds between snapshots, or 0 for a single one
  */
-Node *insert(Node *head, PID process)
+void recordSnapshots(const char *path, int threads, double interval)
 {
-  /** The next node in the list */
-  Node *n = (Node *) malloc(sizeof(Node));
+  /** Header of a new snapshot file */
+  struct SnapFileHeader fileHeader = { { 'P', 'I', 'D', 'S' }, 1 };
+  /** The snapshot file */
+  int fd = openAppend(path, &fileHeader, sizeof(fileHeader));
+  /** Path of the index */
+  char *indexPath = malloc(strlen(path) + 5);
+  /** The process table, scanned again for each snapshot */
+  struct ProcessTable table;
+  /** The previous snapshot's processes, in pid order */
+  struct Snapshot prev;
+  /** The encoded snapshot */
+  struct ByteBuffer buf;
+  /** Time between snapshots */
+  struct timespec pause = { (time_t) interval, (long) ((interval - (time_t) interval) * 1e9) };
+  /** Offset of the last keyframe */
+  uint64_t keyOffset = 0;
   
-  // Special case head is NULL
-  if(head == NULL){
-    n->value = process;
-    n->next = NULL;
-    head = n;
-    return head;
+  sprintf(indexPath, "%s.idx", path);
+  /** The index */
+  int indexFd = openAppend(indexPath, NULL, 0);
+  memset(&table, 0, sizeof(table));
+  memset(&prev, 0, sizeof(prev));
+  memset(&buf, 0, sizeof(buf));
+  for(unsigned long n = 0; ; n++){
+    /** Time of the snapshot */
+    struct timespec now;
+    scanProcesses(&table, threads);
+    clock_gettime(CLOCK_REALTIME, &now);
+    qsort(table.records, table.count, sizeof(PID), comparePID);
+    
+    // Encode the snapshot after room for its header, then fill the header in
+    /** Whether the snapshot stores every process whole */
+    int keyframe = n % KEYFRAME_EVERY == 0;
+    /** The header */
+    struct SnapHeader head = { { 'S', 'N', 'A', 'P' }, 0, (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec,
+                               (uint32_t) table.count, (uint32_t) keyframe };
+    buf.len = 0;
+    growBuffer(&buf, sizeof(head));
+    buf.len = sizeof(head);
+    encodeSnapshot(&buf, table.records, table.count, keyframe ? NULL : prev.records, prev.count);
+    head.length = (uint32_t) (buf.len - sizeof(head));
+    memcpy(buf.data, &head, sizeof(head));
+    /** Offset of the snapshot */
+    uint64_t offset = (uint64_t) lseek(fd, 0, SEEK_END);
+    keyOffset = keyframe ? offset : keyOffset;
+    /** The snapshot's index entry */
+    struct SnapIndex entry = { head.time, offset, keyOffset };
+    if(write(fd, buf.data, buf.len) != (ssize_t) buf.len || write(indexFd, &entry, sizeof(entry)) != sizeof(entry)){
+      perror(path);
+      exit(EXIT_FAILURE);
+    }
+    
+    // The table's records become the previous snapshot
+    if(table.count > prev.capacity){
+      prev.capacity = table.capacity;
+      prev.records = (PID *) realloc(prev.records, prev.capacity * sizeof(PID));
+    }
+    memcpy(prev.records, table.records, table.count * sizeof(PID));
+    prev.count = table.count;
+    if(interval <= 0){
+      break;
+    }
+    nanosleep(&pause, NULL);
   }
+  close(fd);
+  close(indexFd);
+  free(indexPath);
+  free(prev.records);
+  free(buf.data);
+  freeTable(&table);
+}
+
+/**
+ * Maps a whole file into memory, read only.
+ * @param path the file
+ * @param len receives the length of the file
+ * @return the mapping, or NULL if the file is empty
+ */
+const unsigned char *mapFile(const char *path, size_t *len)
+{
+  /** The file */
+  int fd = open(path, O_RDONLY);
+  /** Status of the file */
+  struct stat st;
   
-  /** The current node */
-  Node *current = head;
+  if(fd < 0 || fstat(fd, &st) < 0){
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  *len = st.st_size;
+  /** The mapping */
+  void *map = *len > 0 ? mmap(NULL, *len, PROT_READ, MAP_SHARED, fd, 0) : NULL;
+  close(fd);
+  if(map == MAP_FAILED){
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  return map;
+}
+
+/**
+ * Decodes the snapshot in effect at a time: the last one taken at or before
+ * it. The index is binary searched for the snapshot, which is decoded from
+ * its keyframe on, so no more than KEYFRAME_EVERY snapshots are read.
+ * Snapshots the file ends partway through are ignored.
+ * @param data the snapshot file
+ * @param len the length of the snapshot file
+ * @param index the index
+ * @param entries the number of index entries
+ * @param time the time, in nanoseconds since the Unix epoch
+ * @param snap the snapshot to decode into
+ * @return 0 on success, or -1 if no snapshot was taken by the time
+ */
+int openSnapshot(const unsigned char *data, size_t len, const struct SnapIndex *index, size_t entries,
+                 uint64_t time, struct Snapshot *snap)
+{
+  /** First entry after the time */
+  size_t lo = 0;
+  /** Upper bound of the search */
+  size_t hi = entries;
+  /** The previous snapshot, while decoding up to the one wanted */
+  struct Snapshot prev;
   
-  // Assign the PID to the correct position in the list
-  while(current != NULL){
-    // Check for equal process id and parent id
-    if(current->value.parid == process.parid){
-      while(current->next != NULL && current->next->value.parid == process.parid){
-        current = current->next;
+  // Leave out snapshots cut short, as by a recorder killed while writing one
+  while(hi > 0){
+    /** The last snapshot's header */
+    struct SnapHeader head;
+    if(index[hi - 1].offset + sizeof(head) <= len){
+      memcpy(&head, data + index[hi - 1].offset, sizeof(head));
+      if(index[hi - 1].offset + sizeof(head) + head.length <= len){
+        break;
       }
-      // This works
-      n->value = process;
-      n->next = current->next;
-      current->next = n;
-      return head;
     }
-    
-    // Special condition if the end is reached
-    if (current->next == NULL){
+    hi--;
+  }
+  while(lo < hi){
+    size_t mid = lo + (hi - lo) / 2;
+    if(index[mid].time <= time){
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if(lo == 0){
+    return -1;
+  }
+  /** The entry of the snapshot */
+  const struct SnapIndex *entry = &index[lo - 1];
+  /** Offset of the snapshot being decoded */
+  uint64_t offset = entry->keyOffset;
+  memset(&prev, 0, sizeof(prev));
+  while(1){
+    /** The snapshot's header */
+    struct SnapHeader head;
+    if(offset >= len || decodeSnapshot(data + offset, data + len, &prev, snap) < 0){
+      free(prev.records);
+      return -1;
+    }
+    if(offset == entry->offset){
       break;
     }
-    
-    // Update current to the next node
-    current = current->next;
+    memcpy(&head, data + offset, sizeof(head));
+    offset += sizeof(head) + head.length;
+    // The decoded snapshot becomes the previous one
+    struct Snapshot swap = prev;
+    prev = *snap;
+    *snap = swap;
+  }
+  free(prev.records);
+  return 0;
+}
+
+/**
+ * Prints what changed between two snapshots: processes that are new, that
+ * exited, or whose parent changed, and the CPU usage of every process that
+ * used any, as events with the process.
+ * @param prev the earlier snapshot
+ * @param cur the later snapshot
+ * @param bitmap the bitmap field in which to check selected options
+ */
+void printDiff(const struct Snapshot *prev, struct Snapshot *cur, int bitmap)
+{
+  /** Position in the earlier snapshot */
+  size_t j = 0;
+  /** Seconds between the snapshots */
+  double elapsed = (cur->time - prev->time) / 1e9;
+  
+  if(format == FORMAT_TEXT){
+    putFormat("== %.3f (+%.3f s)\n", cur->time / 1e9, elapsed);
+  }
+  for(size_t i = 0; i <= cur->count; i++){
+    /** The process in the later snapshot, or NULL once they are all done */
+    PID *process = i < cur->count ? &cur->records[i] : NULL;
+    // Processes of the earlier snapshot before this one exited
+    while(j < prev->count && (process == NULL || prev->records[j].pid < process->pid
+          || (prev->records[j].pid == process->pid && prev->records[j].start != process->start))){
+      printPID(&prev->records[j], bitmap, 0, 0, "exit");
+      if(process != NULL && prev->records[j].pid == process->pid){
+        j++;
+        break;
+      }
+      j++;
+    }
+    if(process == NULL){
+      break;
+    }
+    if(j == prev->count || prev->records[j].pid != process->pid){
+      process->cpu = 0;
+      printPID(process, bitmap, 0, 0, "new");
+      continue;
+    }
+    /** The same process in the earlier snapshot */
+    const PID *old = &prev->records[j++];
+    /** Ticks used between the snapshots */
+    unsigned long used = process->time + process->stime - old->time - old->stime;
+    process->cpu = elapsed > 0 ? 100.0 * used / clockTicks / elapsed : 0;
+    if(process->parid != old->parid){
+      printPID(process, bitmap, 0, 0, "reparent");
+    }
+    if(used > 0){
+      printPID(process, bitmap, 0, 0, "cpu");
+    }
   }
+}
+
+/**
+ * Parses a time given in seconds since the Unix epoch.
+ * @param text the time
+ * @return the time, in nanoseconds since the Unix epoch
+ */
+uint64_t parseTime(const char *text)
+{
+  return (uint64_t) (strtod(text, NULL) * 1e9);
+}
+
+/**
+ * Replays a snapshot file. Without times, prints what changed between each
+ * snapshot and the next. With one time, "<secs>", lists the processes of the
+ * snapshot in effect then like a live listing; with two, "<secs>,<secs>",
+ * prints what changed between the snapshots in effect at each. Times are in
+ * seconds since the Unix epoch.
+ * @param path the snapshot file
+ * @param times the times, or NULL
+ * @param bitmap the bitmap field in which to check selected options
+ */
+void replaySnapshots(const char *path, const char *times, int bitmap)
+{
+  /** Length of the snapshot file */
+  size_t len;
+  /** The snapshot file */
+  const unsigned char *data = mapFile(path, &len);
+  /** The two snapshots compared */
+  struct Snapshot snaps[2];
   
-  // PID to add does not match any previous PIDs, so add to end of list
-  n->value = process;
-  n->next = NULL;
-  current->next = n;
+  memset(snaps, 0, sizeof(snaps));
+  if(len < sizeof(struct SnapFileHeader) || memcmp(data, "PIDS", 4) != 0){
+    fprintf(stderr, "%s is not a snapshot file\n", path);
+    exit(EXIT_FAILURE);
+  }
+  if(times == NULL){
+    // Decode every snapshot in order, each against the one before
+    /** Offset of the next snapshot */
+    size_t offset = sizeof(struct SnapFileHeader);
+    printHeader(bitmap);
+    for(int n = 0; offset < len && decodeSnapshot(data + offset, data + len, &snaps[n % 2 ? 0 : 1], &snaps[n % 2]) == 0;
+        n++){
+      /** The snapshot's header */
+      struct SnapHeader head;
+      if(n > 0){
+        printDiff(&snaps[n % 2 ? 0 : 1], &snaps[n % 2], bitmap);
+      }
+      memcpy(&head, data + offset, sizeof(head));
+      offset += sizeof(head) + head.length;
+    }
+  } else {
+    /** Path of the index */
+    char *indexPath = malloc(strlen(path) + 5);
+    /** Length of the index */
+    size_t indexLen;
+    sprintf(indexPath, "%s.idx", path);
+    /** The index */
+    const struct SnapIndex *index = (const struct SnapIndex *) mapFile(indexPath, &indexLen);
+    /** Number of index entries */
+    size_t entries = indexLen / sizeof(struct SnapIndex);
+    /** The second time, if given */
+    const char *second = strchr(times, ',');
+    if(openSnapshot(data, len, index, entries, parseTime(times), &snaps[0]) < 0
+       || (second != NULL && openSnapshot(data, len, index, entries, parseTime(second + 1), &snaps[1]) < 0)){
+      fprintf(stderr, "No snapshot was taken by then\n");
+      exit(EXIT_FAILURE);
+    }
+    printHeader(bitmap);
+    if(second != NULL){
+      printDiff(&snaps[0], &snaps[1], bitmap);
+    } else {
+      // List the snapshot like a live scan
+      /** The snapshot as a process table */
+      struct ProcessTable table;
+      memset(&table, 0, sizeof(table));
+      table.records = snaps[0].records;
+      table.count = snaps[0].count;
+      table.capacity = snaps[0].capacity;
+      snaps[0].records = NULL;
+      buildTable(&table);
+      filterTree(&table);
+      if(bitmap & 16){
+        printTree(&table, bitmap);
+      } else {
+        printPIDs(&table, bitmap);
+      }
+      freeTable(&table);
+    }
+    if(indexLen > 0){
+      munmap((void *) index, indexLen);
+    }
+    free(indexPath);
+  }
+  flushOutput();
+  free(snaps[0].records);
+  free(snaps[1].records);
+  munmap((void *) data, len);
+}
+
+/**
+ * Returns the seconds elapsed since a time, and sets the time to now.
+ * @param since the time
+ * @return the seconds elapsed
+ */
+double lap(struct timespec *since)
+{
+  /** The time now */
+  struct timespec now;
+  /** Seconds elapsed */
+  double elapsed;
   
-  //Return head node
-  return head;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  elapsed = (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+  *since = now;
+  return elapsed;
 }
 
 /**
- * Opens the "/proc" directory in the system and reads through each directory,
- * retrieving the process' id, program name, associated addresses, parent id,
- * and schedule time in user mode. The current process is then inserted into
- * the list of processes based on matching parent ids. The list of processes
- * is then printed once complete.
+ * Lists the processes several times like handleArguments(), timing each
+ * stage: listing the directory, parsing the stat files, building the tree,
+ * and writing the output. Parsing is timed as the rest of the scan after the
+ * listing, which is timed alone first. The fastest time of each stage is
+ * reported on standard error with the processes handled per second, so the
+ * listings themselves may be sent to /dev/null. Later runs reuse the table
+ * as monitor mode does.
  * @param bitmap the bitmap field in which to check selected options
+ * @param threads the number of threads to parse stat files with
+ * @param runs the number of times to list the processes
  */
-void handleArguments(int bitmap)
+void benchmark(int bitmap, int threads, int runs)
 {
-  /** Head of the linked list */
-  Node *head = NULL;
-  //open proc directory
-  DIR *proc = opendir("/proc");
-  /** The current directory accessed */
-  struct dirent *current = readdir(proc);
+  /** The processes and their hierarchy */
+  struct ProcessTable table;
+  /** Names of the stages */
+  static const char *stages[] = { "scan", "parse", "tree", "output" };
+  /** Fastest time of each stage */
+  double best[4] = { 1e30, 1e30, 1e30, 1e30 };
+  /** Time of each stage in the current run */
+  double took[4];
   
-  // Access available directories
-  while(current){
-    
-    // Check the current directory name for appropriate format
-    if(isdigit(current->d_name[0])){
-      
-      /** Name of the process directory */
-      char pdir[256];
-      /** Struct representing this process id */
-      PID process;
-      
-      // Create the process directory for reading
-      strcpy(pdir, "/proc/");
-      strcat(pdir, current->d_name);
-      strcat(pdir, "/stat");
-      /** The process directory */
-      FILE *stat;
-      //Open the process directory
-      stat = fopen(pdir, "r");
-    
-      // Get all desirable information for this process
-      // Get the process id for this directory
-      // To be updated
-      process.pid = getProcessID(stat);
-      // Get the process name
-      getProcessName(stat, &process);
-      // Get the parent id
-      process.parid = getParentID(stat);
-      // Get the schedule time (user mode)
-      process.time = getUserTime(stat);
-      // Get the process' addresses
-      getAddresses(stat, &process);
-      
-      // Assert the current Process identifier in the list of PIDs
-      head = insert(head, process);
-      // Close the current stat file
-      fclose(stat);
+  memset(&table, 0, sizeof(table));
+  for(int run = 0; run < runs; run++){
+    /** Start of the current stage */
+    struct timespec since;
+    /** The directory, listed alone */
+    DIR *dir;
+    clock_gettime(CLOCK_MONOTONIC, &since);
+    if((dir = opendir(procRoot)) == NULL){
+      perror(procRoot);
+      exit(EXIT_FAILURE);
     }
-    // open the next available directory
-    current = readdir(proc);
+    while(readdir(dir) != NULL){
+    }
+    closedir(dir);
+    took[0] = lap(&since);
+    scanProcesses(&table, threads);
+    took[1] = lap(&since);
+    buildTable(&table);
+    filterTree(&table);
+    took[2] = lap(&since);
+    if(bitmap & 16){
+      printTree(&table, bitmap);
+    } else {
+      printPIDs(&table, bitmap);
+    }
+    flushOutput();
+    took[3] = lap(&since);
+    // The listing is part of the scan, too
+    took[1] = took[1] > took[0] ? took[1] - took[0] : 0;
+    for(int stage = 0; stage < 4; stage++){
+      best[stage] = took[stage] < best[stage] ? took[stage] : best[stage];
+    }
+  }
+  fprintf(stderr, "%zu processes from %s, best of %d runs with %d thread%s\n", table.count, procRoot, runs,
+          threads, threads == 1 ? "" : "s");
+  for(int stage = 0; stage < 4; stage++){
+    fprintf(stderr, "%-8s%10.3f ms%14.0f processes/s\n", stages[stage], best[stage] * 1e3,
+            best[stage] > 0 ? table.count / best[stage] : 0);
   }
+  freeTable(&table);
+}
+
+/**
+ * Lists the processes in the system, grouped by parent id or, with the "-t"
+ * option, as a tree, based on user - specified options.
+ * @param bitmap the bitmap field in which to check selected options
+ * @param threads the number of threads to parse stat files with
+ */
+void handleArguments(int bitmap, int threads)
+{
+  /** The processes and their hierarchy */
+  struct ProcessTable table;
   
+  memset(&table, 0, sizeof(table));
+  scanProcesses(&table, threads);
+  buildTable(&table);
+  filterTree(&table);
   // Print out the list of processes
-  printPIDs(head, bitmap);
-  
-  // Free all the nodes
-  while(head){
-    Node *next = head->next;
-    free(head);
-    head = next;
+  if(bitmap & 16){
+    printTree(&table, bitmap);
+  } else {
+    printPIDs(&table, bitmap);
   }
-  // free memory
-  free(current);
+  flushOutput();
+  freeTable(&table);
 }
  
+/**
+ * Plans the files and fields every scan reads from the selected options.
+ * The parent id and state are always read, as listings are grouped by parent.
+ * @param bitmap the bitmap field in which to check selected options
+ */
+void planFields(int bitmap)
+{
+  plan.name = (bitmap & 1) != 0;
+  plan.statm = (bitmap & 128) != 0;
+  plan.maxField = STAT_PPID;
+  if(bitmap & 2){
+    plan.maxField = STAT_UTIME;
+  }
+  // The monitor needs both times, and the start time to detect reused ids
+  if(bitmap & 256){
+    plan.maxField = STAT_STIME;
+  }
+  if(bitmap & 512){
+    plan.maxField = STAT_THREADS;
+  }
+  if(bitmap & (2048 | 32)){
+    plan.maxField = STAT_STARTTIME;
+  }
+  if(bitmap & 4){
+    plan.maxField = STAT_ENDCODE;
+  }
+  // Read what the filter compares, too
+  for(int t = 0; t < filter.termCount; t++){
+    /** Name of the field compared */
+    const char *field = filterFields[filter.terms[t].field];
+    /** Highest stat field the term needs */
+    int needs = STAT_PPID;
+    plan.uid |= strcmp(field, "uid") == 0;
+    plan.name |= strcmp(field, "name") == 0;
+    plan.statm |= strcmp(field, "rss") == 0;
+    if(strcmp(field, "utime") == 0){
+      needs = STAT_UTIME;
+    } else if(strcmp(field, "stime") == 0 || strcmp(field, "time") == 0){
+      needs = STAT_STIME;
+    } else if(strcmp(field, "threads") == 0){
+      needs = STAT_THREADS;
+    }
+    if(needs > plan.maxField){
+      plan.maxField = needs;
+    }
+  }
+}
+
 /**
  * Main operation for the program. Handles system calls and checks user - specified
  * options for appropriate listing actions. Prints the header for the program based
@@ -330,11 +2857,23 @@ void handleArguments(int bitmap)
 int main(int argc, char *argv[])
 {
   /** Command line argument to process */
-  char *input = (char *) malloc(6 * sizeof(char));
+  char *input;
   /** index of current option */
   int i;
   /** bitmap to determine specified command line options */
   int bitmap = 0;
+  /** number of threads to parse stat files with */
+  int threads = 1;
+  /** seconds between refreshes in monitor mode */
+  double interval = 1;
+  /** snapshot file to capture to, or NULL */
+  const char *capture = NULL;
+  /** snapshot file to replay, or NULL */
+  const char *replay = NULL;
+  /** times to replay, or NULL for every snapshot */
+  const char *times = NULL;
+  /** number of benchmark runs, or 0 to list the processes once */
+  int runs = 0;
   
   // Check for incorrect argument format
   checkFormat(argc, argv);
@@ -343,7 +2882,7 @@ int main(int argc, char *argv[])
   for(int j = 1; j < argc; j++ ){
     
     // Determine if the current argument has any available option(s)
-    if((sscanf(argv[j], "%s", input) == 1)) {
+    if((input = argv[j]) != NULL) {
       // Point to the fist option in the argument
       i = 1;
       // Determine the type of option for each available in the argument
@@ -362,6 +2901,88 @@ int main(int argc, char *argv[])
           case 'p': // parent of process
             bitmap = bitmap | 8;
             break;
+          case 'r': // resident set size
+            bitmap = bitmap | 128;
+            break;
+          case 's': // schedule time in kernel mode
+            bitmap = bitmap | 256;
+            break;
+          case 'l': // number of threads
+            bitmap = bitmap | 512;
+            break;
+          case 'z': // process state
+            bitmap = bitmap | 1024;
+            break;
+          case 'b': // start time
+            bitmap = bitmap | 2048;
+            break;
+          case 'm': // monitor, with an optional refresh interval in seconds
+            bitmap = bitmap | 32;
+            if(isdigit(input[i + 1]) || input[i + 1] == '.'){
+              /** End of the interval */
+              char *end;
+              interval = strtod(&input[i + 1], &end);
+              i = (int) (end - input) - 1;
+            }
+            break;
+          case 'f': // output format, taking the rest of the argument
+            if(strcmp(&input[i + 1], "csv") == 0){
+              format = FORMAT_CSV;
+            } else if(strcmp(&input[i + 1], "json") == 0){
+              format = FORMAT_JSON;
+            } else if(strcmp(&input[i + 1], "bin") == 0){
+              format = FORMAT_BINARY;
+            } else {
+              fprintf(stderr, "Formats are csv, json, and bin.\n");
+              exit(EXIT_FAILURE);
+            }
+            i = (int) strlen(input) - 1;
+            break;
+          case 'w': // filter, taking the rest of the argument
+            compileFilter(&input[i + 1]);
+            i = (int) strlen(input) - 1;
+            break;
+          case 'c': // capture snapshots to a file, taking the rest of the argument
+            capture = &input[i + 1];
+            i = (int) strlen(input) - 1;
+            break;
+          case 'd': // replay a snapshot file, taking the rest of the argument
+            replay = &input[i + 1];
+            i = (int) strlen(input) - 1;
+            break;
+          case 'i': // times to replay, taking the rest of the argument
+            times = &input[i + 1];
+            i = (int) strlen(input) - 1;
+            break;
+          case 'P': // directory to list processes from, taking the rest of the argument
+            procRoot = &input[i + 1];
+            i = (int) strlen(input) - 1;
+            break;
+          case 'x': // benchmark, with an optional number of runs
+            runs = 10;
+            if(isdigit(input[i + 1])){
+              runs = atoi(&input[i + 1]);
+              while(isdigit(input[i + 1])){
+                i++;
+              }
+            }
+            break;
+          case 'e': // track fork, exec, and exit events
+            bitmap = bitmap | 64;
+            break;
+          case 't': // tree of processes with subtree sizes
+            bitmap = bitmap | 16;
+            break;
+          case 'j': // parallel scan, with an optional thread count
+            if(isdigit(input[i + 1])){
+              threads = atoi(&input[i + 1]);
+              while(isdigit(input[i + 1])){
+                i++;
+              }
+            } else {
+              threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+            }
+            break;
           default:
             bitmap = bitmap | 0;
         }
@@ -370,13 +2991,34 @@ int main(int argc, char *argv[])
       }
     }
   }
+  // Snapshots hold every field they can diff
+  if(capture != NULL){
+    planFields(bitmap | 1 | 2 | 8 | 128 | 256 | 512 | 2048);
+    recordSnapshots(capture, threads, bitmap & 32 ? (interval < 0.01 ? 0.01 : interval) : 0);
+    return EXIT_SUCCESS;
+  }
+  planFields(bitmap);
+  clockTicks = sysconf(_SC_CLK_TCK);
+  if(replay != NULL){
+    plan.name = 1;
+    replaySnapshots(replay, times, times != NULL && strchr(times, ',') == NULL ? bitmap : bitmap | 64 | 32);
+    return EXIT_SUCCESS;
+  }
+  // Track events or monitor until interrupted, refreshing at least every 10 ms
+  if(bitmap & 64){
+    trackEvents(bitmap, threads);
+    return EXIT_FAILURE;
+  } else if(bitmap & 32){
+    monitor(bitmap, threads, interval < 0.01 ? 0.01 : interval);
+  }
   // print appropriate headers
   printHeader(bitmap);
+  if(runs > 0){
+    benchmark(bitmap, threads, runs);
+    return EXIT_SUCCESS;
+  }
   // handle bit flag arguments
-  handleArguments(bitmap);
-  
-  // free memory
-  free(input);
+  handleArguments(bitmap, threads);
   
   //Return program exit status
   return EXIT_SUCCESS;